@@ -28,3 +28,15 @@ conn.GetNext([0], snmpCallback.bind(undefined, "example 5"));
 // query all network interface names
 conn.GetSubtree("ifDescr", snmpCallback.bind(undefined, "example 6"));
 
+
+// interface names and physical addresses, joined by ifIndex
+conn.GetTable("ifTable", [2, 6], function(aError, aRows) {
+  if (aError) {
+    console.log("example 7: error occured - " + aError);
+    return;
+  }
+  aRows.forEach(function(aRow) {
+    console.log("example 7: " + aRow.index.toArray().join(".") + ": "
+	+ aRow.values.join(" "));
+  });
+});
@@ -18,6 +18,35 @@ function interpret_oid(aOid) {
   }
 }
 
+// function is_packed_oid(aOid) {{{
+function is_packed_oid(aOid) {
+  return Buffer.isBuffer(aOid) ||
+    (typeof(Uint32Array) != "undefined" && aOid instanceof Uint32Array);
+}
+// }}}
+
+// function output_options(aOptions) {{{
+function output_options(aOptions) {
+  // binding writes to the SlowBuffer behind aOptions.output, options are
+  // copied so that the caller's object is left alone
+  if (!aOptions || !aOptions.output) {
+    return aOptions;
+  }
+  assert.ok(Buffer.isBuffer(aOptions.output), "output must be a Buffer");
+  var options = {};
+  for (var key in aOptions) {
+    options[key] = aOptions[key];
+  }
+  options.output = aOptions.output.parent;
+  options.outputOffset = aOptions.output.offset;
+  options.outputLength = aOptions.output.length;
+  if (options.format === undefined) {
+    options.format = binding.FORMAT_NDJSON;
+  }
+  return options;
+}
+// }}}
+
 // binding.Value.prototype.asString = function() {{{
 binding.Value.prototype.toString = function toString() {
   var v = this.GetData();
@@ -27,7 +56,8 @@ binding.Value.prototype.toString = function toString() {
     // exception,  Buffer.toString('utf8') appears  to  NOT  throw when  string
     // contains invalid characters.
     //
-    // We could do better with hints about data type from MIB... TODO?
+    // Value does not know its OID, so no MIB hints here - see Format and
+    // format_values.
     var printable = true;
     for(var i = 0; i < v.length; ++i) {
       if (v[i] > 127) {
@@ -120,6 +150,60 @@ function oid_compare(aLeft, aRight) {
 // }}}
 exports.oid_compare = oid_compare;
 
+/**
+ * Pack array of OIDs (any format) into Buffer accepted by Get and GetNext in
+ * place of OID: each OID as its number of arcs followed by the arcs, all
+ * little endian uint32. The binding copies it into the request in one pass,
+ * build it once for requests repeated with the same OIDs. Uint32Array with
+ * the same layout (host byte order) is accepted too.
+ */
+// function pack_oids(aOids) {{{
+function pack_oids(aOids) {
+  var oids = aOids.map(interpret_oid);
+  var words = 0;
+  for (var i = 0; i < oids.length; ++i) {
+    words += oids[i].length + 1;
+  }
+  var result = new Buffer(words * 4);
+  var offset = 0;
+  function put(aWord) {
+    result[offset++] = aWord & 0xff;
+    result[offset++] = (aWord >>> 8) & 0xff;
+    result[offset++] = (aWord >>> 16) & 0xff;
+    result[offset++] = (aWord >>> 24) & 0xff;
+  }
+  for (var i = 0; i < oids.length; ++i) {
+    put(oids[i].length);
+    oids[i].forEach(put);
+  }
+  return result;
+}
+// }}}
+exports.pack_oids = pack_oids;
+
+/**
+ * Request template - OIDs (array in any format) converted into a native
+ * request once, Get, GetNext and Scheduler.Add take it in place of OIDs.
+ * Each request sends a copy of it with fresh request id, nothing is converted
+ * from JS. Size() returns number of OIDs in it.
+ */
+// exports.Template = function(aOids) {{{
+exports.Template = function(aOids) {
+  assert.ok(aOids instanceof Array, "OIDs must be an array");
+  return new (binding.Template)(aOids.map(interpret_oid));
+}
+// }}}
+
+// function raw_oid(aOid) {{{
+function raw_oid(aOid) {
+  // packed OIDs and templates go to the binding as they are
+  if (is_packed_oid(aOid) || aOid instanceof binding.Template) {
+    return aOid;
+  }
+  return interpret_oid(aOid);
+}
+// }}}
+
 /**
  * Parse dotted oid format to array of integers.
  */
@@ -129,6 +213,127 @@ exports.read_objid = binding.read_objid;
  * of integers.
  */
 exports.parse_oid = binding.parse_oid;
+/**
+ * MIB modules are not loaded at startup, but when first symbolic name has to
+ * be resolved  or value formatted. load_mibs loads  them right away (long
+ * running processes may prefer to pay the price at start).
+ */
+exports.load_mibs = binding.load_mibs;
+/**
+ * Resolve  plain labels  ("ifDescr", "IF-MIB::ifDescr.1") in  parse_oid from
+ * binary  cache file  at aPath,  without loading  MIBs. When  the file  does
+ * not exist, it is created when MIBs are loaded. The cache is not checked
+ * against MIB files - remove it when MIBs change.
+ */
+exports.set_mib_cache = binding.set_mib_cache;
+/**
+ * Enable (true) or disable batched datagram I/O for connections created from
+ * now on. Requests are then queued and sent once per event loop iteration
+ * (sendmmsg), and all responses waiting on a socket are read at once
+ * (recvmmsg). Off by default.
+ */
+exports.batch_io = binding.batch_io;
+/**
+ * Host names of connections are resolved in background threads and cached
+ * for aTtl ms (5 minutes by default), by all connections and sync requests.
+ * 0 disables the cache.
+ */
+exports.set_dns_ttl = binding.set_dns_ttl;
+/**
+ * Array of numbers from Buffer of rates (see Connection.Get aOptions.rate).
+ */
+exports.rates_to_array = binding.rates_to_array;
+/**
+ * Admission limits of all connections of the process, 0 or missing means no
+ * limit (the default):
+ *  - requests - queued and in flight requests, steps of walks included. New
+ *    Get/GetNext/GetBulk/GetSubtree/GetTable/PollTable calls throw
+ *    "overloaded - request limit reached" at the limit, Scheduler jobs report
+ *    it as their error. Steps of walks already running are never refused.
+ *    Sync requests run on a private session of their own and are never
+ *    counted nor refused.
+ *  - inFlight - requests sent and waiting for response, the rest stays
+ *    queued (in priority order per connection) until responses arrive.
+ *  - bytes - estimated size of walk results buffered in the binding, new
+ *    requests fail with "overloaded - result memory limit reached" above it,
+ *    and so does a running walk whose results cross it.
+ * admission_state() returns current { requests, inFlight, bytes }.
+ */
+// exports.set_admission = function(aLimits) {{{
+exports.set_admission = function(aLimits) {
+  aLimits = aLimits || {};
+  binding.set_admission(aLimits.requests || 0, aLimits.inFlight || 0,
+      aLimits.bytes || 0);
+}
+// }}}
+exports.admission_state = binding.admission_state;
+/**
+ * Tracepoints of all connections record into a ring of the last 16384
+ * events of the process: request send, response receive, timeout, fail
+ * (send failure, close, cancel by deadline), callback-enter/-exit around JS
+ * callbacks, open and close of the session, hedge (copy sent to the
+ * alternate address, see Connection.SetHedge). trace_dump(aReset) returns them
+ * oldest first as { time (ms since epoch, us precision), event, session (see
+ * Connection.TraceId), reqid (SNMP request id) }, aReset skips them in the
+ * next dump. trace_enable(false) stops recording. When built with sys/sdt.h
+ * the same tracepoints are USDT probes snmp:request__send,
+ * snmp:response__receive, snmp:request__timeout, snmp:request__fail,
+ * snmp:callback__enter, snmp:callback__exit, snmp:session__open,
+ * snmp:session__close and snmp:request__hedge with (session, reqid)
+ * arguments.
+ */
+exports.trace_dump = binding.trace_dump;
+exports.trace_enable = binding.trace_enable;
+/**
+ * Format values  using MIB  information (enum labels,  DISPLAY-HINT, units),
+ * same as  snmpwalk prints them.  Takes array of  { oid, value }  results and
+ * returns array of strings, or rows of GetTable with table OID and columns
+ * and  returns array of  arrays of strings. MIB  object of each  column is
+ * resolved once and cached. Values of primitive results are formatted too.
+ *
+ *    exports.format_values(results)
+ *    exports.format_values(rows, table, columns)
+ *
+ * Single Value can be formatted with value.Format(oid).
+ */
+exports.format_values = binding.format_values;
+/**
+ * ASN types reported in 'type' of results (and 'types' of table rows) with
+ * primitive option.
+ */
+[ 'ASN_INTEGER', 'ASN_GAUGE', 'ASN_COUNTER', 'ASN_UINTEGER', 'ASN_TIMETICKS',
+  'ASN_COUNTER64', 'ASN_OCTET_STR', 'ASN_OBJECT_ID', 'ASN_IPADDRESS',
+  'ASN_NULL' ].forEach(function(aName) {
+  exports[aName] = binding[aName];
+});
+/**
+ * Values of  aOptions.priority. Requests wait in per-priority queues  of the
+ * connection and are sent once per event loop iteration, higher priority
+ * first (FIFO within a priority) - see conn.prototype.SetMaxInFlight.
+ */
+[ 'PRIORITY_HIGH', 'PRIORITY_NORMAL', 'PRIORITY_LOW' ].forEach(function(aName) {
+  exports[aName] = binding[aName];
+});
+/**
+ * Values  of aOptions.format,  encoding of results  written  to aOptions.output
+ * (see Get):
+ *
+ * FORMAT_NDJSON - a line of JSON per varbind, {"oid":"1.3.6...","type":2,
+ * "value":...}, or per table row, {"index":"1","values":[...],"types":[...]}.
+ * Integer types are numbers (Counter64 above 2^53 decimal strings), OIDs and
+ * IP addresses dotted strings, exceptions null, other values strings with one
+ * character per byte (like Buffer 'binary' encoding).
+ *
+ * FORMAT_BINARY - records prefixed by their length (uint32), big endian.
+ * Varbind: type (uint8), OID length n (uint8), n uint32 subids, value length
+ * (uint32),  value. Row:  index length  n (uint8), n uint32 subids, number of
+ * columns (uint16), then type, value length and value of each column (type 0
+ * for missing cell). Integer types are 8 byte values, OIDs uint32 subids,
+ * other types raw bytes.
+ */
+[ 'FORMAT_NDJSON', 'FORMAT_BINARY' ].forEach(function(aName) {
+  exports[aName] = binding[aName];
+});
 
 
 
@@ -157,14 +362,120 @@ Error.prototype.isEof = function() {
 
 
 
-var conn = exports.Connection = function Connection(aHost, aCredentials) {
-  this.worker_ = new (binding.Connection)(aHost, aCredentials);
+// function snmp_version(aVersion) {{{
+function snmp_version(aVersion) {
+  if (aVersion === undefined || aVersion == 1 || aVersion == "1") {
+    return binding.SNMP_VERSION_1;
+  } else if (aVersion == 2 || aVersion == "2c") {
+    return binding.SNMP_VERSION_2c;
+  }
+  assert.ok(false, "unsupported snmp version " + aVersion);
 }
+// }}}
 
-conn.prototype.Get = function(aOid, aCallback) {
-  var oid = interpret_oid(aOid);
+/**
+ * aVersion is optional - 1 (default) or "2c".
+ *
+ * aHost given by name is looked up in background (unless cached, see
+ * set_dns_ttl), requests made meanwhile wait and go out once it is done, or
+ * fail with "cannot resolve host name". Optional aCallback is called with
+ * (aError) when the connection is ready, always asynchronously.
+ */
+var conn = exports.Connection = function Connection(aHost, aCredentials, aVersion, aCallback) {
   if (aCallback) {
-    return this.worker_.Get(oid, aCallback, false);
+    assert.ok(aCallback instanceof Function, "callback must be a function");
+  }
+  function ready_callback(aError) {
+    aCallback(aError ? new Error(aError) : false);
+  }
+  this.worker_ = new (binding.Connection)(aHost, aCredentials,
+      snmp_version(aVersion), aCallback ? ready_callback : undefined);
+  this.closed_ = false;
+  if (aCallback && !this.worker_.IsOpening()) {
+    process.nextTick(function() {
+      aCallback(false);
+    });
+  }
+}
+
+/**
+ * Close the  session right  away: all requests in flight fail with "session
+ * closed" error and any further request throws. The socket itself is closed
+ * at the start of next event loop iteration, so Close is safe in callbacks.
+ * Without Close  the session lives  until GC collects the  Connection object
+ * (never while requests are pending).
+ */
+// conn.prototype.Close = function() {{{
+conn.prototype.Close = function() {
+  if (!this.closed_) {
+    this.closed_ = true;
+    this.worker_.Close();
+  }
+}
+// }}}
+
+/**
+ * Direct mapping for GET snmp operation. Sync/async behaviour and results are
+ * the same as in GetNext.
+ *
+ * aOptions.primitive  -  Integer, Gauge32,  Counter32,  Unsigned32,  TimeTicks
+ * and Counter64 values  are passed as plain numbers  instead of Value objects
+ * and each result gets 'type' property  with ASN type of the value (compare to
+ * exports.ASN_*). Counter64  above 2^53  can't be represented  exactly and is
+ * passed as decimal string.
+ *
+ * aOptions.cache - cache the response for this many ms (OIDs with TTL set by
+ * SetCacheTtl use that one). While the request is in flight, identical async
+ * requests with cache option wait for its response instead of sending their
+ * own. Sync requests read and fill the same cache. When the cache of the
+ * connection is full, entries closest to expiry are dropped first.
+ *
+ * aOptions.priority - one of exports.PRIORITY_* (PRIORITY_NORMAL by default),
+ * order in which queued requests are sent.
+ *
+ * aOptions.deadline - fail the request with "deadline exceeded" when it has
+ * no response after this many ms, regardless of net-snmp retries.
+ *
+ * aOptions.rate - instead of results,  callback gets one Buffer  of little
+ * endian doubles (readDoubleLE, or rates_to_array on older node versions),
+ * [delta, rate per second] for each varbind in order: difference of Counter32
+ * or  Counter64  against previous response for the same OID on this connection
+ * (Counter32 wrap is accounted for), NaN for other types, first sample and
+ * after agent restart. The binding appends sysUpTime.0 to the request unless
+ * it is there, it detects restarts and is the time base of rates. Such
+ * requests are never cached. Sync requests run on a fresh connection and
+ * have no previous samples.
+ *
+ * aOptions.output  - Buffer, results are  written into it  in aOptions.format
+ * (exports.FORMAT_NDJSON by default) and the callback gets number of bytes
+ * written instead of the results. When the buffer is too short, callback gets
+ * "output buffer too small" error with number of bytes needed. The buffer
+ * must not be touched until the callback. Such requests are never cached and
+ * can't be combined with aOptions.rate.
+ *
+ * Async version returns request id for Cancel (0 when answered from cache).
+ */
+// conn.prototype.Get = function(aOid, aCallback, aOptions) {{{
+conn.prototype.Get = function(aOid, aCallback, aOptions) {
+  var oid = raw_oid(aOid);
+  aOptions = output_options(aOptions);
+  if (aCallback && aOptions && aOptions.output) {
+    // the binding keeps the output alive through the callback, one per request
+    var callback = aCallback;
+    aCallback = function(aError, aData) {
+      callback(aError, aData);
+    };
+  }
+  if (aCallback) {
+    // cached result comes back directly, callback is always async
+    var cached = this.worker_.Get(oid, aCallback, false, aOptions);
+    if (cached instanceof Array) {
+      process.nextTick(function() {
+        aCallback(false, cached);
+      });
+      return 0;
+    }
+    return cached;
   } else {
     var result_err;
     var result_val;
@@ -174,7 +485,10 @@ conn.prototype.Get = function(aOid, aCallback) {
       result_val = aData;
     }
 
-    this.worker_.Get(oid, callback, true);
+    var cached = this.worker_.Get(oid, callback, true, aOptions);
+    if (cached instanceof Array) {
+      callback(false, cached);
+    }
 
     if (result_err) {
       this.lastError = new Error(result_err);
@@ -187,6 +501,100 @@ conn.prototype.Get = function(aOid, aCallback) {
     }
   }
 }
+// }}}
+
+/**
+ * Set cache TTL (ms) for responses to  requests for OIDs in aOid subtree (the
+ * longest matching subtree wins), so that  only some of the OIDs are cached or
+ * each with different TTL. 0 disables caching under aOid, null removes the
+ * setting. Rules apply to requests with  or without cache option, request with
+ * several OIDs is cached for the least of their TTLs.
+ */
+// conn.prototype.SetCacheTtl = function(aOid, aTtl) {{{
+conn.prototype.SetCacheTtl = function(aOid, aTtl) {
+  this.worker_.SetCacheTtl(interpret_oid(aOid), aTtl);
+}
+// }}}
+
+/**
+ * Drop request or walk  with id returned by Get, GetNext, GetSubtree, GetTable
+ * or PollTable, its callback is not called. Returns false when there is no
+ * such request (already finished). Response to request already sent is
+ * ignored when it arrives.
+ */
+// conn.prototype.Cancel = function(aId) {{{
+conn.prototype.Cancel = function(aId) {
+  return this.worker_.Cancel(aId);
+}
+// }}}
+
+/**
+ * Session id of this connection in trace_dump events and USDT probes.
+ */
+// conn.prototype.TraceId = function() {{{
+conn.prototype.TraceId = function() {
+  return this.worker_.TraceId();
+}
+// }}}
+
+/**
+ * Limit number of  requests in flight on this connection (0 - unlimited, the
+ * default). Requests above the limit wait in priority queues and go out as
+ * responses  arrive, so that  a burst of  low priority walk steps doesn't
+ * delay high priority requests queued after them.
+ */
+// conn.prototype.SetMaxInFlight = function(aCount) {{{
+conn.prototype.SetMaxInFlight = function(aCount) {
+  this.worker_.SetMaxInFlight(aCount);
+}
+// }}}
+
+/**
+ * Use GETBULK for  walks done  in the binding  (GetSubtree, GetTable,
+ * PollTable). Pass false to switch back to GETNEXT, otherwise options may hold
+ * initial (default 10) and max (default 50) max-repetitions. Actual value is
+ * tuned per connection: grows  while responses come back complete and fast,
+ * halves on tooBig or timeout. SNMPv2c connections only.
+ */
+// conn.prototype.SetBulk = function(aOptions) {{{
+conn.prototype.SetBulk = function(aOptions) {
+  if (aOptions === false) {
+    this.worker_.SetBulk(false);
+  } else {
+    aOptions = aOptions || {};
+    this.worker_.SetBulk(true, aOptions.initial, aOptions.max);
+  }
+}
+// }}}
+
+/**
+ * Hedge requests to agents reachable on two addresses (in-band and
+ * out-of-band management). Request without response after the
+ * aOptions.percentile (default 95) of RTTs observed on the primary address,
+ * but at least aOptions.min ms (default 10), is sent to aOptions.peer as well
+ * (same community, same request id); the first response wins, the other one
+ * is dropped. Until enough RTTs are known the delay is aOptions.initial ms
+ * (default 500). Pass false to stop hedging. Can't be changed while requests
+ * are in flight. aOptions.peer has to be a numeric address, or a host name the
+ * resolver already has cached - no DNS lookup is done here. Only UDP peers
+ * ("udp:", "udp6:" or no prefix, IPv6 as "[addr]:port") are accepted. Hedge
+ * copies take a slot of SetMaxInFlight (and of set_admission inFlight) like
+ * any request, the losing copy keeps it until net-snmp drops it.
+ */
+// conn.prototype.SetHedge = function(aOptions) {{{
+conn.prototype.SetHedge = function(aOptions) {
+  if (aOptions === false) {
+    this.worker_.SetHedge(false);
+  } else {
+    assert.ok(aOptions && typeof(aOptions.peer) == "string",
+        "alternate peer expected");
+    this.worker_.SetHedge(aOptions.peer,
+        aOptions.percentile === undefined ? 95 : aOptions.percentile,
+        aOptions.min === undefined ? 10 : aOptions.min,
+        aOptions.initial === undefined ? 500 : aOptions.initial);
+  }
+}
+// }}}
 
 /**
  * Direct  mapping for  GET_NEXT  snmp  operation -  returns  contents of  next
@@ -202,16 +610,35 @@ conn.prototype.Get = function(aOid, aCallback) {
  *
  * Data is passed as  array of objects - we could  support multi-oid queries in
  * future. Each member of the array will have 'oid' and 'value' properties.
+ *
+ * aOptions.primitive,  aOptions.cache,  aOptions.priority, aOptions.deadline,
+ * aOptions.output, aOptions.rate, return value of async version - see Get.
+ * Results written to output, rates and replies to packed OIDs (see
+ * pack_oids) or templates (see Template) are not checked for broken
+ * (non-increasing) replies.
  */
-// conn.prototype.GetNext = function(aOid, aCallback) {{{
-conn.prototype.GetNext = function(aOid, aCallback) {
+// conn.prototype.GetNext = function(aOid, aCallback, aOptions) {{{
+conn.prototype.GetNext = function(aOid, aCallback, aOptions) {
+  return get_next.call(this, aOid, aCallback, aOptions, false);
+}
+// }}}
+
+// function get_next(aOid, aCallback, aOptions, aContinuation) {{{
+function get_next(aOid, aCallback, aOptions, aContinuation) {
+  // GetNext with this of the connection; aContinuation (steps of a walk
+  // past admission, see getNextSubtree) is not reachable from the options
   if (aCallback) {
     assert.ok(aCallback instanceof Function,
         "callback must be a function");
   }
 
-  var oid = interpret_oid(aOid);
+  var oid = raw_oid(aOid);
   var that = this;
+  aOptions = output_options(aOptions);
+  // results in output or rates, and replies to packed OIDs or templates
+  // can't be compared
+  var unchecked = (aOptions && (aOptions.output || aOptions.rate)) ||
+    !(oid instanceof Array);
 
   function verifyNextResult(aReqOid, aReplyOid) {
     // reply to GET_NEXT must be next lexicographically greater row... but some
@@ -230,7 +657,7 @@ conn.prototype.GetNext = function(aOid, aCallback) {
       that.lastError = new Error(aError);
       return;
     }
-    if (!verifyNextResult(oid, aData[0].oid)) {
+    if (!unchecked && !verifyNextResult(oid, aData[0].oid)) {
       that.lastResult = null;
       that.lastError = new Error("broken peer implementation", ERR_CYCLE, null);
       return;
@@ -245,7 +672,7 @@ conn.prototype.GetNext = function(aOid, aCallback) {
       return;
     }
     // XXX: this won't work for multi-oid queries
-    if (!verifyNextResult(oid, aData[0].oid)) {
+    if (!unchecked && !verifyNextResult(oid, aData[0].oid)) {
       aCallback(new Error("broken peer implementation", ERR_CYCLE), null);
       console.log([oid, aData[0].oid]);
       return;
@@ -254,19 +681,92 @@ conn.prototype.GetNext = function(aOid, aCallback) {
   }
 
   if (aCallback) {
-    return this.worker_.GetNext(oid, async_callback, false);
+    var cached = this.worker_.GetNext(oid, async_callback, false, aOptions,
+        aContinuation);
+    if (cached instanceof Array) {
+      process.nextTick(function() {
+        async_callback(false, cached);
+      });
+      return 0;
+    }
+    return cached;
   } else {
-    this.worker_.GetNext(oid, sync_callback, true);
+    var cached = this.worker_.GetNext(oid, sync_callback, true, aOptions,
+        aContinuation);
+    if (cached instanceof Array) {
+      sync_callback(false, cached);
+    }
     return !this.lastError;
   }
 }
 // }}}
 
 /**
- * Wrapper for GetNext, restricted to subtree queries.
+ * Direct mapping for GET_BULK snmp operation (SNMPv2c only) - returns up to
+ * aOptions.maxRepetitions (10 by default) successors of each OID after the
+ * first aOptions.nonRepeaters (0 by default), which get one successor each
+ * like GetNext. Results are flat array of objects with 'oid' and 'value'
+ * properties, in the order of the reply. Replies are not checked for broken
+ * (non-increasing) OIDs. Sync behaviour and lastResult / lastError as Get.
+ *
+ * aOptions.primitive,  aOptions.cache,  aOptions.priority, aOptions.deadline,
+ * aOptions.output, return value of async version - see Get. aOptions.rate is
+ * not supported.
  */
-// conn.prototype.getNextSubtree = function(aOid, aBase, aCallback) {{{
-conn.prototype.getNextSubtree = function(aOid, aBase, aCallback) {
+// conn.prototype.GetBulk = function(aOid, aCallback, aOptions) {{{
+conn.prototype.GetBulk = function(aOid, aCallback, aOptions) {
+  var oid = raw_oid(aOid);
+  aOptions = output_options(aOptions);
+  if (aCallback && aOptions && aOptions.output) {
+    // the binding keeps the output alive through the callback, one per request
+    var callback = aCallback;
+    aCallback = function(aError, aData) {
+      callback(aError, aData);
+    };
+  }
+  if (aCallback) {
+    var cached = this.worker_.GetBulk(oid, aCallback, false, aOptions);
+    if (cached instanceof Array) {
+      process.nextTick(function() {
+        aCallback(false, cached);
+      });
+      return 0;
+    }
+    return cached;
+  } else {
+    var result_err;
+    var result_val;
+
+    function callback(aError, aData) {
+      result_err = aError;
+      result_val = aData;
+    }
+
+    var cached = this.worker_.GetBulk(oid, callback, true, aOptions);
+    if (cached instanceof Array) {
+      callback(false, cached);
+    }
+
+    if (result_err) {
+      this.lastError = new Error(result_err);
+      this.lastResult = null;
+      return false;
+    } else {
+      this.lastResult = result_val;
+      this.lastError = null;
+      return true;
+    }
+  }
+}
+// }}}
+
+/**
+ * Wrapper for GetNext, restricted to subtree queries. aContinuation marks
+ * steps after the first one, which are never refused by set_admission.
+ */
+// conn.prototype.getNextSubtree = function(aOid, aBase, aCallback, aContinuation) {{{
+conn.prototype.getNextSubtree = function(aOid, aBase, aCallback,
+    aContinuation) {
   if (aCallback) {
     assert.ok(aCallback instanceof Function, "callback must be a function");
   }
@@ -285,7 +785,8 @@ conn.prototype.getNextSubtree = function(aOid, aBase, aCallback) {
   }
 
   if (aCallback) {
-    return this.GetNext(aOid, async_callback);
+    return get_next.call(this, aOid, async_callback, undefined,
+        !!aContinuation);
   } else {
     if (!this.GetNext(base)) {
       return false;
@@ -299,8 +800,47 @@ conn.prototype.getNextSubtree = function(aOid, aBase, aCallback) {
 }
 // }}}
 
-// conn.prototype.GetSubtree = function(aOid, aCallback) {{{
-conn.prototype.GetSubtree = function(aOid, aCallback) {
+/**
+ * Walk whole subtree of aOid, callback gets array of { oid, value } objects in
+ * OID order.
+ *
+ * aOid can  also be  array of OIDs,  then all  of them are  walked natively,
+ * advancing in lockstep - one GETNEXT with one varbind per root for each step,
+ * roots are retired as they leave their subtree. Results are grouped by root,
+ * in the order of aOid.
+ *
+ * aOptions.parallel  - when  greater than 1, the binding  splits the subtree
+ * into  its children  (columns, for  tables)  and walks  up to  that many  of
+ * them  concurrently on  this connection. Results  are the  same, but  walks
+ * over high-latency links take roughly (rows) instead of (rows * columns)
+ * round trips.
+ *
+ * aOptions.primitive - see Get. Subtree is always walked natively with this
+ * option.
+ *
+ * aOptions.priority - see Get, applies to every step of the walk.
+ *
+ * aOptions.deadline - see Get, applies to the whole walk.
+ *
+ * aOptions.retries - when a step times out (or can't be sent), send it again
+ * from the last OID received, with fresh net-snmp timeout and retries, up to
+ * this many times in a row (0 by default).
+ *
+ * When a native walk fails, callback gets the error together with results
+ * received so far.  Their 'resume' property is a  checkpoint - pass it as
+ * aOptions.resume (with the  same aOid) to  walk only the  rest. Results of
+ * the resumed walk start after the checkpoint.
+ *
+ * aOptions.output, aOptions.format - see Get, results are written  to the
+ * buffer and callback gets their  length. Failed walk  passes length  of the
+ * partial results (written only if they fit) and the checkpoint as third
+ * argument.
+ *
+ * With any of the options the subtree is walked natively and the  walk id for
+ * Cancel is returned.
+ */
+// conn.prototype.GetSubtree = function(aOid, aCallback, aOptions) {{{
+conn.prototype.GetSubtree = function(aOid, aCallback, aOptions) {
   // TODO: great opportunity for GET_BULK. IF we support v2 protocol, and the
   // connection is v2...
 
@@ -312,6 +852,35 @@ conn.prototype.GetSubtree = function(aOid, aCallback) {
   var that = this;
   var results = [];
 
+  function native_callback(aError, aData, aCheckpoint) {
+    if (aError) {
+      // partial result with checkpoint, see aOptions.resume
+      aCallback(new Error(aError), aData, aCheckpoint);
+      return;
+    }
+    aCallback(false, aData);
+  }
+
+  var options = output_options(aOptions) || {};
+  if (aOid instanceof Array && aOid.length > 0 && !(typeof(aOid[0]) == "number")) {
+    return this.worker_.Walk(aOid.map(interpret_oid), native_callback,
+        { lockstep: true, primitive: options.primitive,
+          priority: options.priority, deadline: options.deadline,
+          retries: options.retries, resume: options.resume,
+          format: options.format, output: options.output,
+          outputOffset: options.outputOffset,
+          outputLength: options.outputLength });
+  }
+  if (aOptions) {
+    return this.worker_.Walk(interpret_oid(aOid), native_callback,
+        { parallel: options.parallel, primitive: options.primitive,
+          priority: options.priority, deadline: options.deadline,
+          retries: options.retries, resume: options.resume,
+          format: options.format, output: options.output,
+          outputOffset: options.outputOffset,
+          outputLength: options.outputLength });
+  }
+
   function get_subtree_callback(aError, aData) {
     if (aError) {
       if (aError.isEof()) {
@@ -321,7 +890,7 @@ conn.prototype.GetSubtree = function(aOid, aCallback) {
       }
     } else {
       results.push(aData[0]);
-      that.getNextSubtree(aData[0].oid, aOid, get_subtree_callback);
+      that.getNextSubtree(aData[0].oid, aOid, get_subtree_callback, true);
     }
   }
 
@@ -329,4 +898,331 @@ conn.prototype.GetSubtree = function(aOid, aCallback) {
 }
 // }}}
 
+/**
+ * Fetch  selected columns of  conceptual table  (ifTable, ipNetToMediaTable,
+ * ...). Columns are walked and joined into rows by the binding, callback gets
+ * array of  rows sorted  by index,  each with  'index' (Value  of OID  type -
+ * instance part of  the row OIDs) and 'values' (array of  Values in the same
+ * order as aColumns, null where the agent has no value for the column).
+ *
+ * aColumns is array of column numbers, eg. [2, 6] for ifDescr and ifPhysAddress
+ * when aTable is ifTable.
+ *
+ * aOptions.parallel - number of columns walked concurrently (default 1).
+ * aOptions.lockstep - fetch one row per request, all columns advance together
+ * in one GETNEXT PDU (what snmptable does). Takes precedence over parallel.
+ * aOptions.primitive - numeric values  are plain numbers (see Get), each row
+ * gets also 'types' array with ASN types of values.
+ * aOptions.priority, aOptions.deadline - see Get, for the whole walk.
+ * aOptions.retries, aOptions.resume - see GetSubtree. Resumed table walk gets
+ * only rows after the checkpoint of each column.
+ * aOptions.output, aOptions.format - rows written to the buffer, see Get and
+ * GetSubtree.
+ *
+ * Returns walk id for Cancel.
+ */
+// conn.prototype.GetTable = function(aTable, aColumns, aCallback, aOptions) {{{
+conn.prototype.GetTable = function(aTable, aColumns, aCallback, aOptions) {
+  // no sync version available for now
+  assert.ok(aCallback instanceof Function, "callback must be a function");
+  assert.ok(aColumns instanceof Array && aColumns.length > 0,
+      "columns must be non-empty array of column numbers");
+
+  var table = interpret_oid(aTable);
+
+  function async_callback(aError, aData, aCheckpoint) {
+    if (aError) {
+      // partial rows with checkpoint, see aOptions.resume
+      aCallback(new Error(aError), aData, aCheckpoint);
+      return;
+    }
+    aCallback(false, aData);
+  }
+
+  return this.worker_.GetTable(table, aColumns, async_callback,
+      output_options(aOptions));
+}
+// }}}
+
+/**
+ * Change-only version of GetTable. The binding remembers state of the table
+ * (per  connection, table  and set of  columns) from  the previous  call and
+ * callback gets only the difference:
+ *
+ *    { added: [ rows ], changed: [ rows ], removed: [ index Values ] }
+ *
+ * Rows have  the same  format as  in GetTable. First  call reports  all rows
+ * as  added. When  the  walk fails,  the remembered  state is  kept and  next
+ * successful poll is compared to it.
+ */
+// conn.prototype.PollTable = function(aTable, aColumns, aCallback, aOptions) {{{
+conn.prototype.PollTable = function(aTable, aColumns, aCallback, aOptions) {
+  assert.ok(aCallback instanceof Function, "callback must be a function");
+  assert.ok(aColumns instanceof Array && aColumns.length > 0,
+      "columns must be non-empty array of column numbers");
+
+  var table = interpret_oid(aTable);
+
+  function async_callback(aError, aData) {
+    if (aError) {
+      aCallback(new Error(aError), null);
+      return;
+    }
+    aCallback(false, aData);
+  }
+
+  return this.worker_.PollTable(table, aColumns, async_callback, aOptions);
+}
+// }}}
+
+
+
+// function pool_key(aHost, aCredentials, aVersion) {{{
+function pool_key(aHost, aCredentials, aVersion) {
+  return [ aHost, snmp_version(aVersion), aCredentials ].join("\0");
+}
+// }}}
+
+/**
+ * Pool of open connections, keyed by (host, version, credentials). Released
+ * connections stay open and are handed  out to the next Acquire of the same
+ * key.
+ *
+ * aOptions.maxOpen - at most  this many connections are open  at once (256).
+ * When the limit is reached, least recently released idle connection is
+ * closed to make room,  and when all  of them are in  use, Acquire waits for
+ * Release.
+ * aOptions.idleTimeout - idle connections are closed after this many ms
+ * (30000).
+ */
+// var Pool = exports.Pool = function Pool(aOptions) {{{
+var Pool = exports.Pool = function Pool(aOptions) {
+  aOptions = aOptions || {};
+  this.maxOpen_ = aOptions.maxOpen || 256;
+  this.idleTimeout_ =
+    aOptions.idleTimeout === undefined ? 30000 : aOptions.idleTimeout;
+  this.open_ = 0;
+  this.idle_ = [];      // { conn, timer }, least recently released first
+  this.waiting_ = [];   // { key, host, credentials, version, callback }
+  this.closed_ = false;
+}
+
+/**
+ * aCallback is called with (aError, aConnection). Pass the connection back
+ * with Release when done, don't Close it.
+ */
+// Pool.prototype.Acquire = function(aHost, aCredentials, aVersion, aCallback) {{{
+Pool.prototype.Acquire = function(aHost, aCredentials, aVersion, aCallback) {
+  assert.ok(aCallback instanceof Function, "callback must be a function");
+
+  var request = {
+    key: pool_key(aHost, aCredentials, aVersion),
+    host: aHost,
+    credentials: aCredentials,
+    version: aVersion,
+    callback: aCallback
+  };
+  if (this.closed_) {
+    process.nextTick(function() {
+      aCallback(new Error("pool closed"), null);
+    });
+    return;
+  }
+
+  for (var i = this.idle_.length - 1; i >= 0; --i) {
+    if (this.idle_[i].conn.pool_key_ == request.key) {
+      var entry = this.idle_.splice(i, 1)[0];
+      clearTimeout(entry.timer);
+      process.nextTick(function() {
+        aCallback(false, entry.conn);
+      });
+      return;
+    }
+  }
+
+  if (this.open_ >= this.maxOpen_ && this.idle_.length > 0) {
+    this.evict_(this.idle_[0]);
+  }
+  if (this.open_ < this.maxOpen_) {
+    this.open_connection_(request);
+  } else {
+    this.waiting_.push(request);
+  }
+}
+// }}}
+
+// Pool.prototype.Release = function(aConnection) {{{
+Pool.prototype.Release = function(aConnection) {
+  var that = this;
+
+  if (aConnection.closed_ || this.closed_) {
+    if (!aConnection.closed_) {
+      aConnection.Close();
+    }
+    --this.open_;
+    this.serve_waiting_();
+    return;
+  }
+
+  for (var i = 0; i < this.waiting_.length; ++i) {
+    if (this.waiting_[i].key == aConnection.pool_key_) {
+      var request = this.waiting_.splice(i, 1)[0];
+      process.nextTick(function() {
+        request.callback(false, aConnection);
+      });
+      return;
+    }
+  }
+
+  if (this.waiting_.length > 0) {
+    // somebody waits for other key, make room
+    aConnection.Close();
+    --this.open_;
+    this.serve_waiting_();
+    return;
+  }
+
+  var entry = { conn: aConnection, timer: null };
+  entry.timer = setTimeout(function() {
+    that.evict_(entry);
+  }, this.idleTimeout_);
+  this.idle_.push(entry);
+}
+// }}}
+
+/**
+ * Close all idle connections, connections in use are closed when released.
+ * Waiting Acquire calls fail.
+ */
+// Pool.prototype.Close = function() {{{
+Pool.prototype.Close = function() {
+  this.closed_ = true;
+  while (this.idle_.length > 0) {
+    this.evict_(this.idle_[0]);
+  }
+  var waiting = this.waiting_;
+  this.waiting_ = [];
+  waiting.forEach(function(aRequest) {
+    aRequest.callback(new Error("pool closed"), null);
+  });
+}
+// }}}
+
+// Pool.prototype.evict_ = function(aEntry) {{{
+Pool.prototype.evict_ = function(aEntry) {
+  var i = this.idle_.indexOf(aEntry);
+  if (i < 0) {
+    return;
+  }
+  this.idle_.splice(i, 1);
+  clearTimeout(aEntry.timer);
+  aEntry.conn.Close();
+  --this.open_;
+}
+// }}}
+
+// Pool.prototype.open_connection_ = function(aRequest) {{{
+Pool.prototype.open_connection_ = function(aRequest) {
+  var c;
+  try {
+    c = new conn(aRequest.host, aRequest.credentials, aRequest.version);
+  } catch (e) {
+    process.nextTick(function() {
+      aRequest.callback(new Error(e), null);
+    });
+    return;
+  }
+  c.pool_key_ = aRequest.key;
+  ++this.open_;
+  process.nextTick(function() {
+    aRequest.callback(false, c);
+  });
+}
+// }}}
+
+// Pool.prototype.serve_waiting_ = function() {{{
+Pool.prototype.serve_waiting_ = function() {
+  while (this.waiting_.length > 0 && this.open_ < this.maxOpen_) {
+    this.open_connection_(this.waiting_.shift());
+  }
+}
+// }}}
+
+
+
+/**
+ * Receiver of SNMPv1/v2c traps and informs.
+ *
+ * aOptions.port (default 162) and aOptions.address (default "0.0.0.0") select
+ * where to listen. aCallback is called with (aError, aTraps), where aTraps is
+ * array of all traps  received since the last call - socket  is read in batches
+ * by the binding. Each trap has:
+ *  - type - "trap" (v1), "trap2" or "inform"
+ *  - version, community, source ("address:port" of the sender)
+ *  - varbinds - array of { oid, value } (Values, same as query results)
+ *  - enterprise, agentAddr, genericTrap, specificTrap, uptime - v1 traps only
+ *
+ * Informs are acknowledged by the binding before the callback is called.
+ */
+// var TrapListener = exports.TrapListener = function(aOptions, aCallback) {{{
+var TrapListener = exports.TrapListener = function TrapListener(aOptions, aCallback) {
+  assert.ok(aCallback instanceof Function, "callback must be a function");
+  aOptions = aOptions || {};
+
+  this.worker_ = new (binding.TrapListener)(
+      aOptions.port === undefined ? 162 : aOptions.port,
+      aOptions.address || "0.0.0.0",
+      aCallback);
+}
+
+TrapListener.prototype.Close = function() {
+  this.worker_.Close();
+}
+// }}}
+
+/**
+ * Native periodic poller. Jobs added  by Add(aConnection, aOids, aInterval,
+ * aOptions) send GET for aOids (array of OIDs or Template, one PDU) on
+ * aConnection every aInterval ms. The request is built once and copied each
+ * cycle. Start times of jobs are spread evenly over their interval and
+ * each cycle is shifted by random jitter (aOptions.jitter, fraction of the
+ * interval, 0.05 by default), all jobs run off one native timer.
+ *
+ * aCallback is called with (aError, aResults) once per event loop iteration
+ * with results of all polls finished since the last call. Each result has:
+ *  - id - job id returned by Add
+ *  - time - ms since epoch when the poll finished
+ *  - error - null or error message ("deadline exceeded" when there  was no
+ *    response within the interval)
+ *  - values - array of { oid, value }, same as results of Get
+ *  - rates - instead of values with rate option, see Connection.Get. Rates
+ *    of all results of one call are slices of one Buffer.
+ *
+ * Options of Add: primitive, priority, rate and deadline (at most the
+ * interval) - see Connection.Get.
+ */
+// var Scheduler = exports.Scheduler = function(aOptions, aCallback) {{{
+var Scheduler = exports.Scheduler = function Scheduler(aOptions, aCallback) {
+  assert.ok(aCallback instanceof Function, "callback must be a function");
+  aOptions = aOptions || {};
+
+  this.worker_ = new (binding.Scheduler)(aCallback, aOptions.jitter);
+}
+
+Scheduler.prototype.Add = function(aConnection, aOids, aInterval, aOptions) {
+  assert.ok(aConnection instanceof conn, "not a connection");
+  var oids = aOids instanceof binding.Template ? aOids :
+    aOids.map(interpret_oid);
+  return this.worker_.Add(aConnection.worker_, oids, aInterval, aOptions);
+}
+
+Scheduler.prototype.Remove = function(aId) {
+  return this.worker_.Remove(aId);
+}
+
+Scheduler.prototype.Close = function() {
+  this.worker_.Close();
+}
+// }}}
+
 // vim: ts=2 sw=2 et
@@ -5,27 +5,34 @@
 
 #include <net-snmp/net-snmp-config.h>
 #include <net-snmp/pdu_api.h>
+#include <net-snmp/library/snmp_transport.h>
+#include <net-snmp/library/snmpUDPDomain.h>
+#include <net-snmp/library/default_store.h>
 
-extern "C" {
-
-// #include <net-snmp/mib_api.h>
-// we  can't include  mib_api.h  where  this function  is  declared, it  causes
-// collision with node namespace.
-int read_objid(const char *, oid *, size_t *);
-
-oid* snmp_parse_oid(const char * argv,
-    oid * root,
-    size_t * rootlen
-    );
-
-} // extern "C"
+// mib_api.h (through  parse.h) declares struct  node, which collides  with node
+// namespace. We  never use  the struct,  so it's renamed  for the  duration of
+// the include.
+#define node netsnmp_parse_node
+#include <net-snmp/mib_api.h>
+#undef node
 
 #include <node.h>
 #include <node_events.h>
 #include <node_buffer.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
 #include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -35,6 +42,9 @@ oid* snmp_parse_oid(const char * argv,
 #include <deque>
 #include <memory>
 #include <list>
+#include <map>
+#include <set>
+#include <limits>
 
 // TODO's: exception safety, RAII (see PerformRequest's handling of pdu for
 // example of the WRONG way to do it). Does RAII even work v8::ThrowException?
@@ -75,8 +85,592 @@ using namespace v8;
 
 #endif // MODULE_EXPORTS_DOC
 
+// ==== SnmpTrace {{{
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+#endif
+
+/**
+ * Flight recorder of the hot path. Tracepoints (request sent, response
+ * received, timeout, failure, JS callback enter/exit, session open/close)
+ * carry session id and request id and go into a fixed ring with the last
+ * kCapacity events of the process. The ring is shared by all threads without
+ * locks: writer claims a slot by atomic increment and stamps it after the
+ * payload, reader skips slots that are being rewritten. Recording costs a
+ * clock read and a few stores, and can be switched off (trace_enable).
+ *
+ * With sys/sdt.h, every tracepoint is also USDT probe of provider "snmp"
+ * with (session, reqid) arguments, a nop unless perf or bpftrace attaches.
+ */
+class SnmpTrace {
+  public:
+    enum event {
+      EVENT_SEND = 1,
+      EVENT_RECEIVE,
+      EVENT_TIMEOUT,
+      EVENT_FAIL,
+      EVENT_CALLBACK_ENTER,
+      EVENT_CALLBACK_EXIT,
+      EVENT_OPEN,
+      EVENT_CLOSE,
+      EVENT_HEDGE
+    };
+
+    enum { kCapacity = 16384 };  // power of 2
+
+    struct entry {
+      uint32_t stamp_;    // sequence number + 1, 0 while being written
+      uint32_t event_;
+      uint32_t session_;
+      int32_t reqid_;
+      double time_;       // ms since epoch
+    };
+
+  private:
+    static entry ring_[kCapacity];
+    static uint32_t next_;      // sequence number of the next event
+    static uint32_t begin_;     // first sequence number not dumped yet
+    static uint32_t lastSession_;
+    static bool enabled_;
+
+  public:
+    static void add(event aEvent, uint32_t aSession, long aReqId) {
+      if (!enabled_) {
+        return;
+      }
+      struct timeval tv;
+      gettimeofday(&tv, NULL);
+
+      uint32_t kSeq = __sync_fetch_and_add(&next_, 1);
+      entry& kEntry = ring_[kSeq & (kCapacity - 1)];
+      kEntry.stamp_ = 0;
+      __sync_synchronize();
+      kEntry.event_ = aEvent;
+      kEntry.session_ = aSession;
+      kEntry.reqid_ = static_cast<int32_t>(aReqId);
+      kEntry.time_ = tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+      __sync_synchronize();
+      kEntry.stamp_ = kSeq + 1;
+    }
+
+    // events since the last reset (at most kCapacity), oldest first
+    static void dump(std::vector<entry>* aOut, bool aReset) {
+      uint32_t kEnd = next_;
+      uint32_t kBegin = begin_;
+      if (kEnd - kBegin > kCapacity) {
+        kBegin = kEnd - kCapacity;
+      }
+      aOut->reserve(kEnd - kBegin);
+      for (uint32_t i = kBegin; i != kEnd; ++i) {
+        const entry& kSlot = ring_[i & (kCapacity - 1)];
+        uint32_t kStamp = kSlot.stamp_;
+        __sync_synchronize();
+        entry kCopy = kSlot;
+        __sync_synchronize();
+        // unfinished, or overwritten by a writer that lapped us
+        if (kStamp != i + 1 || kSlot.stamp_ != kStamp) {
+          continue;
+        }
+        aOut->push_back(kCopy);
+      }
+      if (aReset) {
+        begin_ = kEnd;
+      }
+    }
+
+    static void enable(bool aEnabled) { enabled_ = aEnabled; }
+
+    static uint32_t nextSession() {
+      return __sync_add_and_fetch(&lastSession_, 1);
+    }
+
+    static const char* name(uint32_t aEvent) {
+      switch (aEvent) {
+        case EVENT_SEND: return "send";
+        case EVENT_RECEIVE: return "receive";
+        case EVENT_TIMEOUT: return "timeout";
+        case EVENT_FAIL: return "fail";
+        case EVENT_CALLBACK_ENTER: return "callback-enter";
+        case EVENT_CALLBACK_EXIT: return "callback-exit";
+        case EVENT_OPEN: return "open";
+        case EVENT_CLOSE: return "close";
+        case EVENT_HEDGE: return "hedge";
+        default: return "unknown";
+      }
+    }
+};
+
+SnmpTrace::entry SnmpTrace::ring_[SnmpTrace::kCapacity];
+uint32_t SnmpTrace::next_ = 0;
+uint32_t SnmpTrace::begin_ = 0;
+uint32_t SnmpTrace::lastSession_ = 0;
+bool SnmpTrace::enabled_ = true;
+
+#ifdef HAVE_SYS_SDT_H
+# define SNMP_PROBE(aProbe, aSession, aReqId)                             \
+  DTRACE_PROBE2(snmp, aProbe, aSession, aReqId)
+#else
+# define SNMP_PROBE(aProbe, aSession, aReqId)
+#endif
+
+// tracepoint - USDT probe snmp:aProbe and event of the ring
+#define SNMP_TRACE(aEvent, aProbe, aSession, aReqId)                      \
+  do {                                                                     \
+    SNMP_PROBE(aProbe, aSession, aReqId);                                  \
+    SnmpTrace::add(SnmpTrace::aEvent, aSession, aReqId);                   \
+  } while (0)
+
+// }}}
+
+
+
+// ==== SnmpBatchIo {{{
+
+/**
+ * Batched datagram I/O for net-snmp sessions. When enabled, send and receive
+ * functions of  session's UDP transport  are replaced: sends are  queued and
+ * flushed  once per  loop  iteration  (sendmmsg per  socket,  from  manager's
+ * prepare  callback), and  readable socket  is drained  with recvmmsg  before
+ * net-snmp  processes  the  datagrams  one  by  one  (snmp_sess_read  calls
+ * recv_hook, which only pops from the queue).
+ *
+ * Every session still has its own socket, so batching pays off for sessions
+ * with  several requests  in flight  (parallel and  lockstep walks,  bursts of
+ * Gets) and for draining responses which arrived during one loop iteration.
+ *
+ * Send errors are only  visible at flush time and are  dropped, net-snmp will
+ * retransmit the request on timeout like after any lost datagram.
+ */
+class SnmpBatchIo {
+  public:
+    typedef int (*transport_fn)(netsnmp_transport*, void*, int, void**, int*);
+
+    struct datagram {
+      std::vector<unsigned char> data_;
+      size_t length_;
+      struct sockaddr_storage addr_;
+      socklen_t addrLength_;
+    };
+
+    enum { kBatch = 32, kMaxMessage = 65536 };
+
+    // outgoing datagram vectors are reused, only the count moves. Received
+    // ones wait in incoming_ of their transport until net-snmp reads them,
+    // a nested drain (sync request from a callback) can't touch them.
+    struct transport_state {
+      netsnmp_transport* transport_;
+      transport_fn origSend_;
+      transport_fn origRecv_;
+      std::vector<datagram> outgoing_;
+      size_t outCount_;
+      bool dirty_;
+      std::deque<datagram> incoming_;
+    };
+
+    typedef std::map<netsnmp_transport*, transport_state> state_map;
+
+  private:
+    static bool enabled_;
+    static state_map states_;
+    static std::vector<transport_state*> dirty_;
+
+    // recvmmsg buffers shared by all transports, datagrams are copied to
+    // their transport's queue right away
+    static std::vector<datagram> received_;
+
+    static int send_hook(netsnmp_transport* t, void* buf, int size,
+        void** opaque, int* olength);
+    static int recv_hook(netsnmp_transport* t, void* buf, int size,
+        void** opaque, int* olength);
+
+    static void flush(transport_state& aState);
+
+  public:
+    static void enable(bool aEnabled) { enabled_ = aEnabled; }
+
+    // start/stop batching on transport of newly opened/closing session
+    static void attach(netsnmp_transport* t);
+    static void detach(netsnmp_transport* t);
+
+    // send everything queued since the last call
+    static void flush();
+
+    // read all datagrams waiting on the socket, returns false when transport
+    // isn't batched (caller should use plain snmp_sess_read)
+    static bool drain(netsnmp_transport* t);
+    static bool pending(netsnmp_transport* t);
+};
+
+bool SnmpBatchIo::enabled_ = false;
+SnmpBatchIo::state_map SnmpBatchIo::states_;
+std::vector<SnmpBatchIo::transport_state*> SnmpBatchIo::dirty_;
+std::vector<SnmpBatchIo::datagram> SnmpBatchIo::received_;
+
+// void SnmpBatchIo::attach(netsnmp_transport* t) {{{
+void SnmpBatchIo::attach(netsnmp_transport* t) {
+  if (!enabled_ || !t || !t->data
+      || t->data_length < static_cast<int>(sizeof(struct sockaddr_in)))
+  {
+    return;
+  }
+  // UDP  transports keep  the  peer address  in t->data  -  sockaddr_in or
+  // sockaddr_in6, or address pair starting with one. Anything else (TCP, unix
+  // sockets) is left alone.
+  sa_family_t kFamily = reinterpret_cast<struct sockaddr*>(t->data)->sa_family;
+  if (kFamily != AF_INET && kFamily != AF_INET6) {
+    return;
+  }
+  if ((t->flags & NETSNMP_TRANSPORT_FLAG_STREAM)) {
+    return;
+  }
+
+  transport_state& kState = states_[t];
+  kState.transport_ = t;
+  kState.origSend_ = t->f_send;
+  kState.origRecv_ = t->f_recv;
+  kState.outCount_ = 0;
+  kState.dirty_ = false;
+  if (received_.empty()) {
+    received_.resize(kBatch);
+    for (size_t i = 0; i < kBatch; ++i) {
+      received_[i].data_.resize(kMaxMessage);
+    }
+  }
+  t->f_send = SnmpBatchIo::send_hook;
+  t->f_recv = SnmpBatchIo::recv_hook;
+}
+// }}}
+
+// void SnmpBatchIo::detach(netsnmp_transport* t) {{{
+void SnmpBatchIo::detach(netsnmp_transport* t) {
+  state_map::iterator it = states_.find(t);
+  if (it == states_.end()) {
+    return;
+  }
+  if (it->second.dirty_) {
+    dirty_.erase(std::find(dirty_.begin(), dirty_.end(), &it->second));
+  }
+  t->f_send = it->second.origSend_;
+  t->f_recv = it->second.origRecv_;
+  states_.erase(it);
+}
+// }}}
+
+// int SnmpBatchIo::send_hook(...) {{{
+int SnmpBatchIo::send_hook(netsnmp_transport* t, void* buf, int size,
+    void** opaque, int* olength)
+{
+  state_map::iterator it = states_.find(t);
+  assert(it != states_.end());
+  transport_state& kState = it->second;
+
+  // destination - explicit one from net-snmp or the session peer
+  const void* kAddr = t->data;
+  size_t kAddrLength = t->data_length;
+  if (opaque && *opaque && olength
+      && *olength >= static_cast<int>(sizeof(struct sockaddr_in)))
+  {
+    kAddr = *opaque;
+    kAddrLength = *olength;
+  }
+
+  if (kState.outCount_ == kState.outgoing_.size()) {
+    kState.outgoing_.resize(kState.outCount_ + 1);
+  }
+  datagram& kDatagram = kState.outgoing_[kState.outCount_++];
+  kDatagram.data_.assign(static_cast<unsigned char*>(buf),
+      static_cast<unsigned char*>(buf) + size);
+  kDatagram.length_ = size;
+  memset(&kDatagram.addr_, 0, sizeof(kDatagram.addr_));
+  memcpy(&kDatagram.addr_, kAddr,
+      std::min(kAddrLength, sizeof(kDatagram.addr_)));
+  kDatagram.addrLength_ = (kDatagram.addr_.ss_family == AF_INET6)
+    ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  if (!kState.dirty_) {
+    kState.dirty_ = true;
+    dirty_.push_back(&kState);
+  }
+  return size;
+}
+// }}}
+
+// int SnmpBatchIo::recv_hook(...) {{{
+int SnmpBatchIo::recv_hook(netsnmp_transport* t, void* buf, int size,
+    void** opaque, int* olength)
+{
+  state_map::iterator it = states_.find(t);
+  if (it == states_.end() || it->second.incoming_.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+  datagram& kDatagram = it->second.incoming_.front();
+  int kLength = std::min<int>(size, kDatagram.length_);
+  if (kLength > 0) {
+    memcpy(buf, &kDatagram.data_[0], kLength);
+  }
+
+  // net-snmp frees the address with free(). Same as the transport's own
+  // recv: UDP/IPv4 passes address pair (remote, local, interface), UDP/IPv6
+  // bare sockaddr_in6.
+  if (opaque && olength) {
+    void* kFrom;
+    int kFromLength;
+    if (kDatagram.addr_.ss_family == AF_INET6) {
+      kFromLength = sizeof(struct sockaddr_in6);
+      kFrom = calloc(1, kFromLength);
+      if (kFrom) {
+        memcpy(kFrom, &kDatagram.addr_, kFromLength);
+      }
+    } else {
+      kFromLength = sizeof(netsnmp_indexed_addr_pair);
+      netsnmp_indexed_addr_pair* kPair =
+        static_cast<netsnmp_indexed_addr_pair*>(calloc(1, kFromLength));
+      if (kPair) {
+        memcpy(&kPair->remote_addr, &kDatagram.addr_,
+            std::min<size_t>(sizeof(kPair->remote_addr),
+              sizeof(struct sockaddr_in)));
+      }
+      kFrom = kPair;
+    }
+    *opaque = kFrom;
+    *olength = kFrom ? kFromLength : 0;
+  }
+  it->second.incoming_.pop_front();
+  return kLength;
+}
+// }}}
+
+// void SnmpBatchIo::flush(transport_state& aState) {{{
+void SnmpBatchIo::flush(transport_state& aState) {
+  int kSocket = aState.transport_->sock;
+  size_t kSent = 0;
+
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr kMsgs[kBatch];
+  struct iovec kIov[kBatch];
+
+  while (kSent < aState.outCount_) {
+    size_t kCount = std::min<size_t>(aState.outCount_ - kSent, kBatch);
+    memset(kMsgs, 0, kCount * sizeof(kMsgs[0]));
+    for (size_t i = 0; i < kCount; ++i) {
+      datagram& kDatagram = aState.outgoing_[kSent + i];
+      kIov[i].iov_base = &kDatagram.data_[0];
+      kIov[i].iov_len = kDatagram.length_;
+      kMsgs[i].msg_hdr.msg_iov = &kIov[i];
+      kMsgs[i].msg_hdr.msg_iovlen = 1;
+      kMsgs[i].msg_hdr.msg_name = &kDatagram.addr_;
+      kMsgs[i].msg_hdr.msg_namelen = kDatagram.addrLength_;
+    }
+    int kResult = sendmmsg(kSocket, kMsgs, kCount, 0);
+    // skip the datagram which failed, the rest gets another chance
+    kSent += (kResult > 0) ? kResult : 1;
+  }
+#else
+  for (; kSent < aState.outCount_; ++kSent) {
+    datagram& kDatagram = aState.outgoing_[kSent];
+    sendto(kSocket, &kDatagram.data_[0], kDatagram.length_, 0,
+        reinterpret_cast<struct sockaddr*>(&kDatagram.addr_),
+        kDatagram.addrLength_);
+  }
+#endif
+  aState.outCount_ = 0;
+  aState.dirty_ = false;
+}
+// }}}
+
+// void SnmpBatchIo::flush() {{{
+void SnmpBatchIo::flush() {
+  for (size_t i = 0; i < dirty_.size(); ++i) {
+    flush(*dirty_[i]);
+  }
+  dirty_.clear();
+}
+// }}}
+
+// bool SnmpBatchIo::drain(netsnmp_transport* t) {{{
+bool SnmpBatchIo::drain(netsnmp_transport* t) {
+  state_map::iterator it = states_.find(t);
+  if (it == states_.end()) {
+    return false;
+  }
+  size_t kCount = 0;
+
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr kMsgs[kBatch];
+  struct iovec kIov[kBatch];
+
+  memset(kMsgs, 0, sizeof(kMsgs));
+  for (size_t i = 0; i < kBatch; ++i) {
+    datagram& kDatagram = received_[i];
+    kIov[i].iov_base = &kDatagram.data_[0];
+    kIov[i].iov_len = kDatagram.data_.size();
+    kMsgs[i].msg_hdr.msg_iov = &kIov[i];
+    kMsgs[i].msg_hdr.msg_iovlen = 1;
+    kMsgs[i].msg_hdr.msg_name = &kDatagram.addr_;
+    kMsgs[i].msg_hdr.msg_namelen = sizeof(kDatagram.addr_);
+  }
+  int kResult = recvmmsg(t->sock, kMsgs, kBatch, MSG_DONTWAIT, NULL);
+  for (int i = 0; i < kResult; ++i) {
+    received_[i].length_ = kMsgs[i].msg_len;
+    received_[i].addrLength_ = kMsgs[i].msg_hdr.msg_namelen;
+  }
+  kCount = kResult > 0 ? kResult : 0;
+#else
+  for (; kCount < kBatch; ++kCount) {
+    datagram& kDatagram = received_[kCount];
+    kDatagram.addrLength_ = sizeof(kDatagram.addr_);
+    ssize_t kLength = recvfrom(t->sock, &kDatagram.data_[0],
+        kDatagram.data_.size(), MSG_DONTWAIT,
+        reinterpret_cast<struct sockaddr*>(&kDatagram.addr_),
+        &kDatagram.addrLength_);
+    if (kLength < 0) {
+      break;
+    }
+    kDatagram.length_ = kLength;
+  }
+#endif
+
+  // only the bytes received, shared buffers are free for the next drain
+  std::deque<datagram>& kQueue = it->second.incoming_;
+  for (size_t i = 0; i < kCount; ++i) {
+    const datagram& kReceived = received_[i];
+    kQueue.push_back(datagram());
+    datagram& kDatagram = kQueue.back();
+    kDatagram.data_.assign(kReceived.data_.begin(),
+        kReceived.data_.begin() + kReceived.length_);
+    kDatagram.length_ = kReceived.length_;
+    kDatagram.addr_ = kReceived.addr_;
+    kDatagram.addrLength_ = kReceived.addrLength_;
+  }
+  return true;
+}
+// }}}
+
+// bool SnmpBatchIo::pending(netsnmp_transport* t) {{{
+bool SnmpBatchIo::pending(netsnmp_transport* t) {
+  state_map::const_iterator it = states_.find(t);
+  return it != states_.end() && !it->second.incoming_.empty();
+}
+// }}}
+
+// }}}
+
+// ==== SnmpResolver {{{
+
+// waits for lookup of peer name started through SnmpSessionManager::resolve
+struct SnmpResolveClient {
+  // aAddress is numeric IPv4 address, empty when aError is set
+  virtual void onResolved(const std::string& aAddress, const char* aError) = 0;
+
+  virtual ~SnmpResolveClient() {}
+};
+
+/**
+ * Host names of peers resolved on a few helper threads (getaddrinfo blocks)
+ * and cached for ttl_, shared by all threads. Sessions open on the numeric
+ * address, so net-snmp never resolves on the loop thread.
+ */
+class SnmpResolver {
+  public:
+    // finished lookups of one manager, handed over to its loop by async_
+    struct mailbox {
+      struct job {
+        std::string host_;
+        std::string address_;
+        std::string error_;
+      };
+
+      ev_async* async_;
+#if EV_MULTIPLICITY
+      struct ev_loop* loop_;
+#endif
+      std::deque<job> done_;
+      unsigned jobs_;   // queued or running
+      bool closed_;     // manager is gone, deleted with its last job
+
+      mailbox() : async_(NULL), jobs_(0), closed_(false) {}
+    };
+
+    static const unsigned kMaxThreads = 4;
+
+  private:
+    struct cache_entry {
+      std::string address_;
+      double expires_;  // ms, SnmpSessionManager::nowMs clock
+    };
+    typedef std::map<std::string, cache_entry> cache_type;
+    typedef std::pair<std::string, mailbox*> request_type;
+
+    // everything below is guarded by lock_
+    static pthread_mutex_t lock_;
+    static pthread_cond_t wake_;
+    static cache_type cache_;
+    static std::deque<request_type> queue_;
+    static unsigned threads_;
+    static unsigned idle_;
+    static double ttl_;
+
+    static void* worker(void* aUnused);
+    static bool cachedLocked(const std::string& aHost, double aNow,
+        std::string* aAddress);
+    static bool lookupImpl(const std::string& aHost, std::string* aAddress,
+        std::string* aError);
+
+  public:
+    // "host", "host:port" and "udp:host[:port]" with non-numeric host need a
+    // lookup, other peer names (numeric, other transports, IPv6) go to
+    // net-snmp as they are
+    static bool split(const std::string& aPeer, std::string* aHost,
+        std::string* aPort);
+    // UDP peer net-snmp opens without a lookup: IPv4 or IPv6 address, with
+    // optional "udp:" / "udp6:" prefix and port ("[addr]:port" for IPv6)
+    static bool numeric(const std::string& aPeer);
+    // peer name for net-snmp with resolved address
+    static std::string numericPeer(const std::string& aAddress,
+        const std::string& aPort);
+
+    static bool cached(const std::string& aHost, std::string* aAddress);
+    // blocking lookup through the cache (sync requests)
+    static bool lookup(const std::string& aHost, std::string* aAddress);
+    // queue lookup, result goes to aMailbox
+    static void start(const std::string& aHost, mailbox* aMailbox);
+    // manager is going away
+    static void close(mailbox* aMailbox);
+    // take finished lookups
+    static void collect(mailbox* aMailbox, std::deque<mailbox::job>* aDone);
+
+    static void setTtl(double aTtl);
+};
+
+pthread_mutex_t SnmpResolver::lock_ = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t SnmpResolver::wake_ = PTHREAD_COND_INITIALIZER;
+SnmpResolver::cache_type SnmpResolver::cache_;
+std::deque<SnmpResolver::request_type> SnmpResolver::queue_;
+unsigned SnmpResolver::threads_ = 0;
+unsigned SnmpResolver::idle_ = 0;
+double SnmpResolver::ttl_ = 300000;
+
+// }}}
+
 // ==== SnmpSessionManager {{{
 
+// owner of requests  waiting to be sent (sessions), flushed by the manager at
+// prepare - everything queued during one loop iteration goes out ordered
+struct SnmpSendQueue {
+  virtual void flushPending() = 0;
+
+  virtual ~SnmpSendQueue() {}
+};
+
+// periodic work (poll jobs) sharing the one clock timer of the manager
+struct SnmpTimerClient {
+  virtual void onTimer() = 0;
+
+  virtual ~SnmpTimerClient() {}
+};
+
 class SnmpSessionManager {
   public:
     struct storage_el {
@@ -102,44 +696,143 @@ class SnmpSessionManager {
 
       ex_timeout() : active_(false), selfPtr_(NULL) {}
     };
+    struct ex_clock {
+      ev_timer watcher_;
+      bool active_;
+      double at_;   // ms, nowMs clock
+      SnmpSessionManager* selfPtr_;
+    };
+    struct ex_async {
+      ev_async watcher_;
+      bool active_;
+      SnmpSessionManager* selfPtr_;
+    };
+
+    typedef std::multimap<double, SnmpTimerClient*> timer_map;
+    typedef std::multimap<std::string, SnmpResolveClient*> resolve_map;
+
+    // admission control of all sessions of the manager, 0 - no limit
+    struct admission {
+      size_t maxRequests_;  // queued and in flight, walk steps included
+      size_t maxInFlight_;  // sent and waiting for response
+      double maxBytes_;     // walk results buffered in the binding
+      size_t requests_;
+      size_t inFlight_;
+      double bytes_;        // estimate, see SnmpWalk::store
+
+      admission()
+        : maxRequests_(0), maxInFlight_(0), maxBytes_(0), requests_(0),
+          inFlight_(0), bytes_(0) {}
+    };
 
   private:
     static SnmpSessionManager* defaultInst_;
 
     storage_type storage_;
+    std::vector<SnmpSendQueue*> scheduled_;
+    std::vector<SnmpSendQueue*> flushing_;  // being flushed right now
+    bool running_;  // prepare and check watchers are started
     ex_prepare prepare_;
     ex_check check_;
     ex_timeout timeout_;
+    timer_map timers_;  // due time -> client, see clock_cb
+    ex_clock clock_;
+    resolve_map resolving_; // host -> clients waiting for its lookup
+    ex_async resolved_;     // running while resolving_ is not empty
+    SnmpResolver::mailbox* mailbox_;
+    admission admission_;
+    std::vector<SnmpSendQueue*> throttled_; // wait for a free send slot
 #if EV_MULTIPLICITY
     struct ev_loop* loop_;
 #endif
 
-    SnmpSessionManager() {
+    SnmpSessionManager() : running_(false), mailbox_(NULL) {
       prepare_.selfPtr_ = this;
       check_.selfPtr_ = this;
       timeout_.selfPtr_ = this;
+      clock_.active_ = false;
+      clock_.at_ = 0;
+      clock_.selfPtr_ = this;
+      resolved_.active_ = false;
+      resolved_.selfPtr_ = this;
 #if EV_MULTIPLICITY
       loop_ = NULL;
 #endif
     }
 
+    void startWatchers();
+    void flushScheduled();
+
     SnmpSessionManager(const SnmpSessionManager&);
     SnmpSessionManager& operator==(const SnmpSessionManager&);
 
     void prepare_cb_impl(EV_P);
     void check_cb_impl(EV_P);
+    void clock_cb_impl();
+    void armClock();
+    void resolved_cb_impl();
+    void stopResolving();
 
   public:
     ~SnmpSessionManager() {
       assert(storage_.empty());
+      stopResolving();
+      if (mailbox_) {
+        SnmpResolver::close(mailbox_);
+      }
     }
 
     void addClient(void* aSnmp);
     void removeClient(void* aSnmp);
 
+    // flush aQueue at next prepare (once, schedule again to repeat)
+    void schedule(SnmpSendQueue* aQueue);
+    void unschedule(SnmpSendQueue* aQueue);
+
+    // descriptors not owned by net-snmp (trap listeners), watched for as long
+    // as they are started
+    void startWatcher(ev_io* aWatcher);
+    void stopWatcher(ev_io* aWatcher);
+    // timers of clients (request deadlines) on the same loop
+    void startTimer(ev_timer* aTimer);
+    void stopTimer(ev_timer* aTimer);
+
+    // call aClient->onTimer once at aAt (ms, nowMs clock). All clients share
+    // one timer armed to the earliest of them.
+    void addTimer(double aAt, SnmpTimerClient* aClient);
+    void removeTimer(double aAt, SnmpTimerClient* aClient);
+
+    // look aHost up off the loop thread. True when it is cached (aAddress is
+    // set right away), otherwise aClient->onResolved follows on this loop.
+    bool resolve(const std::string& aHost, SnmpResolveClient* aClient,
+        std::string* aAddress);
+    void cancelResolve(SnmpResolveClient* aClient);
+
+    // NULL when new request (or walk) may start, error to report otherwise.
+    // Steps of walks already running are not checked, see overBytes.
+    const char* admit() const;
+    // buffered walk results above the limit, running walks fail then
+    bool overBytes() const {
+      return admission_.maxBytes_ > 0 &&
+        admission_.bytes_ > admission_.maxBytes_;
+    }
+    void setLimits(size_t aRequests, size_t aInFlight, double aBytes);
+    const admission& admissionState() const { return admission_; }
+    // requests entering (positive) or leaving the queues of sessions
+    void countRequests(long aDelta) { admission_.requests_ += aDelta; }
+    void countBytes(double aDelta) { admission_.bytes_ += aDelta; }
+    // true when aQueue may send one more request now, otherwise it is
+    // scheduled again once a response frees a slot
+    bool acquireSend(SnmpSendQueue* aQueue);
+    void releaseSend(size_t aCount);
+
+    static double nowMs();
+
     static void prepare_cb(EV_P_ ev_prepare* w, int revents);
     static void check_cb(EV_P_ ev_check* w, int revents);
     static void timeout_cb(EV_P_ ev_timer* w, int revents);
+    static void clock_cb(EV_P_ ev_timer* w, int revents);
+    static void resolved_cb(EV_P_ ev_async* w, int revents);
 
     static SnmpSessionManager* default_inst();
 
@@ -177,12 +870,12 @@ void SnmpSessionManager::prepare_cb(
     EV_P_  ev_prepare* w, int revents)
 {
   ex_prepare* data = reinterpret_cast<ex_prepare*>(w);
-  assert(!data->selfPtr_->storage_.empty());
   data->selfPtr_->prepare_cb_impl(EV_A);
 }
 
 void SnmpSessionManager::prepare_cb_impl(EV_P) {
-  assert(!this->storage_.empty());
+  // requests queued in sessions go out first, they join storage_ as clients
+  flushScheduled();
 
 #ifndef NDEBUG
   // zero initialized, used for assert checks
@@ -196,6 +889,9 @@ void SnmpSessionManager::prepare_cb_impl(EV_P) {
 
   FD_ZERO(&readSet);
 
+  // everything sent during this loop iteration goes out now, in batches
+  SnmpBatchIo::flush();
+
   storage_iterator it_end = this->storage_.end();
   for(storage_iterator it = this->storage_.begin();
       it != it_end; ++it)
@@ -248,7 +944,6 @@ void SnmpSessionManager::check_cb(
     EV_P_   ev_check* w, int revents)
 {
   ex_check* data = reinterpret_cast<ex_check*>(w);
-  assert(!data->selfPtr_->storage_.empty());
   data->selfPtr_->check_cb_impl(EV_A);
 }
 
@@ -283,7 +978,16 @@ void SnmpSessionManager::check_cb_impl(EV_P) {
       fprintf(stderr, "read on fd %d\n", it->io_watcher_.fd);
 #endif
       FD_SET(it->io_watcher_.fd, &readSet);
-      snmp_sess_read(it->snmpHandle_, &readSet);
+      netsnmp_transport* kTransport = snmp_sess_transport(it->snmpHandle_);
+      if (SnmpBatchIo::drain(kTransport)) {
+        // callbacks can finish the last request of session, leave the rest
+        // (stray responses) unprocessed then
+        while (it->snmpHandle_ && SnmpBatchIo::pending(kTransport)) {
+          snmp_sess_read(it->snmpHandle_, &readSet);
+        }
+      } else {
+        snmp_sess_read(it->snmpHandle_, &readSet);
+      }
     } else {
       snmp_sess_timeout(it->snmpHandle_);
     }
@@ -295,28 +999,72 @@ void SnmpSessionManager::check_cb_impl(EV_P) {
     }
   }
 
-  if (storage_.empty()) {
+  if (storage_.empty() && scheduled_.empty()) {
     ev_prepare_stop(EV_A_   &this->prepare_.watcher_);
     ev_check_stop(EV_A_   &this->check_.watcher_);
+    running_ = false;
   }
 }
 
-void SnmpSessionManager::addClient(void* aSnmp) {
-  if (storage_.empty()) {
-    ev_prepare_init(&this->prepare_.watcher_, SnmpSessionManager::prepare_cb);
-    ev_check_init(&this->check_.watcher_, SnmpSessionManager::check_cb);
+void SnmpSessionManager::startWatchers() {
+  if (running_) {
+    return;
+  }
+  running_ = true;
+  ev_prepare_init(&this->prepare_.watcher_, SnmpSessionManager::prepare_cb);
+  ev_check_init(&this->check_.watcher_, SnmpSessionManager::check_cb);
 
 #if EV_MULTIPLICITY
-    ev_prepare_start(this->loop_, &this->prepare_.watcher_);
-    ev_check_start(this->loop_, &this->check_.watcher_);
+  ev_prepare_start(this->loop_, &this->prepare_.watcher_);
+  ev_check_start(this->loop_, &this->check_.watcher_);
 #else
-    ev_prepare_start(&this->prepare_.watcher_);
-    ev_check_start(&this->check_.watcher_);
+  ev_prepare_start(&this->prepare_.watcher_);
+  ev_check_start(&this->check_.watcher_);
 #endif
-  }
+}
+
+void SnmpSessionManager::addClient(void* aSnmp) {
+  startWatchers();
   storage_.push_front((storage_el){ aSnmp });
 }
 
+void SnmpSessionManager::schedule(SnmpSendQueue* aQueue) {
+  if (std::find(scheduled_.begin(), scheduled_.end(), aQueue) ==
+      scheduled_.end())
+  {
+    scheduled_.push_back(aQueue);
+  }
+  startWatchers();
+}
+
+void SnmpSessionManager::unschedule(SnmpSendQueue* aQueue) {
+  std::vector<SnmpSendQueue*>::iterator it =
+    std::find(scheduled_.begin(), scheduled_.end(), aQueue);
+  if (it != scheduled_.end()) {
+    scheduled_.erase(it);
+  }
+  throttled_.erase(std::remove(throttled_.begin(), throttled_.end(), aQueue),
+      throttled_.end());
+  // may be closed (or destroyed) by a callback during flush
+  std::replace(flushing_.begin(), flushing_.end(), aQueue,
+      static_cast<SnmpSendQueue*>(NULL));
+}
+
+void SnmpSessionManager::flushScheduled() {
+  // callbacks of failed sends can queue more requests, flush them too - the
+  // loop would block before next prepare otherwise
+  while (!scheduled_.empty()) {
+    assert(flushing_.empty());
+    flushing_.swap(scheduled_);
+    for (size_t i = 0; i < flushing_.size(); ++i) {
+      if (flushing_[i]) {
+        flushing_[i]->flushPending();
+      }
+    }
+    flushing_.clear();
+  }
+}
+
 namespace {
 struct handleFind {
   private:
@@ -341,41 +1089,540 @@ void SnmpSessionManager::removeClient(void* aSnmp) {
   it->snmpHandle_ = NULL;
 }
 
-// }}}
+void SnmpSessionManager::startWatcher(ev_io* aWatcher) {
+#if EV_MULTIPLICITY
+  ev_io_start(this->loop_, aWatcher);
+#else
+  ev_io_start(aWatcher);
+#endif
+}
 
+void SnmpSessionManager::stopWatcher(ev_io* aWatcher) {
+#if EV_MULTIPLICITY
+  ev_io_stop(this->loop_, aWatcher);
+#else
+  ev_io_stop(aWatcher);
+#endif
+}
 
+void SnmpSessionManager::startTimer(ev_timer* aTimer) {
+#if EV_MULTIPLICITY
+  ev_timer_start(this->loop_, aTimer);
+#else
+  ev_timer_start(aTimer);
+#endif
+}
 
-enum { VT_NUMBER, VT_TEXT, VT_OID, VT_RAW, VT_NULL };
+void SnmpSessionManager::stopTimer(ev_timer* aTimer) {
+#if EV_MULTIPLICITY
+  ev_timer_stop(this->loop_, aTimer);
+#else
+  ev_timer_stop(aTimer);
+#endif
+}
 
-// ===== class SnmpValue {{{
-class SnmpValue : public node::ObjectWrap {
-  private:
-    static Persistent<v8::FunctionTemplate> constructorTemplate_;
+double SnmpSessionManager::nowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
 
-    u_char type_;
-    std::vector<unsigned char> data_;
+const char* SnmpSessionManager::admit() const {
+  if (admission_.maxRequests_ &&
+      admission_.requests_ >= admission_.maxRequests_)
+  {
+    return "overloaded - request limit reached";
+  }
+  if (admission_.maxBytes_ > 0 && admission_.bytes_ >= admission_.maxBytes_) {
+    return "overloaded - result memory limit reached";
+  }
+  return NULL;
+}
 
-    SnmpValue() {}
+void SnmpSessionManager::setLimits(size_t aRequests, size_t aInFlight,
+    double aBytes)
+{
+  admission_.maxRequests_ = aRequests;
+  admission_.maxInFlight_ = aInFlight;
+  admission_.maxBytes_ = aBytes;
+  // raised limit - throttled sessions may go on
+  releaseSend(0);
+}
 
-  public:
-    static Handle<Value> GetType(const Arguments& args);
-    static Handle<Value> GetData(const Arguments& args);
+bool SnmpSessionManager::acquireSend(SnmpSendQueue* aQueue) {
+  if (admission_.maxInFlight_ &&
+      admission_.inFlight_ >= admission_.maxInFlight_)
+  {
+    if (std::find(throttled_.begin(), throttled_.end(), aQueue) ==
+        throttled_.end())
+    {
+      throttled_.push_back(aQueue);
+    }
+    return false;
+  }
+  ++admission_.inFlight_;
+  return true;
+}
 
-    static Handle<Value> New(u_char type, void* data, std::size_t length);
+void SnmpSessionManager::releaseSend(size_t aCount) {
+  assert(admission_.inFlight_ >= aCount);
+  admission_.inFlight_ -= aCount;
+  if (throttled_.empty() || (admission_.maxInFlight_ &&
+        admission_.inFlight_ >= admission_.maxInFlight_))
+  {
+    return;
+  }
+  // in order of throttling, the first ones take the free slots
+  std::vector<SnmpSendQueue*> kWaiting;
+  kWaiting.swap(throttled_);
+  for (size_t i = 0; i < kWaiting.size(); ++i) {
+    schedule(kWaiting[i]);
+  }
+}
 
-    static void Initialize(Handle<Object> target);
-};
+void SnmpSessionManager::addTimer(double aAt, SnmpTimerClient* aClient) {
+  timers_.insert(std::make_pair(aAt, aClient));
+  if (!clock_.active_ || aAt < clock_.at_) {
+    armClock();
+  }
+}
 
-Persistent<v8::FunctionTemplate> SnmpValue::constructorTemplate_;
+void SnmpSessionManager::removeTimer(double aAt, SnmpTimerClient* aClient) {
+  std::pair<timer_map::iterator, timer_map::iterator> kRange =
+    timers_.equal_range(aAt);
+  for (timer_map::iterator it = kRange.first; it != kRange.second; ++it) {
+    if (it->second == aClient) {
+      timers_.erase(it);
+      break;
+    }
+  }
+  if (timers_.empty() && clock_.active_) {
+    stopTimer(&clock_.watcher_);
+    clock_.active_ = false;
+  }
+}
 
-// Handle<Value> SnmpValue::GetType(const Arguments& args) {{{
-Handle<Value> SnmpValue::GetType(const Arguments& args) {
-  SnmpValue* inst = ObjectWrap::Unwrap<SnmpValue>(args.This());
+void SnmpSessionManager::armClock() {
+  if (clock_.active_) {
+    stopTimer(&clock_.watcher_);
+    clock_.active_ = false;
+  }
+  if (timers_.empty()) {
+    return;
+  }
+  clock_.at_ = timers_.begin()->first;
+  double kDelay = std::max(clock_.at_ - nowMs(), 0.0) / 1000;
+  ev_timer_init(&clock_.watcher_, &SnmpSessionManager::clock_cb, kDelay, 0.0);
+  startTimer(&clock_.watcher_);
+  clock_.active_ = true;
+}
 
-  int kResult = VT_RAW;
-  switch (inst->type_) {
-    case ASN_INTEGER:
-    case ASN_GAUGE:
+void SnmpSessionManager::clock_cb(EV_P_ ev_timer* w, int revents) {
+  ex_clock* data = reinterpret_cast<ex_clock*>(w);
+  data->active_ = false;
+  data->selfPtr_->clock_cb_impl();
+}
+
+void SnmpSessionManager::clock_cb_impl() {
+  // everything due within timer resolution, clients usually add themselves
+  // again for the next period
+  double kNow = nowMs() + 1;
+  while (!timers_.empty() && timers_.begin()->first <= kNow) {
+    SnmpTimerClient* kClient = timers_.begin()->second;
+    timers_.erase(timers_.begin());
+    kClient->onTimer();
+  }
+  armClock();
+}
+
+bool SnmpSessionManager::resolve(const std::string& aHost,
+    SnmpResolveClient* aClient, std::string* aAddress)
+{
+  if (SnmpResolver::cached(aHost, aAddress)) {
+    return true;
+  }
+  if (!mailbox_) {
+    mailbox_ = new SnmpResolver::mailbox();
+    mailbox_->async_ = &resolved_.watcher_;
+#if EV_MULTIPLICITY
+    mailbox_->loop_ = loop_;
+#endif
+    ev_async_init(&resolved_.watcher_, &SnmpSessionManager::resolved_cb);
+  }
+  if (!resolved_.active_) {
+    // keeps the loop alive until the lookups are done
+#if EV_MULTIPLICITY
+    ev_async_start(this->loop_, &resolved_.watcher_);
+#else
+    ev_async_start(&resolved_.watcher_);
+#endif
+    resolved_.active_ = true;
+  }
+  // one lookup for all sessions to the same host
+  bool kStarted = resolving_.find(aHost) != resolving_.end();
+  resolving_.insert(std::make_pair(aHost, aClient));
+  if (!kStarted) {
+    SnmpResolver::start(aHost, mailbox_);
+  }
+  return false;
+}
+
+void SnmpSessionManager::cancelResolve(SnmpResolveClient* aClient) {
+  // the lookup itself goes on, its result is cached
+  for (resolve_map::iterator it = resolving_.begin(); it != resolving_.end();) {
+    if (it->second == aClient) {
+      resolving_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  if (resolving_.empty()) {
+    stopResolving();
+  }
+}
+
+void SnmpSessionManager::stopResolving() {
+  if (resolved_.active_) {
+#if EV_MULTIPLICITY
+    ev_async_stop(this->loop_, &resolved_.watcher_);
+#else
+    ev_async_stop(&resolved_.watcher_);
+#endif
+    resolved_.active_ = false;
+  }
+}
+
+void SnmpSessionManager::resolved_cb(EV_P_ ev_async* w, int revents) {
+  ex_async* data = reinterpret_cast<ex_async*>(w);
+  data->selfPtr_->resolved_cb_impl();
+}
+
+void SnmpSessionManager::resolved_cb_impl() {
+  std::deque<SnmpResolver::mailbox::job> kDone;
+  SnmpResolver::collect(mailbox_, &kDone);
+
+  for (size_t i = 0; i < kDone.size(); ++i) {
+    const SnmpResolver::mailbox::job& kJob = kDone[i];
+    // clients may start or cancel other lookups from onResolved
+    std::vector<SnmpResolveClient*> kClients;
+    std::pair<resolve_map::iterator, resolve_map::iterator> kRange =
+      resolving_.equal_range(kJob.host_);
+    for (resolve_map::iterator it = kRange.first; it != kRange.second; ++it) {
+      kClients.push_back(it->second);
+    }
+    resolving_.erase(kRange.first, kRange.second);
+    for (size_t j = 0; j < kClients.size(); ++j) {
+      kClients[j]->onResolved(kJob.address_,
+          kJob.error_.empty() ? NULL : kJob.error_.c_str());
+    }
+  }
+  if (resolving_.empty()) {
+    stopResolving();
+  }
+}
+
+// }}}
+
+
+
+// ==== SnmpResolver methods {{{
+
+// bool SnmpResolver::split(...) {{{
+bool SnmpResolver::split(const std::string& aPeer, std::string* aHost,
+    std::string* aPort)
+{
+  std::string kRest = aPeer;
+  if (kRest.compare(0, 4, "udp:") == 0 || kRest.compare(0, 4, "UDP:") == 0) {
+    kRest.erase(0, 4);
+  }
+  size_t kColon = kRest.find(':');
+  aPort->clear();
+  if (kColon != std::string::npos) {
+    *aPort = kRest.substr(kColon + 1);
+    if (aPort->empty() ||
+        aPort->find_first_not_of("0123456789") != std::string::npos)
+    {
+      // another transport ("tcp:host") or IPv6
+      return false;
+    }
+  }
+  *aHost = kRest.substr(0, kColon);
+
+  struct in_addr kAddr;
+  return !aHost->empty() && aHost->find('[') == std::string::npos &&
+    inet_pton(AF_INET, aHost->c_str(), &kAddr) != 1;
+}
+// }}}
+
+// bool SnmpResolver::numeric(const std::string& aPeer) {{{
+bool SnmpResolver::numeric(const std::string& aPeer) {
+  std::string kRest = aPeer;
+  int kFamily = AF_INET;
+  if (kRest.compare(0, 4, "udp:") == 0 || kRest.compare(0, 4, "UDP:") == 0) {
+    kRest.erase(0, 4);
+  } else if (kRest.compare(0, 5, "udp6:") == 0 ||
+      kRest.compare(0, 5, "UDP6:") == 0)
+  {
+    kRest.erase(0, 5);
+    kFamily = AF_INET6;
+  }
+
+  std::string kHost;
+  std::string kPort;
+  if (!kRest.empty() && kRest[0] == '[') {
+    // "[addr]" or "[addr]:port"
+    size_t kClose = kRest.find(']');
+    if (kClose == std::string::npos) {
+      return false;
+    }
+    kHost = kRest.substr(1, kClose - 1);
+    if (kClose + 1 < kRest.size()) {
+      if (kRest[kClose + 1] != ':' || kClose + 2 == kRest.size()) {
+        return false;
+      }
+      kPort = kRest.substr(kClose + 2);
+    }
+    kFamily = AF_INET6;
+  } else if (kFamily == AF_INET && kRest.find(':') == kRest.rfind(':')) {
+    // IPv4, optional port
+    size_t kColon = kRest.find(':');
+    kHost = kRest.substr(0, kColon);
+    if (kColon != std::string::npos) {
+      kPort = kRest.substr(kColon + 1);
+      if (kPort.empty()) {
+        return false;
+      }
+    }
+  } else {
+    kHost = kRest;
+    kFamily = AF_INET6;
+  }
+  if (kPort.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+
+  struct in6_addr kAddr;
+  return inet_pton(kFamily, kHost.c_str(), &kAddr) == 1;
+}
+// }}}
+
+// std::string SnmpResolver::numericPeer(...) {{{
+std::string SnmpResolver::numericPeer(const std::string& aAddress,
+    const std::string& aPort)
+{
+  std::string kResult = "udp:" + aAddress;
+  if (!aPort.empty()) {
+    kResult += ":" + aPort;
+  }
+  return kResult;
+}
+// }}}
+
+// bool SnmpResolver::cachedLocked(...) {{{
+bool SnmpResolver::cachedLocked(const std::string& aHost, double aNow,
+    std::string* aAddress)
+{
+  cache_type::iterator it = cache_.find(aHost);
+  if (it == cache_.end()) {
+    return false;
+  }
+  if (it->second.expires_ <= aNow) {
+    cache_.erase(it);
+    return false;
+  }
+  *aAddress = it->second.address_;
+  return true;
+}
+// }}}
+
+// bool SnmpResolver::cached(const std::string& aHost, std::string* aAddress) {{{
+bool SnmpResolver::cached(const std::string& aHost, std::string* aAddress) {
+  double kNow = SnmpSessionManager::nowMs();
+  pthread_mutex_lock(&lock_);
+  bool kResult = cachedLocked(aHost, kNow, aAddress);
+  pthread_mutex_unlock(&lock_);
+  return kResult;
+}
+// }}}
+
+// bool SnmpResolver::lookupImpl(...) {{{
+bool SnmpResolver::lookupImpl(const std::string& aHost, std::string* aAddress,
+    std::string* aError)
+{
+  // net-snmp's udp transport is IPv4, so is the lookup
+  struct addrinfo kHints;
+  memset(&kHints, 0, sizeof(kHints));
+  kHints.ai_family = AF_INET;
+  kHints.ai_socktype = SOCK_DGRAM;
+
+  struct addrinfo* kInfo = NULL;
+  int kStatus = getaddrinfo(aHost.c_str(), NULL, &kHints, &kInfo);
+  if (kStatus != 0 || !kInfo) {
+    *aError = kStatus != 0 ? gai_strerror(kStatus) : "no address";
+    return false;
+  }
+  char kBuffer[INET_ADDRSTRLEN];
+  const struct sockaddr_in* kAddr =
+    reinterpret_cast<const struct sockaddr_in*>(kInfo->ai_addr);
+  inet_ntop(AF_INET, &kAddr->sin_addr, kBuffer, sizeof(kBuffer));
+  freeaddrinfo(kInfo);
+  *aAddress = kBuffer;
+
+  double kNow = SnmpSessionManager::nowMs();
+  pthread_mutex_lock(&lock_);
+  // ttl_ is written by setTtl on the loop thread
+  cache_entry& kEntry = cache_[aHost];
+  kEntry.address_ = *aAddress;
+  kEntry.expires_ = kNow + ttl_;
+  pthread_mutex_unlock(&lock_);
+  return true;
+}
+// }}}
+
+// bool SnmpResolver::lookup(const std::string& aHost, std::string* aAddress) {{{
+bool SnmpResolver::lookup(const std::string& aHost, std::string* aAddress) {
+  std::string kError;
+  return cached(aHost, aAddress) || lookupImpl(aHost, aAddress, &kError);
+}
+// }}}
+
+// void SnmpResolver::start(const std::string& aHost, mailbox* aMailbox) {{{
+void SnmpResolver::start(const std::string& aHost, mailbox* aMailbox) {
+  pthread_mutex_lock(&lock_);
+  ++aMailbox->jobs_;
+  queue_.push_back(std::make_pair(aHost, aMailbox));
+  if (idle_ == 0 && threads_ < kMaxThreads) {
+    pthread_t kThread;
+    if (pthread_create(&kThread, NULL, &SnmpResolver::worker, NULL) == 0) {
+      pthread_detach(kThread);
+      ++threads_;
+      ++idle_;
+    }
+  }
+  pthread_cond_signal(&wake_);
+  pthread_mutex_unlock(&lock_);
+}
+// }}}
+
+// void* SnmpResolver::worker(void* aUnused) {{{
+void* SnmpResolver::worker(void* aUnused) {
+  pthread_mutex_lock(&lock_);
+  for (;;) {
+    while (queue_.empty()) {
+      pthread_cond_wait(&wake_, &lock_);
+    }
+    request_type kRequest = queue_.front();
+    queue_.pop_front();
+    --idle_;
+
+    mailbox::job kJob;
+    kJob.host_ = kRequest.first;
+    if (!cachedLocked(kJob.host_, SnmpSessionManager::nowMs(),
+          &kJob.address_))
+    {
+      pthread_mutex_unlock(&lock_);
+      lookupImpl(kJob.host_, &kJob.address_, &kJob.error_);
+      pthread_mutex_lock(&lock_);
+    }
+
+    mailbox* kMailbox = kRequest.second;
+    --kMailbox->jobs_;
+    if (!kMailbox->closed_) {
+      kMailbox->done_.push_back(kJob);
+#if EV_MULTIPLICITY
+      ev_async_send(kMailbox->loop_, kMailbox->async_);
+#else
+      ev_async_send(kMailbox->async_);
+#endif
+    } else if (kMailbox->jobs_ == 0) {
+      delete kMailbox;
+    }
+    ++idle_;
+  }
+  return NULL;
+}
+// }}}
+
+// void SnmpResolver::close(mailbox* aMailbox) {{{
+void SnmpResolver::close(mailbox* aMailbox) {
+  pthread_mutex_lock(&lock_);
+  aMailbox->closed_ = true;
+  bool kUnused = aMailbox->jobs_ == 0;
+  pthread_mutex_unlock(&lock_);
+  if (kUnused) {
+    delete aMailbox;
+  }
+}
+// }}}
+
+// void SnmpResolver::collect(...) {{{
+void SnmpResolver::collect(mailbox* aMailbox, std::deque<mailbox::job>* aDone)
+{
+  pthread_mutex_lock(&lock_);
+  aDone->swap(aMailbox->done_);
+  pthread_mutex_unlock(&lock_);
+}
+// }}}
+
+// void SnmpResolver::setTtl(double aTtl) {{{
+void SnmpResolver::setTtl(double aTtl) {
+  pthread_mutex_lock(&lock_);
+  ttl_ = aTtl;
+  if (aTtl <= 0) {
+    cache_.clear();
+  }
+  pthread_mutex_unlock(&lock_);
+}
+// }}}
+
+// }}}
+
+
+
+enum { VT_NUMBER, VT_TEXT, VT_OID, VT_RAW, VT_NULL };
+
+// ===== class SnmpValue {{{
+class SnmpValue : public node::ObjectWrap {
+  private:
+    static Persistent<v8::FunctionTemplate> constructorTemplate_;
+
+    u_char type_;
+    std::vector<unsigned char> data_;
+
+    SnmpValue() {}
+
+  public:
+    static Handle<Value> GetType(const Arguments& args);
+    static Handle<Value> GetData(const Arguments& args);
+    static Handle<Value> Format(const Arguments& args);
+
+    // NULL when aValue is not Value object
+    static SnmpValue* FromV8(Handle<Value> aValue);
+
+    u_char type() const { return type_; }
+    const std::vector<unsigned char>& data() const { return data_; }
+
+    static Handle<Value> New(u_char type, void* data, std::size_t length);
+    // plain JS number for numeric types, empty handle for anything else
+    static Handle<Value> NewPrimitive(
+        u_char type, const void* data, std::size_t length);
+    // NewPrimitive when aPrimitive is set and the type allows it, New otherwise
+    static Handle<Value> New(
+        u_char type, void* data, std::size_t length, bool aPrimitive);
+
+    static void Initialize(Handle<Object> target);
+};
+
+Persistent<v8::FunctionTemplate> SnmpValue::constructorTemplate_;
+
+// Handle<Value> SnmpValue::GetType(const Arguments& args) {{{
+Handle<Value> SnmpValue::GetType(const Arguments& args) {
+  SnmpValue* inst = ObjectWrap::Unwrap<SnmpValue>(args.This());
+
+  int kResult = VT_RAW;
+  switch (inst->type_) {
+    case ASN_INTEGER:
+    case ASN_GAUGE:
     case ASN_COUNTER:
     case ASN_UINTEGER:
     case ASN_TIMETICKS:
@@ -524,6 +1771,15 @@ Handle<Value> SnmpValue::GetData(const Arguments& args) {
 }
 // }}}
 
+// SnmpValue* SnmpValue::FromV8(Handle<Value> aValue) {{{
+SnmpValue* SnmpValue::FromV8(Handle<Value> aValue) {
+  if (!constructorTemplate_->HasInstance(aValue)) {
+    return NULL;
+  }
+  return ObjectWrap::Unwrap<SnmpValue>(aValue->ToObject());
+}
+// }}}
+
 // Handle<Value> SnmpValue::New(...) {{{
 Handle<Value> SnmpValue::New(u_char type, void* data, std::size_t length) {
   HandleScope kScope;
@@ -531,7 +1787,9 @@ Handle<Value> SnmpValue::New(u_char type, void* data, std::size_t length) {
   SnmpValue* v = new SnmpValue();
   v->type_ = type;
   v->data_.resize(length);
-  memcpy(&v->data_[0], data, length);
+  if (length) {
+    memcpy(&v->data_[0], data, length);
+  }
 
   Local<Object> b = constructorTemplate_->GetFunction()->NewInstance(0, NULL);
 
@@ -540,6 +1798,69 @@ Handle<Value> SnmpValue::New(u_char type, void* data, std::size_t length) {
 }
 // }}}
 
+// Handle<Value> SnmpValue::NewPrimitive(...) {{{
+Handle<Value> SnmpValue::NewPrimitive(
+    u_char type, const void* data, std::size_t length)
+{
+  HandleScope kScope;
+
+  netsnmp_vardata v;
+  v.string = static_cast<u_char*>(const_cast<void*>(data));
+
+  switch (type) {
+    case ASN_INTEGER:
+      if (length < sizeof(long)) {
+        break;
+      }
+      return kScope.Close(v8::Int32::New(*v.integer));
+    case ASN_GAUGE:
+    case ASN_COUNTER:
+    case ASN_UINTEGER:
+    case ASN_TIMETICKS:
+      if (length < sizeof(long)) {
+        break;
+      }
+      return kScope.Close(v8::Uint32::New(*((unsigned int*)v.integer)));
+    case ASN_COUNTER64:
+      {
+        if (length < sizeof(struct counter64)) {
+          break;
+        }
+        uint64_t buf = v.counter64->high & 0xFFFFFFFF;
+        buf <<= 32;
+        buf |= v.counter64->low & 0xFFFFFFFF;
+        // exact in double up to 2^53, bigger values go out as decimal string
+        // (no BigInt in our V8)
+        if (buf <= (static_cast<uint64_t>(1) << 53)) {
+          return kScope.Close(v8::Number::New(static_cast<double>(buf)));
+        }
+        char str[24];
+        snprintf(str, sizeof(str), "%llu",
+            static_cast<unsigned long long>(buf));
+        return kScope.Close(String::New(str));
+      }
+    default:
+      break;
+  }
+  return Handle<Value>();
+}
+// }}}
+
+// Handle<Value> SnmpValue::New(...) {{{
+Handle<Value> SnmpValue::New(
+    u_char type, void* data, std::size_t length, bool aPrimitive)
+{
+  if (aPrimitive) {
+    HandleScope kScope;
+    Handle<Value> kResult = NewPrimitive(type, data, length);
+    if (!kResult.IsEmpty()) {
+      return kScope.Close(kResult);
+    }
+  }
+  return New(type, data, length);
+}
+// }}}
+
 // stolen and modified from node.h
 #define SNMP_DEFINE_HIDDEN_CONSTANT(target, constant)                     \
   (target)->Set(v8::String::NewSymbol(#constant),                         \
@@ -560,6 +1881,7 @@ void SnmpValue::Initialize(Handle<Object> target) {
 
   NODE_SET_PROTOTYPE_METHOD(t, "GetType", SnmpValue::GetType);
   NODE_SET_PROTOTYPE_METHOD(t, "GetData", SnmpValue::GetData);
+  NODE_SET_PROTOTYPE_METHOD(t, "Format", SnmpValue::Format);
 
   target->Set(String::NewSymbol("Value"),
       constructorTemplate_->GetFunction());
@@ -584,653 +1906,6263 @@ void SnmpValue::Initialize(Handle<Object> target) {
 
 
 
-// Using Array of Uint32 should be OK,  OIDs are limited to 0..2^32 range, even
-// when  the  underlying type  is  8  bytes  integer  on amd64  platforms  (see
-// MAX_SUBID in net-snmp types.h).
-// v8::Handle<v8::Value> read_objid_wrapper(const Arguments& args) {{{
-v8::Handle<v8::Value> read_objid_wrapper(const Arguments& args) {
-  HandleScope kScope;
+// ==== class SnmpMibLoader {{{
 
-  if (args.Length() != 1) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - missing aOid")));
-  }
-  if (!args[0]->IsString()) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - string expected")));
-  }
+/**
+ * Parsing all MIB  files takes seconds, and most users of  this module don't
+ * need them (numeric OIDs only). init_snmp is  called with MIBS and MIBDIRS
+ * set empty (-m '' -M ''), MIB modules are loaded with user settings first
+ * time a symbolic name has to be resolved or a value formatted.
+ *
+ * Symbolic  names can  also  be resolved  without  loading  MIBs, from  cache
+ * file  created by  setCache -  memory  mapped table  of all  unique labels  of
+ * the MIB tree and their OIDs (sorted by label, binary search). When the file
+ * does not exist yet, it is written when MIBs get loaded. Cache is not checked
+ * against MIB files, remove it when they change.
+ */
+class SnmpMibLoader {
+  private:
+    // file layout: header, entries sorted by label, pool of labels and OIDs.
+    // Numbers are in host byte order.
+    struct cache_header {
+      char magic_[4];
+      uint32_t version_;
+      uint32_t count_;
+      uint32_t poolSize_;
+    };
+    struct cache_entry {
+      uint32_t label_;        // byte offset in pool
+      uint32_t labelLength_;
+      uint32_t oid_;          // byte offset in pool, uint32 aligned
+      uint32_t oidLength_;    // in subids
+    };
 
-  oid oid[MAX_OID_LEN];
-  std::size_t oidLength = MAX_OID_LEN;
+    static bool loaded_;
+    static unsigned generation_;
+    static std::string cachePath_;
+    static void* map_;
+    static size_t mapSize_;
+    static const cache_entry* entries_;
+    static const char* pool_;
+    static uint32_t count_;
+
+    static bool mapCache(const char* aPath);
+    static void unmapCache();
+    static bool writeCache(const char* aPath);
+    static bool lookup(const char* aLabel, size_t aLength,
+        oid* aOid, size_t* aOidLength);
+    static bool isNumeric(const char* aName);
 
+  public:
+    static void initialize(const char* aType);
+    // load MIB modules if they were not loaded yet
+    static void ensureLoaded();
+    // incremented whenever MIB tree changes
+    static unsigned generation() { return generation_; }
+    static bool setCache(const std::string& aPath);
+
+    // read_objid/snmp_parse_oid, loading MIBs only when really needed
+    static bool parse(const char* aName, oid* aOid, size_t* aOidLength,
+        bool aSymbolic);
+};
 
-  if (!read_objid(*String::Utf8Value(args[0]->ToString()), oid, &oidLength)) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - cannot parse oid")));
+bool SnmpMibLoader::loaded_ = false;
+unsigned SnmpMibLoader::generation_ = 0;
+std::string SnmpMibLoader::cachePath_;
+void* SnmpMibLoader::map_ = NULL;
+size_t SnmpMibLoader::mapSize_ = 0;
+const SnmpMibLoader::cache_entry* SnmpMibLoader::entries_ = NULL;
+const char* SnmpMibLoader::pool_ = NULL;
+uint32_t SnmpMibLoader::count_ = 0;
+
+static const char kMibCacheMagic[4] = { 'S', 'N', 'M', 'C' };
+static const uint32_t kMibCacheVersion = 1;
+
+// void SnmpMibLoader::initialize(const char* aType) {{{
+void SnmpMibLoader::initialize(const char* aType) {
+  const char* kVars[2] = { "MIBS", "MIBDIRS" };
+  std::string kSaved[2];
+  bool kWasSet[2];
+
+  for (int i = 0; i < 2; ++i) {
+    const char* v = getenv(kVars[i]);
+    kWasSet[i] = (v != NULL);
+    if (v) {
+      kSaved[i] = v;
+    }
+    setenv(kVars[i], "", 1);
   }
 
-  Local<Array> result = v8::Array::New(oidLength);
-  for (size_t i = 0; i < oidLength; ++i) {
-    result->Set(i,
-        v8::Integer::NewFromUnsigned(
-          static_cast<uint32_t>(oid[i] & 0xFFFFFFFF)));
+  init_snmp(aType);
+
+  // restore, so ensureLoaded (and child processes) see user settings
+  for (int i = 0; i < 2; ++i) {
+    if (kWasSet[i]) {
+      setenv(kVars[i], kSaved[i].c_str(), 1);
+    } else {
+      unsetenv(kVars[i]);
+    }
   }
-  return kScope.Close(result);
 }
 // }}}
 
-// v8::Handle<v8::Value> parse_oid_wrapper(const Arguments& args) {{{
-v8::Handle<v8::Value> parse_oid_wrapper(const Arguments& args) {
-  HandleScope kScope;
-
-  if (args.Length() != 1) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - missing aOid")));
+// void SnmpMibLoader::ensureLoaded() {{{
+void SnmpMibLoader::ensureLoaded() {
+  if (loaded_) {
+    return;
   }
-  if (!args[0]->IsString()) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - string expected")));
+  loaded_ = true;
+  shutdown_mib();
+  // init_snmp left the empty MIBDIRS of initialize in the default store,
+  // without it net-snmp takes restored MIBDIRS (or its default) again
+  netsnmp_ds_set_string(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_MIBDIRS, NULL);
+  netsnmp_init_mib();
+  ++generation_;
+
+  if (!cachePath_.empty() && !map_) {
+    writeCache(cachePath_.c_str());
   }
+}
+// }}}
 
-  oid oid[MAX_OID_LEN];
-  std::size_t oidLength = MAX_OID_LEN;
-
-
-  if (!snmp_parse_oid(*String::Utf8Value(args[0]->ToString()), oid, &oidLength)) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - cannot parse oid")));
+// bool SnmpMibLoader::setCache(const std::string& aPath) {{{
+bool SnmpMibLoader::setCache(const std::string& aPath) {
+  unmapCache();
+  cachePath_ = aPath;
+  if (mapCache(aPath.c_str())) {
+    return true;
   }
-
-  Local<Array> result = v8::Array::New(oidLength);
-  for (size_t i = 0; i < oidLength; ++i) {
-    result->Set(i,
-        v8::Integer::NewFromUnsigned(
-          static_cast<uint32_t>(oid[i] & 0xFFFFFFFF)));
+  if (loaded_) {
+    // nothing to wait for
+    return writeCache(aPath.c_str());
   }
-  return kScope.Close(result);
+  // written on first load
+  return true;
 }
 // }}}
 
+// bool SnmpMibLoader::mapCache(const char* aPath) {{{
+bool SnmpMibLoader::mapCache(const char* aPath) {
+  int fd = open(aPath, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(cache_header))
+  {
+    close(fd);
+    return false;
+  }
+  size_t kSize = st.st_size;
+  void* kMap = mmap(NULL, kSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (kMap == MAP_FAILED) {
+    return false;
+  }
 
+  const cache_header* h = static_cast<const cache_header*>(kMap);
+  size_t kEntriesSize = static_cast<size_t>(h->count_) * sizeof(cache_entry);
+  if (memcmp(h->magic_, kMibCacheMagic, sizeof(kMibCacheMagic)) != 0 ||
+      h->version_ != kMibCacheVersion ||
+      kSize != sizeof(cache_header) + kEntriesSize + h->poolSize_)
+  {
+    munmap(kMap, kSize);
+    return false;
+  }
 
+  map_ = kMap;
+  mapSize_ = kSize;
+  count_ = h->count_;
+  entries_ = reinterpret_cast<const cache_entry*>(h + 1);
+  pool_ = reinterpret_cast<const char*>(entries_ + count_);
+
+  // validate once, lookups trust the offsets
+  for (uint32_t i = 0; i < count_; ++i) {
+    const cache_entry& e = entries_[i];
+    if (e.label_ + static_cast<uint64_t>(e.labelLength_) > h->poolSize_ ||
+        e.oid_ % sizeof(uint32_t) != 0 || e.oidLength_ > MAX_OID_LEN ||
+        e.oid_ + static_cast<uint64_t>(e.oidLength_) * sizeof(uint32_t)
+          > h->poolSize_)
+    {
+      unmapCache();
+      return false;
+    }
+  }
+  return true;
+}
+// }}}
+
+// void SnmpMibLoader::unmapCache() {{{
+void SnmpMibLoader::unmapCache() {
+  if (map_) {
+    munmap(map_, mapSize_);
+  }
+  map_ = NULL;
+  mapSize_ = 0;
+  entries_ = NULL;
+  pool_ = NULL;
+  count_ = 0;
+}
+// }}}
+
+namespace {
+struct mib_label {
+  std::string label_;
+  std::vector<uint32_t> oid_;
+
+  bool operator<(const mib_label& aOther) const {
+    return label_ < aOther.label_;
+  }
+};
+
+// void collectLabels(...) {{{
+void collectLabels(struct tree* aTree, std::vector<uint32_t>* aPath,
+    std::vector<mib_label>* aLabels)
+{
+  for (struct tree* t = aTree; t; t = t->next_peer) {
+    aPath->push_back(static_cast<uint32_t>(t->subid));
+    if (t->label && *t->label) {
+      aLabels->resize(aLabels->size() + 1);
+      aLabels->back().label_ = t->label;
+      aLabels->back().oid_ = *aPath;
+    }
+    collectLabels(t->child_list, aPath, aLabels);
+    aPath->pop_back();
+  }
+}
+// }}}
+}
+
+// bool SnmpMibLoader::writeCache(const char* aPath) {{{
+bool SnmpMibLoader::writeCache(const char* aPath) {
+  std::vector<mib_label> kLabels;
+  std::vector<uint32_t> kPath;
+  collectLabels(get_tree_head(), &kPath, &kLabels);
+  std::stable_sort(kLabels.begin(), kLabels.end());
+
+  // labels defined at more than one place are left out, lookup of them will
+  // load MIBs and let net-snmp decide
+  std::vector<mib_label> kUnique;
+  for (size_t i = 0; i < kLabels.size(); ) {
+    size_t j = i + 1;
+    bool kAmbiguous = false;
+    for (; j < kLabels.size() && kLabels[j].label_ == kLabels[i].label_; ++j) {
+      if (kLabels[j].oid_ != kLabels[i].oid_) {
+        kAmbiguous = true;
+      }
+    }
+    if (!kAmbiguous) {
+      kUnique.push_back(kLabels[i]);
+    }
+    i = j;
+  }
+
+  // OIDs first - keeps them aligned, labels follow
+  std::string kPool;
+  std::vector<cache_entry> kEntries(kUnique.size());
+  for (size_t i = 0; i < kUnique.size(); ++i) {
+    kEntries[i].oid_ = kPool.size();
+    kEntries[i].oidLength_ = kUnique[i].oid_.size();
+    kPool.append(reinterpret_cast<const char*>(&kUnique[i].oid_[0]),
+        kUnique[i].oid_.size() * sizeof(uint32_t));
+  }
+  for (size_t i = 0; i < kUnique.size(); ++i) {
+    kEntries[i].label_ = kPool.size();
+    kEntries[i].labelLength_ = kUnique[i].label_.size();
+    kPool.append(kUnique[i].label_);
+  }
+
+  cache_header h;
+  memcpy(h.magic_, kMibCacheMagic, sizeof(kMibCacheMagic));
+  h.version_ = kMibCacheVersion;
+  h.count_ = kEntries.size();
+  h.poolSize_ = kPool.size();
+
+  // write to temporary file and rename, concurrent starts never see partial
+  // cache
+  std::string kTmp = std::string(aPath) + ".tmp";
+  int fd = open(kTmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool kOk =
+    write(fd, &h, sizeof(h)) == static_cast<ssize_t>(sizeof(h)) &&
+    (kEntries.empty() ||
+     write(fd, &kEntries[0], kEntries.size() * sizeof(cache_entry)) ==
+       static_cast<ssize_t>(kEntries.size() * sizeof(cache_entry))) &&
+    write(fd, kPool.data(), kPool.size()) ==
+      static_cast<ssize_t>(kPool.size());
+  close(fd);
+  if (!kOk || rename(kTmp.c_str(), aPath) != 0) {
+    unlink(kTmp.c_str());
+    return false;
+  }
+  return true;
+}
+// }}}
+
+// bool SnmpMibLoader::lookup(...) {{{
+bool SnmpMibLoader::lookup(const char* aLabel, size_t aLength,
+    oid* aOid, size_t* aOidLength)
+{
+  uint32_t lo = 0;
+  uint32_t hi = count_;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const cache_entry& e = entries_[mid];
+    int c = memcmp(pool_ + e.label_, aLabel,
+        std::min<size_t>(e.labelLength_, aLength));
+    if (c == 0) {
+      c = (e.labelLength_ < aLength) ? -1 : (e.labelLength_ > aLength);
+    }
+    if (c == 0) {
+      if (e.oidLength_ > *aOidLength) {
+        return false;
+      }
+      const uint32_t* kOid =
+        reinterpret_cast<const uint32_t*>(pool_ + e.oid_);
+      for (uint32_t i = 0; i < e.oidLength_; ++i) {
+        aOid[i] = kOid[i];
+      }
+      *aOidLength = e.oidLength_;
+      return true;
+    }
+    if (c < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return false;
+}
+// }}}
+
+// bool SnmpMibLoader::isNumeric(const char* aName) {{{
+bool SnmpMibLoader::isNumeric(const char* aName) {
+  for (; *aName; ++aName) {
+    if (*aName != '.' && (*aName < '0' || *aName > '9')) {
+      return false;
+    }
+  }
+  return true;
+}
+// }}}
+
+// bool SnmpMibLoader::parse(...) {{{
+bool SnmpMibLoader::parse(const char* aName, oid* aOid, size_t* aOidLength,
+    bool aSymbolic)
+{
+  if (!loaded_ && !isNumeric(aName)) {
+    // [MODULE::]label[.N.N...] can be resolved from cache, anything else
+    // (quoted index, label path...) needs the MIBs. Module is not checked,
+    // labels in cache are unique.
+    const char* kLabel = strstr(aName, "::");
+    kLabel = kLabel ? kLabel + 2 : aName;
+    const char* kSuffix = strchr(kLabel, '.');
+    size_t kLabelLength = kSuffix ? kSuffix - kLabel : strlen(kLabel);
+    size_t kLength = *aOidLength;
+
+    // read_objid resolves plain labels relative to mib-2, not by random
+    // access like snmp_parse_oid, so cache only serves the latter
+    if (aSymbolic && map_ && (!kSuffix || isNumeric(kSuffix)) &&
+        lookup(kLabel, kLabelLength, aOid, &kLength))
+    {
+      while (kSuffix && *kSuffix == '.' && kLength < *aOidLength) {
+        char* kEnd;
+        aOid[kLength++] = strtoul(kSuffix + 1, &kEnd, 10);
+        if (kEnd == kSuffix + 1) {
+          break;
+        }
+        kSuffix = kEnd;
+      }
+      if (!kSuffix || !*kSuffix) {
+        *aOidLength = kLength;
+        return true;
+      }
+    }
+    ensureLoaded();
+  }
+  if (aSymbolic) {
+    return snmp_parse_oid(aName, aOid, aOidLength) != NULL;
+  }
+  return read_objid(aName, aOid, aOidLength) != 0;
+}
+// }}}
+
+// }}}
+
+
+
+// Using Array of Uint32 should be OK,  OIDs are limited to 0..2^32 range, even
+// when  the  underlying type  is  8  bytes  integer  on amd64  platforms  (see
+// MAX_SUBID in net-snmp types.h).
+// v8::Handle<v8::Value> read_objid_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> read_objid_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  if (args.Length() != 1) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - missing aOid")));
+  }
+  if (!args[0]->IsString()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - string expected")));
+  }
+
+  oid oid[MAX_OID_LEN];
+  std::size_t oidLength = MAX_OID_LEN;
+
+
+  if (!SnmpMibLoader::parse(*String::Utf8Value(args[0]->ToString()),
+        oid, &oidLength, false))
+  {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - cannot parse oid")));
+  }
+
+  Local<Array> result = v8::Array::New(oidLength);
+  for (size_t i = 0; i < oidLength; ++i) {
+    result->Set(i,
+        v8::Integer::NewFromUnsigned(
+          static_cast<uint32_t>(oid[i] & 0xFFFFFFFF)));
+  }
+  return kScope.Close(result);
+}
+// }}}
+
+// v8::Handle<v8::Value> batch_io_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> batch_io_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  if (args.Length() != 1 || !args[0]->IsBoolean()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - boolean expected")));
+  }
+  // applies to sessions opened from now on
+  SnmpBatchIo::enable(args[0]->BooleanValue());
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// v8::Handle<v8::Value> trace_enable_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> trace_enable_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  if (args.Length() != 1 || !args[0]->IsBoolean()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - boolean expected")));
+  }
+  // USDT probes stay, only the ring stops recording
+  SnmpTrace::enable(args[0]->BooleanValue());
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// v8::Handle<v8::Value> trace_dump_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> trace_dump_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  std::vector<SnmpTrace::entry> kEntries;
+  SnmpTrace::dump(&kEntries, args.Length() > 0 && args[0]->BooleanValue());
+
+  Local<String> kTime = String::NewSymbol("time");
+  Local<String> kEvent = String::NewSymbol("event");
+  Local<String> kSession = String::NewSymbol("session");
+  Local<String> kReqId = String::NewSymbol("reqid");
+
+  Local<Array> kResult = v8::Array::New(kEntries.size());
+  for (size_t i = 0; i < kEntries.size(); ++i) {
+    Local<Object> kItem = v8::Object::New();
+    kItem->Set(kTime, v8::Number::New(kEntries[i].time_));
+    kItem->Set(kEvent, String::NewSymbol(SnmpTrace::name(kEntries[i].event_)));
+    kItem->Set(kSession, v8::Integer::NewFromUnsigned(kEntries[i].session_));
+    kItem->Set(kReqId, v8::Integer::New(kEntries[i].reqid_));
+    kResult->Set(i, kItem);
+  }
+  return kScope.Close(kResult);
+}
+// }}}
+
+// v8::Handle<v8::Value> set_admission_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> set_admission_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  // call with (max requests, max in flight, max result bytes), 0 - no limit
+  if (args.Length() != 3) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  for (int i = 0; i < 3; ++i) {
+    if (!args[i]->IsNumber() || args[i]->NumberValue() < 0) {
+      return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+              "invalid arguments - limits must be non-negative numbers")));
+    }
+  }
+  // limits of all sessions of the default loop, checked from now on
+  SnmpSessionManager::default_inst()->setLimits(
+      static_cast<size_t>(args[0]->NumberValue()),
+      static_cast<size_t>(args[1]->NumberValue()), args[2]->NumberValue());
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// v8::Handle<v8::Value> admission_state_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> admission_state_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  const SnmpSessionManager::admission& kState =
+    SnmpSessionManager::default_inst()->admissionState();
+  Local<Object> kResult = v8::Object::New();
+  kResult->Set(String::NewSymbol("requests"),
+      v8::Number::New(kState.requests_));
+  kResult->Set(String::NewSymbol("inFlight"),
+      v8::Number::New(kState.inFlight_));
+  kResult->Set(String::NewSymbol("bytes"), v8::Number::New(kState.bytes_));
+  return kScope.Close(kResult);
+}
+// }}}
+
+// v8::Handle<v8::Value> rates_to_array_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> rates_to_array_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  // Buffer of little endian doubles (rate option) to array of numbers, for
+  // node versions without Buffer.readDoubleLE
+  if (args.Length() != 1 || !args[0]->IsObject() ||
+      !args[0]->ToObject()->HasIndexedPropertiesInExternalArrayData() ||
+      args[0]->ToObject()->GetIndexedPropertiesExternalArrayDataType() !=
+        v8::kExternalUnsignedByteArray)
+  {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - Buffer expected")));
+  }
+  Local<Object> kRates = args[0]->ToObject();
+  const unsigned char* kData = static_cast<const unsigned char*>(
+      kRates->GetIndexedPropertiesExternalArrayData());
+  int kCount = kRates->GetIndexedPropertiesExternalArrayDataLength() /
+    sizeof(uint64_t);
+  Local<Array> kResult = v8::Array::New(kCount);
+  for (int i = 0; i < kCount; ++i) {
+    uint64_t kBits = 0;
+    for (size_t k = 0; k < sizeof(kBits); ++k) {
+      kBits |= static_cast<uint64_t>(*kData++) << (8 * k);
+    }
+    double kValue;
+    memcpy(&kValue, &kBits, sizeof(kValue));
+    kResult->Set(i, v8::Number::New(kValue));
+  }
+  return kScope.Close(kResult);
+}
+// }}}
+
+// v8::Handle<v8::Value> set_dns_ttl_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> set_dns_ttl_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - TTL in ms expected")));
+  }
+  // applies to lookups from now on, 0 (or less) also drops the cache
+  SnmpResolver::setTtl(args[0]->NumberValue());
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// v8::Handle<v8::Value> set_mib_cache_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> set_mib_cache_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  if (args.Length() != 1 || !args[0]->IsString()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - path expected")));
+  }
+  if (!SnmpMibLoader::setCache(*String::Utf8Value(args[0]->ToString()))) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("cannot write mib cache")));
+  }
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// v8::Handle<v8::Value> load_mibs_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> load_mibs_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  SnmpMibLoader::ensureLoaded();
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// v8::Handle<v8::Value> parse_oid_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> parse_oid_wrapper(const Arguments& args) {
+  HandleScope kScope;
+
+  if (args.Length() != 1) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - missing aOid")));
+  }
+  if (!args[0]->IsString()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - string expected")));
+  }
+
+  oid oid[MAX_OID_LEN];
+  std::size_t oidLength = MAX_OID_LEN;
+
+
+  if (!SnmpMibLoader::parse(*String::Utf8Value(args[0]->ToString()),
+        oid, &oidLength, true))
+  {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - cannot parse oid")));
+  }
+
+  Local<Array> result = v8::Array::New(oidLength);
+  for (size_t i = 0; i < oidLength; ++i) {
+    result->Set(i,
+        v8::Integer::NewFromUnsigned(
+          static_cast<uint32_t>(oid[i] & 0xFFFFFFFF)));
+  }
+  return kScope.Close(result);
+}
+// }}}
+
+
+
+
+
+
+// requests waiting to be sent go out in this order, FIFO within a level
+enum request_priority { PRIORITY_HIGH, PRIORITY_NORMAL, PRIORITY_LOW };
+static const int kPriorityLevels = PRIORITY_LOW + 1;
+
+// options common to all requests of a session
+struct request_options {
+  bool primitive_;  // numbers instead of Value objects where possible
+  double cacheTtl_; // ms, response cache lifetime for OIDs without own TTL
+  int priority_;    // request_priority, for all steps of a walk
+  double deadline_; // ms, relative when parsed, absolute (see
+                    // SnmpSession::Track) afterwards, 0 - none
+  unsigned id_;     // handle for Cancel, shared by all steps of a walk
+  bool rate_;       // deltas and rates of counters instead of values
+  int format_;      // output_format, results written to output_ if not none
+  char* output_;    // Buffer data, kept alive as hidden value of callback
+  size_t outputLength_;
+  bool continuation_; // step of a walk already admitted, see admit(), set
+                      // by internal argument of PerformRequest only
+  long nonRepeaters_;   // GetBulk only
+  long maxRepetitions_;
+
+  request_options()
+    : primitive_(false), cacheTtl_(0), priority_(PRIORITY_NORMAL),
+      deadline_(0), id_(0), rate_(false), format_(0), output_(NULL),
+      outputLength_(0), continuation_(false), nonRepeaters_(0),
+      maxRepetitions_(10) {}
+};
+
+
+
+// ===== class SnmpResult : public node::ObjectWrap {{{
+class SnmpResult : public node::ObjectWrap {
+  public:
+    // with aPrimitive, numeric values are plain numbers and the object gets
+    // 'type' property with ASN type of the value
+    static Local<Object> New(netsnmp_variable_list* var,
+        bool aPrimitive = false);
+
+    static void Initialize(Handle<Object> target);
+};
+
+// Local<Object> SnmpResult::New(...) {{{
+Local<Object> SnmpResult::New(netsnmp_variable_list* var, bool aPrimitive) {
+  assert(var);
+  HandleScope kScope;
+
+  Local<Object> o = Object::New();
+  o->Set(String::New("oid"),
+      SnmpValue::New(ASN_OBJECT_ID,
+        var->name, var->name_length * sizeof(oid)));
+  o->Set(String::New("value"),
+      SnmpValue::New(var->type, var->val.string, var->val_len, aPrimitive));
+  if (aPrimitive) {
+    o->Set(String::NewSymbol("type"), v8::Integer::New(var->type));
+  }
+  return kScope.Close(o);
+}
+// }}}
+
+// void SnmpResult::Initialize(Handle<Object> target) {{{
+void SnmpResult::Initialize(Handle<Object> target) {
+  js::HandleScope kScope;
+
+  // type tags of primitive results
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_INTEGER);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_GAUGE);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_COUNTER);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_UINTEGER);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_TIMETICKS);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_COUNTER64);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_OCTET_STR);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_OBJECT_ID);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_IPADDRESS);
+  SNMP_DEFINE_HIDDEN_CONSTANT(target, ASN_NULL);
+}
+// }}}
+
+// }}}
+
+
+
+// ==== class SnmpWriter {{{
+
+enum output_format { FORMAT_NONE, FORMAT_NDJSON, FORMAT_BINARY };
+
+/**
+ * Serializes results straight into caller's buffer, one record per varbind
+ * (or table row). Bytes past the end of the buffer are only counted, so that
+ * size() tells how big the buffer should have been.
+ *
+ * FORMAT_NDJSON - one JSON object and '\n' per record:
+ *   {"oid":"1.3.6.1.2.1.1.3.0","type":67,"value":123}
+ *   {"index":"1.2","values":[5,"eth0",null],"types":[2,4,null]}
+ * numbers for integer types (Counter64 above 2^53 as decimal string), dotted
+ * string for OIDs and IP addresses, null for exceptions, other values as
+ * strings with one character per byte.
+ *
+ * FORMAT_BINARY - big endian, each record prefixed by its length (uint32):
+ *   varbind: u8 type, u8 n, n * u32 subid, u32 length, value
+ *   row:     u8 n, n * u32 index subid, u16 m, m * (u8 type, u32 length,
+ *            value), type 0 for missing cells
+ * integer types as 8 bytes (int64 for INTEGER, uint64 otherwise), OIDs as
+ * u32 subids, other values raw.
+ */
+class SnmpWriter {
+  public:
+    struct cell_ref {
+      bool present_;
+      u_char type_;
+      const u_char* data_;
+      size_t length_;
+    };
+
+  private:
+    int format_;
+    char* data_;
+    size_t capacity_;
+    size_t size_;
+
+    void put(const char* aData, size_t aLength);
+    void put(const char* aString) { put(aString, strlen(aString)); }
+    void putByte(unsigned aByte);
+    void putU16(unsigned aValue);
+    void putU32(uint32_t aValue);
+    void putU64(uint64_t aValue);
+    void putOid(const oid* aOid, size_t aLength);
+    void putJsonValue(u_char aType, const u_char* aData, size_t aLength);
+    void putBinaryValue(u_char aType, const u_char* aData, size_t aLength);
+    size_t beginRecord();
+    void endRecord(size_t aStart);
+
+    static bool integerValue(u_char aType, const u_char* aData,
+        size_t aLength, uint64_t* aValue);
+
+  public:
+    SnmpWriter(int aFormat, char* aData, size_t aCapacity)
+      : format_(aFormat), data_(aData), capacity_(aCapacity), size_(0) {}
+
+    void varbind(const oid* aName, size_t aNameLength, u_char aType,
+        const u_char* aData, size_t aLength);
+    void row(const oid* aIndex, size_t aIndexLength,
+        const std::vector<cell_ref>& aCells);
+
+    size_t size() const { return size_; }
+    bool overflow() const { return size_ > capacity_; }
+};
+
+// void SnmpWriter::put(const char* aData, size_t aLength) {{{
+void SnmpWriter::put(const char* aData, size_t aLength) {
+  if (size_ < capacity_) {
+    memcpy(data_ + size_, aData, std::min(aLength, capacity_ - size_));
+  }
+  size_ += aLength;
+}
+// }}}
+
+// void SnmpWriter::putByte(unsigned aByte) {{{
+void SnmpWriter::putByte(unsigned aByte) {
+  if (size_ < capacity_) {
+    data_[size_] = static_cast<char>(aByte);
+  }
+  ++size_;
+}
+// }}}
+
+// void SnmpWriter::putU16(unsigned aValue) {{{
+void SnmpWriter::putU16(unsigned aValue) {
+  putByte((aValue >> 8) & 0xff);
+  putByte(aValue & 0xff);
+}
+// }}}
+
+// void SnmpWriter::putU32(uint32_t aValue) {{{
+void SnmpWriter::putU32(uint32_t aValue) {
+  putU16(aValue >> 16);
+  putU16(aValue & 0xffff);
+}
+// }}}
+
+// void SnmpWriter::putU64(uint64_t aValue) {{{
+void SnmpWriter::putU64(uint64_t aValue) {
+  putU32(static_cast<uint32_t>(aValue >> 32));
+  putU32(static_cast<uint32_t>(aValue));
+}
+// }}}
+
+// void SnmpWriter::putOid(const oid* aOid, size_t aLength) {{{
+void SnmpWriter::putOid(const oid* aOid, size_t aLength) {
+  if (format_ == FORMAT_BINARY) {
+    for (size_t i = 0; i < aLength; ++i) {
+      putU32(static_cast<uint32_t>(aOid[i]));
+    }
+    return;
+  }
+  char kSubid[16];
+  putByte('"');
+  for (size_t i = 0; i < aLength; ++i) {
+    int kLength = snprintf(kSubid, sizeof(kSubid), i ? ".%lu" : "%lu",
+        static_cast<unsigned long>(aOid[i]));
+    put(kSubid, kLength);
+  }
+  putByte('"');
+}
+// }}}
+
+// bool SnmpWriter::integerValue(...) {{{
+bool SnmpWriter::integerValue(u_char aType, const u_char* aData,
+    size_t aLength, uint64_t* aValue)
+{
+  netsnmp_vardata v;
+  v.string = const_cast<u_char*>(aData);
+
+  switch (aType) {
+    case ASN_INTEGER:
+      if (aLength < sizeof(long)) {
+        return false;
+      }
+      *aValue = static_cast<uint64_t>(static_cast<int64_t>(*v.integer));
+      return true;
+    case ASN_GAUGE:
+    case ASN_COUNTER:
+    case ASN_UINTEGER:
+    case ASN_TIMETICKS:
+      if (aLength < sizeof(long)) {
+        return false;
+      }
+      *aValue = static_cast<unsigned long>(*v.integer) & 0xFFFFFFFF;
+      return true;
+    case ASN_COUNTER64:
+      if (aLength < sizeof(struct counter64)) {
+        return false;
+      }
+      *aValue = v.counter64->high & 0xFFFFFFFF;
+      *aValue <<= 32;
+      *aValue |= v.counter64->low & 0xFFFFFFFF;
+      return true;
+    default:
+      return false;
+  }
+}
+// }}}
+
+// void SnmpWriter::putJsonValue(...) {{{
+void SnmpWriter::putJsonValue(u_char aType, const u_char* aData,
+    size_t aLength)
+{
+  char kNumber[32];
+  uint64_t kInteger;
+
+  if (integerValue(aType, aData, aLength, &kInteger)) {
+    int kLength;
+    if (aType == ASN_INTEGER) {
+      kLength = snprintf(kNumber, sizeof(kNumber), "%lld",
+          static_cast<long long>(kInteger));
+    } else if (kInteger > (static_cast<uint64_t>(1) << 53)) {
+      // same as primitive results, beyond exact doubles
+      kLength = snprintf(kNumber, sizeof(kNumber), "\"%llu\"",
+          static_cast<unsigned long long>(kInteger));
+    } else {
+      kLength = snprintf(kNumber, sizeof(kNumber), "%llu",
+          static_cast<unsigned long long>(kInteger));
+    }
+    put(kNumber, kLength);
+    return;
+  }
+
+  switch (aType) {
+    case ASN_OBJECT_ID:
+      putOid(reinterpret_cast<const oid*>(aData), aLength / sizeof(oid));
+      return;
+    case ASN_IPADDRESS:
+      if (aLength == 4) {
+        put(kNumber, snprintf(kNumber, sizeof(kNumber), "\"%u.%u.%u.%u\"",
+              aData[0], aData[1], aData[2], aData[3]));
+        return;
+      }
+      break;
+    case ASN_NULL:
+    case SNMP_NOSUCHOBJECT:
+    case SNMP_NOSUCHINSTANCE:
+    case SNMP_ENDOFMIBVIEW:
+      put("null");
+      return;
+    default:
+      break;
+  }
+
+  // bytes as code points 0-255 (Buffer 'binary' encoding), escaped per JSON
+  putByte('"');
+  for (size_t i = 0; i < aLength; ++i) {
+    unsigned kByte = aData[i];
+    if (kByte == '"' || kByte == '\\') {
+      putByte('\\');
+      putByte(kByte);
+    } else if (kByte >= 0x20 && kByte < 0x7f) {
+      putByte(kByte);
+    } else {
+      put(kNumber, snprintf(kNumber, sizeof(kNumber), "\\u%04x", kByte));
+    }
+  }
+  putByte('"');
+}
+// }}}
+
+// void SnmpWriter::putBinaryValue(...) {{{
+void SnmpWriter::putBinaryValue(u_char aType, const u_char* aData,
+    size_t aLength)
+{
+  uint64_t kInteger;
+
+  if (integerValue(aType, aData, aLength, &kInteger)) {
+    putU32(8);
+    putU64(kInteger);
+  } else if (aType == ASN_OBJECT_ID) {
+    size_t kCount = aLength / sizeof(oid);
+    putU32(kCount * 4);
+    putOid(reinterpret_cast<const oid*>(aData), kCount);
+  } else {
+    putU32(aLength);
+    put(reinterpret_cast<const char*>(aData), aLength);
+  }
+}
+// }}}
+
+// size_t SnmpWriter::beginRecord() {{{
+size_t SnmpWriter::beginRecord() {
+  size_t kStart = size_;
+  if (format_ == FORMAT_BINARY) {
+    putU32(0);  // length, see endRecord
+  }
+  return kStart;
+}
+// }}}
+
+// void SnmpWriter::endRecord(size_t aStart) {{{
+void SnmpWriter::endRecord(size_t aStart) {
+  if (format_ != FORMAT_BINARY) {
+    putByte('\n');
+    return;
+  }
+  if (size_ <= capacity_) {
+    uint32_t kLength = size_ - aStart - 4;
+    for (int i = 0; i < 4; ++i) {
+      data_[aStart + i] = static_cast<char>((kLength >> (24 - 8 * i)) & 0xff);
+    }
+  }
+}
+// }}}
+
+// void SnmpWriter::varbind(...) {{{
+void SnmpWriter::varbind(const oid* aName, size_t aNameLength, u_char aType,
+    const u_char* aData, size_t aLength)
+{
+  size_t kStart = beginRecord();
+  if (format_ == FORMAT_BINARY) {
+    putByte(aType);
+    putByte(aNameLength);
+    putOid(aName, aNameLength);
+    putBinaryValue(aType, aData, aLength);
+  } else {
+    char kType[16];
+    put("{\"oid\":");
+    putOid(aName, aNameLength);
+    put(kType, snprintf(kType, sizeof(kType), ",\"type\":%u,\"value\":",
+          aType));
+    putJsonValue(aType, aData, aLength);
+    putByte('}');
+  }
+  endRecord(kStart);
+}
+// }}}
+
+// void SnmpWriter::row(...) {{{
+void SnmpWriter::row(const oid* aIndex, size_t aIndexLength,
+    const std::vector<cell_ref>& aCells)
+{
+  size_t kStart = beginRecord();
+  if (format_ == FORMAT_BINARY) {
+    putByte(aIndexLength);
+    putOid(aIndex, aIndexLength);
+    putU16(aCells.size());
+    for (size_t i = 0; i < aCells.size(); ++i) {
+      if (aCells[i].present_) {
+        putByte(aCells[i].type_);
+        putBinaryValue(aCells[i].type_, aCells[i].data_, aCells[i].length_);
+      } else {
+        putByte(0);
+        putU32(0);
+      }
+    }
+  } else {
+    char kType[8];
+    put("{\"index\":");
+    putOid(aIndex, aIndexLength);
+    put(",\"values\":[");
+    for (size_t i = 0; i < aCells.size(); ++i) {
+      if (i) {
+        putByte(',');
+      }
+      if (aCells[i].present_) {
+        putJsonValue(aCells[i].type_, aCells[i].data_, aCells[i].length_);
+      } else {
+        put("null");
+      }
+    }
+    put("],\"types\":[");
+    for (size_t i = 0; i < aCells.size(); ++i) {
+      if (i) {
+        putByte(',');
+      }
+      if (aCells[i].present_) {
+        put(kType, snprintf(kType, sizeof(kType), "%u", aCells[i].type_));
+      } else {
+        put("null");
+      }
+    }
+    put("]}");
+  }
+  endRecord(kStart);
+}
+// }}}
+
+// }}}
+
+
+
+// ==== class SnmpWalk {{{
+
+namespace {
+// bool oid_has_prefix(...) {{{
+bool oid_has_prefix(const oid* aName, size_t aLength,
+    const std::vector<oid>& aPrefix)
+{
+  if (aLength < aPrefix.size()) {
+    return false;
+  }
+  return std::equal(aPrefix.begin(), aPrefix.end(), aName);
+}
+// }}}
+}
+
+/**
+ * Native GETNEXT walk over one or more roots. Each root is a chain of GETNEXT
+ * requests, result of one is used as OID for the next one. Values are kept as
+ * raw (type,  data) pairs, V8 objects  are created only once,  when the whole
+ * walk is done.
+ *
+ * Two result shapes are supported:
+ * - WALK_TABLE - roots  are columns of conceptual table,  every value is stored
+ *   in a row keyed by index suffix (the part of OID after the column)
+ * - WALK_SUBTREE - plain list of  (oid, value) pairs, same as GetSubtree in
+ *   snmp.js produces
+ *
+ * Up to parallelism_ requests are in  flight at once, each for different root.
+ * Roots of  subtree walk aren't  known in advance, they  are discovered  by
+ * probing for next sibling of the  last found child (GETNEXT on child OID with
+ * last arc incremented jumps  over whole child subtree). When  the subtree has
+ * only one child (table -> entry), discovery descends one level below it, so
+ * tables split into columns.
+ *
+ * In lockstep mode all unfinished roots share one GETNEXT PDU per step (one
+ * varbind per  root, like snmptable does),  roots are retired one by one as
+ * they leave their subtree.
+ */
+struct walk_options : public request_options {
+  typedef std::pair<std::vector<oid>, std::vector<oid> > checkpoint;
+
+  size_t parallelism_;
+  bool lockstep_;
+  unsigned retries_;  // re-sends of failed step from its last OID, in a row
+  bool resuming_;     // resume_ is set, empty - every root was finished
+  std::vector<checkpoint> resume_;  // (root base, last OID) to continue from
+
+  walk_options()
+    : parallelism_(1), lockstep_(false), retries_(0), resuming_(false) {}
+};
+
+class SnmpWalk {
+  public:
+    typedef std::vector<oid> oid_vector;
+
+    struct cell {
+      bool present_;
+      u_char type_;
+      std::vector<unsigned char> data_;
+
+      cell() : present_(false), type_(ASN_NULL) {}
+    };
+
+    struct entry {
+      oid_vector name_;
+      cell value_;
+    };
+
+    typedef std::vector<cell> row_type;
+    typedef std::map<oid_vector, row_type> row_map;
+
+    struct root {
+      oid_vector base_;
+      oid_vector last_;
+      bool active_;   // request for this root is in flight
+      bool done_;
+      row_map::iterator hint_;
+      std::vector<entry> entries_;  // WALK_SUBTREE only
+
+      root() : active_(false), done_(false) {}
+    };
+
+    enum mode { WALK_TABLE, WALK_SUBTREE };
+
+    // root index used for requests of subtree discovery
+    static const size_t kDiscovery = static_cast<size_t>(-1);
+    // root index used for requests carrying all roots in lockstep mode
+    static const size_t kLockstep = static_cast<size_t>(-2);
+
+  private:
+    mode mode_;
+    walk_options options_;
+    size_t parallelism_;
+    size_t inFlight_;
+    std::vector<root> roots_;
+    row_map rows_;
+
+    bool lockstep_;
+    std::vector<size_t> lockstepRoots_;  // roots in the varbind order
+
+    bool discovering_;
+    bool probeActive_;
+    size_t maxDepth_;
+    oid_vector parent_;
+    oid_vector probe_;
+
+    const char* error_;
+    bool reported_;
+    unsigned retriesLeft_;
+
+    std::string snapshotKey_;  // non-empty for change-only polls
+
+    SnmpSessionManager* account_;  // charged for bytes_, see setAccount
+    double bytes_;                 // estimated size of stored results
+
+    SnmpWalk(const SnmpWalk&);
+    SnmpWalk& operator=(const SnmpWalk&);
+
+    void store(size_t aRoot, netsnmp_variable_list* var);
+    void advance(size_t aRoot, netsnmp_variable_list* var);
+    void discover(netsnmp_pdu* pdu);
+    void stepLockstep(netsnmp_pdu* pdu);
+    void release(size_t aRoot);
+    void resume();
+
+    unsigned repetitions_;  // GETBULK max-repetitions, 0 - GETNEXT
+
+    static netsnmp_pdu* newPdu(unsigned aRepetitions);
+    static netsnmp_pdu* createPdu(const oid_vector& aOid,
+        unsigned aRepetitions = 0);
+
+  public:
+    SnmpWalk(const oid_vector& aTable, const oid_vector& aColumns,
+        const walk_options& aOptions);
+    SnmpWalk(const std::vector<oid_vector>& aBases,
+        const walk_options& aOptions);
+    ~SnmpWalk();
+
+    // stored results count against admission limits of aManager until the
+    // walk is deleted
+    void setAccount(SnmpSessionManager* aManager) { account_ = aManager; }
+
+    // steps created from now on use GETBULK with aRepetitions (0 - GETNEXT),
+    // discovery probes are always GETNEXT
+    void setRepetitions(unsigned aRepetitions) { repetitions_ = aRepetitions; }
+    bool nextRequest(size_t* aRoot, netsnmp_pdu** aPdu);
+    void step(size_t aRoot, netsnmp_pdu* pdu);
+    void fail(size_t aRoot, const char* aReason);
+    // failed step will be sent again from the last OID of its root(s), false
+    // when retries (options_.retries_ in a row) are used up
+    bool retry(size_t aRoot);
+    // failed step will be sent again (with fewer repetitions), unlimited
+    void resend(size_t aRoot) { release(aRoot); }
+
+    // nothing more to send and nothing in flight
+    bool finished() const;
+    bool idle() const { return inFlight_ == 0; }
+    bool failed() const { return error_ != NULL; }
+    const char* error() const { return error_; }
+
+    // error or result has already been passed to the callback, walk only waits
+    // for outstanding responses
+    bool reported() const { return reported_; }
+    void setReported() { reported_ = true; }
+
+    const walk_options& options() const { return options_; }
+
+    Local<Array> resultToV8() const;
+    // the same, serialized for options_.format_ - varbinds or rows
+    void write(SnmpWriter* aWriter) const;
+    // where the walk stopped, for options.resume of new walk - array of
+    // [ base, last ] OID arrays of unfinished roots
+    Local<Array> checkpointToV8() const;
+
+    // snapshot of table for change-only polling - row hash by index
+    typedef std::map<oid_vector, uint64_t> snapshot_type;
+
+    const std::string& snapshotKey() const { return snapshotKey_; }
+    void setSnapshotKey(const std::string& aKey) { snapshotKey_ = aKey; }
+
+    // compare rows with previous snapshot and replace it with current rows,
+    // result is { added: [rows], changed: [rows], removed: [indexes] }
+    Local<Object> diffToV8(snapshot_type* aSnapshot) const;
+
+  private:
+    Local<Object> rowToV8(row_map::const_iterator aRow) const;
+    static Handle<Value> indexToV8(const oid_vector& aIndex);
+    static uint64_t hashRow(const row_type& aRow);
+};
+
+// SnmpWalk::SnmpWalk(...) {{{
+SnmpWalk::SnmpWalk(const oid_vector& aTable, const oid_vector& aColumns,
+    const walk_options& aOptions)
+  : mode_(WALK_TABLE), options_(aOptions),
+    parallelism_(std::max<size_t>(aOptions.parallelism_, 1)),
+    inFlight_(0), lockstep_(aOptions.lockstep_),
+    discovering_(false), probeActive_(false), maxDepth_(0),
+    error_(NULL), reported_(false), retriesLeft_(aOptions.retries_),
+    account_(NULL), bytes_(0), repetitions_(0)
+{
+  roots_.resize(aColumns.size());
+  for (size_t i = 0; i < aColumns.size(); ++i) {
+    // SMI tables: table.1 is the entry, table.1.C is column C
+    roots_[i].base_ = aTable;
+    roots_[i].base_.push_back(1);
+    roots_[i].base_.push_back(aColumns[i]);
+    roots_[i].last_ = roots_[i].base_;
+    roots_[i].hint_ = rows_.end();
+  }
+  resume();
+}
+// }}}
+
+// SnmpWalk::SnmpWalk(...) {{{
+SnmpWalk::SnmpWalk(const std::vector<oid_vector>& aBases,
+    const walk_options& aOptions)
+  : mode_(WALK_SUBTREE), options_(aOptions),
+    parallelism_(std::max<size_t>(aOptions.parallelism_, 1)),
+    inFlight_(0), lockstep_(aOptions.lockstep_),
+    discovering_(false), probeActive_(false), maxDepth_(0),
+    error_(NULL), reported_(false), retriesLeft_(aOptions.retries_),
+    account_(NULL), bytes_(0), repetitions_(0)
+{
+  assert(!aBases.empty());
+  if (aBases.size() == 1 && parallelism_ > 1 && !lockstep_ &&
+      !aOptions.resuming_)
+  {
+    discovering_ = true;
+    parent_ = aBases[0];
+    probe_ = aBases[0];
+    maxDepth_ = aBases[0].size() + 2;
+    return;
+  }
+
+  // explicit roots, or nothing to gain from discovery
+  roots_.resize(aBases.size());
+  for (size_t i = 0; i < aBases.size(); ++i) {
+    roots_[i].base_ = aBases[i];
+    roots_[i].last_ = aBases[i];
+    roots_[i].hint_ = rows_.end();
+  }
+  resume();
+}
+// }}}
+
+// void SnmpWalk::resume() {{{
+void SnmpWalk::resume() {
+  const std::vector<walk_options::checkpoint>& kResume = options_.resume_;
+  if (!options_.resuming_) {
+    return;
+  }
+  if (mode_ == WALK_SUBTREE) {
+    // checkpoint roots replace the given ones (discovered roots and the rest
+    // of discovery are all in it)
+    roots_.clear();
+    roots_.resize(kResume.size());
+    for (size_t i = 0; i < kResume.size(); ++i) {
+      roots_[i].base_ = kResume[i].first;
+      roots_[i].last_ = kResume[i].second;
+      roots_[i].hint_ = rows_.end();
+    }
+    return;
+  }
+  // table columns keep their positions in rows, those missing in the
+  // checkpoint were finished
+  for (size_t i = 0; i < roots_.size(); ++i) {
+    roots_[i].done_ = true;
+    for (size_t j = 0; j < kResume.size(); ++j) {
+      if (kResume[j].first == roots_[i].base_) {
+        roots_[i].last_ = kResume[j].second;
+        roots_[i].done_ = false;
+        break;
+      }
+    }
+  }
+}
+// }}}
+
+// netsnmp_pdu* SnmpWalk::newPdu(unsigned aRepetitions) {{{
+netsnmp_pdu* SnmpWalk::newPdu(unsigned aRepetitions) {
+  if (!aRepetitions) {
+    return snmp_pdu_create(SNMP_MSG_GETNEXT);
+  }
+  netsnmp_pdu* pdu = snmp_pdu_create(SNMP_MSG_GETBULK);
+  if (pdu) {
+    pdu->non_repeaters = 0;
+    pdu->max_repetitions = aRepetitions;
+  }
+  return pdu;
+}
+// }}}
+
+// netsnmp_pdu* SnmpWalk::createPdu(...) {{{
+netsnmp_pdu* SnmpWalk::createPdu(const oid_vector& aOid,
+    unsigned aRepetitions)
+{
+  netsnmp_pdu* pdu = newPdu(aRepetitions);
+  if (!pdu) {
+    return NULL;
+  }
+  if (!snmp_add_null_var(pdu, &aOid[0], aOid.size())) {
+    snmp_free_pdu(pdu);
+    return NULL;
+  }
+  return pdu;
+}
+// }}}
+
+// bool SnmpWalk::nextRequest(size_t* aRoot, netsnmp_pdu** aPdu) {{{
+bool SnmpWalk::nextRequest(size_t* aRoot, netsnmp_pdu** aPdu) {
+  if (error_ || inFlight_ >= parallelism_) {
+    return false;
+  }
+
+  if (lockstep_) {
+    if (inFlight_ != 0) {
+      return false;
+    }
+    netsnmp_pdu* pdu = NULL;
+    lockstepRoots_.clear();
+    for (size_t i = 0; i < roots_.size(); ++i) {
+      root& kRoot = roots_[i];
+      if (kRoot.done_) {
+        continue;
+      }
+      if (!pdu) {
+        pdu = newPdu(repetitions_);
+      }
+      if (!pdu ||
+          !snmp_add_null_var(pdu, &kRoot.last_[0], kRoot.last_.size()))
+      {
+        // nothing goes out, the walk fails (reported by the caller)
+        if (pdu) {
+          snmp_free_pdu(pdu);
+        }
+        for (size_t j = 0; j < lockstepRoots_.size(); ++j) {
+          roots_[lockstepRoots_[j]].active_ = false;
+        }
+        lockstepRoots_.clear();
+        error_ = "cannot allocate pdu";
+        return false;
+      }
+      kRoot.active_ = true;
+      lockstepRoots_.push_back(i);
+    }
+    if (lockstepRoots_.empty()) {
+      return false;
+    }
+    ++inFlight_;
+    *aRoot = kLockstep;
+    *aPdu = pdu;
+    return true;
+  }
+
+  // discovery first, it is what feeds the other roots
+  if (discovering_ && !probeActive_) {
+    probeActive_ = true;
+    ++inFlight_;
+    *aRoot = kDiscovery;
+    *aPdu = createPdu(probe_);
+    return true;
+  }
+
+  for (size_t i = 0; i < roots_.size(); ++i) {
+    root& kRoot = roots_[i];
+    if (kRoot.done_ || kRoot.active_) {
+      continue;
+    }
+    kRoot.active_ = true;
+    ++inFlight_;
+    *aRoot = i;
+    *aPdu = createPdu(kRoot.last_, repetitions_);
+    return true;
+  }
+  return false;
+}
+// }}}
+
+// bool SnmpWalk::finished() const {{{
+bool SnmpWalk::finished() const {
+  if (inFlight_ != 0) {
+    return false;
+  }
+  if (error_) {
+    return true;
+  }
+  if (discovering_) {
+    return false;
+  }
+  for (size_t i = 0; i < roots_.size(); ++i) {
+    if (!roots_[i].done_) {
+      return false;
+    }
+  }
+  return true;
+}
+// }}}
+
+// void SnmpWalk::release(size_t aRoot) {{{
+void SnmpWalk::release(size_t aRoot) {
+  // request of aRoot is over without result
+  assert(inFlight_ > 0);
+  --inFlight_;
+  if (aRoot == kDiscovery) {
+    probeActive_ = false;
+  } else if (aRoot == kLockstep) {
+    for (size_t i = 0; i < lockstepRoots_.size(); ++i) {
+      roots_[lockstepRoots_[i]].active_ = false;
+    }
+  } else {
+    roots_[aRoot].active_ = false;
+  }
+}
+// }}}
+
+// bool SnmpWalk::retry(size_t aRoot) {{{
+bool SnmpWalk::retry(size_t aRoot) {
+  if (error_ || retriesLeft_ == 0) {
+    return false;
+  }
+  --retriesLeft_;
+  // nextRequest sends it again from last_ (probe_) with fresh net-snmp
+  // timeout and retries
+  release(aRoot);
+  return true;
+}
+// }}}
+
+// void SnmpWalk::fail(size_t aRoot, const char* aReason) {{{
+void SnmpWalk::fail(size_t aRoot, const char* aReason) {
+  release(aRoot);
+  if (!error_) {
+    error_ = aReason;
+  }
+}
+// }}}
+
+// void SnmpWalk::store(size_t aRoot, netsnmp_variable_list* var) {{{
+void SnmpWalk::store(size_t aRoot, netsnmp_variable_list* var) {
+  root& kRoot = roots_[aRoot];
+  cell* kCell;
+
+  if (mode_ == WALK_SUBTREE) {
+    kRoot.entries_.resize(kRoot.entries_.size() + 1);
+    kRoot.entries_.back().name_.assign(
+        var->name, var->name + var->name_length);
+    kCell = &kRoot.entries_.back().value_;
+  } else {
+    oid_vector kIndex(var->name + kRoot.base_.size(),
+        var->name + var->name_length);
+
+    // every column comes in index order, inserting right after the previous
+    // row of the same column is amortized constant
+    kRoot.hint_ = rows_.insert(kRoot.hint_,
+        row_map::value_type(kIndex, row_type()));
+    if (kRoot.hint_->second.empty()) {
+      kRoot.hint_->second.resize(roots_.size());
+    }
+    kCell = &kRoot.hint_->second[aRoot];
+  }
+
+  kCell->present_ = true;
+  kCell->type_ = var->type;
+  kCell->data_.assign(var->val.string, var->val.string + var->val_len);
+
+  // rough, row keys and container overhead included in the fixed part
+  double kBytes = sizeof(entry) + var->name_length * sizeof(oid) +
+    var->val_len;
+  bytes_ += kBytes;
+  if (account_) {
+    account_->countBytes(kBytes);
+    if (!error_ && account_->overBytes()) {
+      // the limit is shared, stop the walk that crossed it
+      error_ = "overloaded - result memory limit reached";
+    }
+  }
+}
+// }}}
+
+// SnmpWalk::~SnmpWalk() {{{
+SnmpWalk::~SnmpWalk() {
+  if (account_) {
+    account_->countBytes(-bytes_);
+  }
+}
+// }}}
+
+// void SnmpWalk::discover(netsnmp_pdu* pdu) {{{
+void SnmpWalk::discover(netsnmp_pdu* pdu) {
+  netsnmp_variable_list* var = pdu->variables;
+  bool kLevelDone = false;
+
+  if (pdu->errstat == SNMP_ERR_NOSUCHNAME) {
+    // SNMPv1 way to say "end of MIB"
+    kLevelDone = true;
+  } else if (pdu->errstat != SNMP_ERR_NOERROR) {
+    error_ = snmp_errstring(pdu->errstat);
+    return;
+  } else if (!var) {
+    error_ = "empty response";
+    return;
+  } else if (var->type == SNMP_ENDOFMIBVIEW
+      || !oid_has_prefix(var->name, var->name_length, parent_))
+  {
+    kLevelDone = true;
+  } else if (snmp_oid_compare(var->name, var->name_length,
+        &probe_[0], probe_.size()) <= 0)
+  {
+    error_ = "broken peer implementation";
+    return;
+  }
+
+  if (!kLevelDone) {
+    // new child found, its first value is already here
+    roots_.resize(roots_.size() + 1);
+    root& kRoot = roots_.back();
+    kRoot.base_.assign(var->name, var->name + parent_.size() + 1);
+    kRoot.last_.assign(var->name, var->name + var->name_length);
+    kRoot.hint_ = rows_.end();
+    store(roots_.size() - 1, var);
+
+    probe_ = kRoot.base_;
+    if (probe_.back() == MAX_SUBID) {
+      discovering_ = false;
+      return;
+    }
+    ++probe_.back();
+    return;
+  }
+
+  // single child (typically table entry) - split it one level deeper. The
+  // child's walk keeps going, only its base is narrowed to the child of its
+  // current position.
+  if (roots_.size() == 1 && parent_.size() + 1 < maxDepth_
+      && !roots_[0].done_
+      && roots_[0].last_.size() > roots_[0].base_.size() + 1)
+  {
+    root& kRoot = roots_[0];
+    parent_ = kRoot.base_;
+    kRoot.base_.assign(kRoot.last_.begin(),
+        kRoot.last_.begin() + parent_.size() + 1);
+    probe_ = kRoot.base_;
+    if (probe_.back() != MAX_SUBID) {
+      ++probe_.back();
+      return;
+    }
+  }
+  discovering_ = false;
+}
+// }}}
+
+// void SnmpWalk::advance(size_t aRoot, netsnmp_variable_list* var) {{{
+void SnmpWalk::advance(size_t aRoot, netsnmp_variable_list* var) {
+  root& kRoot = roots_[aRoot];
+
+  if (var->type == SNMP_ENDOFMIBVIEW
+      || !oid_has_prefix(var->name, var->name_length, kRoot.base_))
+  {
+    kRoot.done_ = true;
+  } else if (snmp_oid_compare(var->name, var->name_length,
+        &kRoot.last_[0], kRoot.last_.size()) <= 0)
+  {
+    // same check as verifyNextResult in snmp.js
+    error_ = "broken peer implementation";
+  } else {
+    store(aRoot, var);
+    kRoot.last_.assign(var->name, var->name + var->name_length);
+  }
+}
+// }}}
+
+// void SnmpWalk::stepLockstep(netsnmp_pdu* pdu) {{{
+void SnmpWalk::stepLockstep(netsnmp_pdu* pdu) {
+  for (size_t i = 0; i < lockstepRoots_.size(); ++i) {
+    roots_[lockstepRoots_[i]].active_ = false;
+  }
+
+  if (pdu->errstat == SNMP_ERR_NOSUCHNAME) {
+    // SNMPv1 "end of MIB" for the varbind at errindex. Nothing else in the
+    // response is valid, retire that root and repeat the step without it.
+    size_t kIndex = pdu->errindex;
+    if (kIndex >= 1 && kIndex <= lockstepRoots_.size()) {
+      roots_[lockstepRoots_[kIndex - 1]].done_ = true;
+    } else {
+      for (size_t i = 0; i < lockstepRoots_.size(); ++i) {
+        roots_[lockstepRoots_[i]].done_ = true;
+      }
+    }
+    return;
+  }
+  if (pdu->errstat != SNMP_ERR_NOERROR) {
+    error_ = snmp_errstring(pdu->errstat);
+    return;
+  }
+
+  // GETBULK response repeats the roots in the same order
+  size_t kCount = lockstepRoots_.size();
+  netsnmp_variable_list* var = pdu->variables;
+  for (size_t i = 0; !error_; ++i, var = var->next_variable) {
+    if (!var) {
+      if (i < kCount) {
+        error_ = "response is missing varbinds";
+      }
+      return;
+    }
+    if (!roots_[lockstepRoots_[i % kCount]].done_) {
+      advance(lockstepRoots_[i % kCount], var);
+    }
+  }
+}
+// }}}
+
+// void SnmpWalk::step(size_t aRoot, netsnmp_pdu* pdu) {{{
+void SnmpWalk::step(size_t aRoot, netsnmp_pdu* pdu) {
+  assert(inFlight_ > 0);
+  --inFlight_;
+
+  if (error_) {
+    // late response of already failed walk
+    return;
+  }
+  retriesLeft_ = options_.retries_;
+
+  if (aRoot == kDiscovery) {
+    probeActive_ = false;
+    discover(pdu);
+    return;
+  }
+  if (aRoot == kLockstep) {
+    stepLockstep(pdu);
+    return;
+  }
+
+  assert(aRoot < roots_.size());
+  root& kRoot = roots_[aRoot];
+  kRoot.active_ = false;
+
+  if (pdu->errstat == SNMP_ERR_NOSUCHNAME) {
+    // SNMPv1 way to say "end of MIB"
+    kRoot.done_ = true;
+  } else if (pdu->errstat != SNMP_ERR_NOERROR) {
+    error_ = snmp_errstring(pdu->errstat);
+  } else if (!pdu->variables) {
+    error_ = "empty response";
+  } else {
+    // one varbind for GETNEXT, up to max-repetitions for GETBULK
+    for (netsnmp_variable_list* var = pdu->variables;
+        var && !kRoot.done_ && !error_; var = var->next_variable)
+    {
+      advance(aRoot, var);
+    }
+  }
+}
+// }}}
+
+// Local<Array> SnmpWalk::checkpointToV8() const {{{
+Local<Array> SnmpWalk::checkpointToV8() const {
+  HandleScope kScope;
+
+  std::vector<walk_options::checkpoint> kPoints;
+  for (size_t i = 0; i < roots_.size(); ++i) {
+    if (!roots_[i].done_) {
+      kPoints.push_back(std::make_pair(roots_[i].base_, roots_[i].last_));
+    }
+  }
+  if (discovering_) {
+    // rest of the parent after the children found so far, as one more root
+    kPoints.push_back(std::make_pair(parent_, probe_));
+  }
+
+  Local<Array> kResult = v8::Array::New(kPoints.size());
+  for (size_t i = 0; i < kPoints.size(); ++i) {
+    const oid_vector* kOids[2] = { &kPoints[i].first, &kPoints[i].second };
+    Local<Array> kPoint = v8::Array::New(2);
+    for (uint32_t j = 0; j < 2; ++j) {
+      Local<Array> kOid = v8::Array::New(kOids[j]->size());
+      for (size_t k = 0; k < kOids[j]->size(); ++k) {
+        kOid->Set(k, v8::Number::New((*kOids[j])[k]));
+      }
+      kPoint->Set(j, kOid);
+    }
+    kResult->Set(i, kPoint);
+  }
+  return kScope.Close(kResult);
+}
+// }}}
+
+// Local<Array> SnmpWalk::resultToV8() const {{{
+Local<Array> SnmpWalk::resultToV8() const {
+  HandleScope kScope;
+
+  if (mode_ == WALK_SUBTREE) {
+    // roots are disjoint and sorted, concatenation is in OID order
+    size_t kCount = 0;
+    for (size_t i = 0; i < roots_.size(); ++i) {
+      kCount += roots_[i].entries_.size();
+    }
+
+    Local<Array> kResult = v8::Array::New(kCount);
+    Local<String> kOidSymbol = String::NewSymbol("oid");
+    Local<String> kValueSymbol = String::NewSymbol("value");
+    Local<String> kTypeSymbol = String::NewSymbol("type");
+    uint32_t index = 0;
+
+    for (size_t i = 0; i < roots_.size(); ++i) {
+      const std::vector<entry>& kEntries = roots_[i].entries_;
+      for (size_t j = 0; j < kEntries.size(); ++j, ++index) {
+        const entry& kEntry = kEntries[j];
+        Local<Object> o = Object::New();
+        o->Set(kOidSymbol,
+            SnmpValue::New(ASN_OBJECT_ID, const_cast<oid*>(&kEntry.name_[0]),
+              kEntry.name_.size() * sizeof(oid)));
+        o->Set(kValueSymbol,
+            SnmpValue::New(kEntry.value_.type_,
+              const_cast<unsigned char*>(kEntry.value_.data_.empty() ? NULL :
+                &kEntry.value_.data_[0]),
+              kEntry.value_.data_.size(), options_.primitive_));
+        if (options_.primitive_) {
+          o->Set(kTypeSymbol, v8::Integer::New(kEntry.value_.type_));
+        }
+        kResult->Set(index, o);
+      }
+    }
+    return kScope.Close(kResult);
+  }
+
+  Local<Array> kResult = v8::Array::New(rows_.size());
+  uint32_t i = 0;
+
+  row_map::const_iterator it_end = rows_.end();
+  for (row_map::const_iterator it = rows_.begin(); it != it_end; ++it, ++i) {
+    kResult->Set(i, rowToV8(it));
+  }
+  return kScope.Close(kResult);
+}
+// }}}
+
+// void SnmpWalk::write(SnmpWriter* aWriter) const {{{
+void SnmpWalk::write(SnmpWriter* aWriter) const {
+  if (mode_ == WALK_SUBTREE) {
+    for (size_t i = 0; i < roots_.size(); ++i) {
+      const std::vector<entry>& kEntries = roots_[i].entries_;
+      for (size_t j = 0; j < kEntries.size(); ++j) {
+        const entry& kEntry = kEntries[j];
+        aWriter->varbind(&kEntry.name_[0], kEntry.name_.size(),
+            kEntry.value_.type_,
+            kEntry.value_.data_.empty() ? NULL : &kEntry.value_.data_[0],
+            kEntry.value_.data_.size());
+      }
+    }
+    return;
+  }
+
+  std::vector<SnmpWriter::cell_ref> kCells;
+  row_map::const_iterator it_end = rows_.end();
+  for (row_map::const_iterator it = rows_.begin(); it != it_end; ++it) {
+    kCells.resize(it->second.size());
+    for (size_t j = 0; j < it->second.size(); ++j) {
+      const cell& kCell = it->second[j];
+      kCells[j].present_ = kCell.present_;
+      kCells[j].type_ = kCell.type_;
+      kCells[j].data_ = kCell.data_.empty() ? NULL : &kCell.data_[0];
+      kCells[j].length_ = kCell.data_.size();
+    }
+    aWriter->row(&it->first[0], it->first.size(), kCells);
+  }
+}
+// }}}
+
+// Local<Object> SnmpWalk::rowToV8(row_map::const_iterator aRow) const {{{
+Local<Object> SnmpWalk::rowToV8(row_map::const_iterator aRow) const {
+  HandleScope kScope;
+
+  Local<Object> kRow = Object::New();
+  kRow->Set(String::NewSymbol("index"), indexToV8(aRow->first));
+
+  const bool kPrimitive = options_.primitive_;
+  Local<Array> kValues = v8::Array::New(aRow->second.size());
+  // ASN types in primitive mode, same order as values
+  Local<Array> kTypes;
+  if (kPrimitive) {
+    kTypes = v8::Array::New(aRow->second.size());
+  }
+  for (uint32_t j = 0; j < aRow->second.size(); ++j) {
+    const cell& kCell = aRow->second[j];
+    if (kCell.present_) {
+      kValues->Set(j, SnmpValue::New(kCell.type_,
+            const_cast<unsigned char*>(kCell.data_.empty() ? NULL :
+              &kCell.data_[0]),
+            kCell.data_.size(), kPrimitive));
+      if (kPrimitive) {
+        kTypes->Set(j, v8::Integer::New(kCell.type_));
+      }
+    } else {
+      kValues->Set(j, v8::Null());
+      if (kPrimitive) {
+        kTypes->Set(j, v8::Null());
+      }
+    }
+  }
+  kRow->Set(String::NewSymbol("values"), kValues);
+  if (kPrimitive) {
+    kRow->Set(String::NewSymbol("types"), kTypes);
+  }
+  return kScope.Close(kRow);
+}
+// }}}
+
+// Handle<Value> SnmpWalk::indexToV8(const oid_vector& aIndex) {{{
+Handle<Value> SnmpWalk::indexToV8(const oid_vector& aIndex) {
+  return SnmpValue::New(ASN_OBJECT_ID,
+      const_cast<oid*>(&aIndex[0]), aIndex.size() * sizeof(oid));
+}
+// }}}
+
+// uint64_t SnmpWalk::hashRow(const row_type& aRow) {{{
+uint64_t SnmpWalk::hashRow(const row_type& aRow) {
+  // FNV-1a over (presence, type, length, data) of every cell
+  uint64_t kHash = 14695981039346656037ULL;
+  for (size_t i = 0; i < aRow.size(); ++i) {
+    const cell& kCell = aRow[i];
+    unsigned char kHeader[6] = {
+      kCell.present_, kCell.type_,
+      static_cast<unsigned char>(kCell.data_.size() >> 24),
+      static_cast<unsigned char>(kCell.data_.size() >> 16),
+      static_cast<unsigned char>(kCell.data_.size() >> 8),
+      static_cast<unsigned char>(kCell.data_.size())
+    };
+    for (size_t j = 0; j < sizeof(kHeader); ++j) {
+      kHash = (kHash ^ kHeader[j]) * 1099511628211ULL;
+    }
+    for (size_t j = 0; j < kCell.data_.size(); ++j) {
+      kHash = (kHash ^ kCell.data_[j]) * 1099511628211ULL;
+    }
+  }
+  return kHash;
+}
+// }}}
+
+// Local<Object> SnmpWalk::diffToV8(snapshot_type* aSnapshot) const {{{
+Local<Object> SnmpWalk::diffToV8(snapshot_type* aSnapshot) const {
+  HandleScope kScope;
+  assert(mode_ == WALK_TABLE);
+
+  Local<Array> kAdded = v8::Array::New(0);
+  Local<Array> kChanged = v8::Array::New(0);
+  Local<Array> kRemoved = v8::Array::New(0);
+  uint32_t kAddedCount = 0, kChangedCount = 0, kRemovedCount = 0;
+
+  // both maps are sorted by index, single merge pass finds all differences
+  snapshot_type kNext;
+  snapshot_type::iterator kHint = kNext.end();
+  snapshot_type::const_iterator old_it = aSnapshot->begin();
+  snapshot_type::const_iterator old_end = aSnapshot->end();
+  row_map::const_iterator it_end = rows_.end();
+
+  for (row_map::const_iterator it = rows_.begin(); it != it_end; ++it) {
+    for (; old_it != old_end && old_it->first < it->first; ++old_it) {
+      kRemoved->Set(kRemovedCount++, indexToV8(old_it->first));
+    }
+
+    uint64_t kHash = hashRow(it->second);
+    kHint = kNext.insert(kHint, snapshot_type::value_type(it->first, kHash));
+
+    if (old_it != old_end && old_it->first == it->first) {
+      if (old_it->second != kHash) {
+        kChanged->Set(kChangedCount++, rowToV8(it));
+      }
+      ++old_it;
+    } else {
+      kAdded->Set(kAddedCount++, rowToV8(it));
+    }
+  }
+  for (; old_it != old_end; ++old_it) {
+    kRemoved->Set(kRemovedCount++, indexToV8(old_it->first));
+  }
+
+  aSnapshot->swap(kNext);
+
+  Local<Object> kResult = Object::New();
+  kResult->Set(String::NewSymbol("added"), kAdded);
+  kResult->Set(String::NewSymbol("changed"), kChanged);
+  kResult->Set(String::NewSymbol("removed"), kRemoved);
+  return kScope.Close(kResult);
+}
+// }}}
+
+// }}}
+
+
+
+// ==== class SnmpRequestTemplate : public node::ObjectWrap {{{
+
+/**
+ * Varbinds of a recurring request, converted from JS once. Each request is a
+ * clone of the prototype PDU with fresh request id - no OID conversion and no
+ * varbind list built from scratch. net-snmp can't send a pre-encoded message
+ * (request id and community live inside the BER), so encoding stays per send.
+ */
+class SnmpRequestTemplate : public node::ObjectWrap {
+  private:
+    static Persistent<v8::FunctionTemplate> constructorTemplate_;
+
+    netsnmp_pdu* pdu_;
+
+    SnmpRequestTemplate() : pdu_(NULL) {}
+
+  public:
+    ~SnmpRequestTemplate() {
+      if (pdu_) {
+        snmp_free_pdu(pdu_);
+      }
+    }
+
+    netsnmp_pdu* instantiate(int aCommand) const {
+      return instantiate(pdu_, aCommand);
+    }
+    // copy of aPrototype ready to send, NULL when out of memory
+    static netsnmp_pdu* instantiate(netsnmp_pdu* aPrototype, int aCommand);
+
+    // NULL when aValue is not a template
+    static SnmpRequestTemplate* FromV8(Handle<Value> aValue);
+    static Handle<Value> New(const Arguments& args);
+    static Handle<Value> Size(const Arguments& args);
+    static void Initialize(Handle<Object> target);
+};
+
+Persistent<v8::FunctionTemplate> SnmpRequestTemplate::constructorTemplate_;
+
+// netsnmp_pdu* SnmpRequestTemplate::instantiate(...) {{{
+netsnmp_pdu* SnmpRequestTemplate::instantiate(netsnmp_pdu* aPrototype,
+    int aCommand)
+{
+  netsnmp_pdu* pdu = snmp_clone_pdu(aPrototype);
+  if (pdu) {
+    // the clone has the ids of the prototype
+    pdu->command = aCommand;
+    pdu->reqid = snmp_get_next_reqid();
+    pdu->msgid = snmp_get_next_msgid();
+  }
+  return pdu;
+}
+// }}}
+
+// SnmpRequestTemplate* SnmpRequestTemplate::FromV8(Handle<Value> aValue) {{{
+SnmpRequestTemplate* SnmpRequestTemplate::FromV8(Handle<Value> aValue) {
+  if (constructorTemplate_.IsEmpty() || !aValue->IsObject() ||
+      !constructorTemplate_->HasInstance(aValue->ToObject()))
+  {
+    return NULL;
+  }
+  return ObjectWrap::Unwrap<SnmpRequestTemplate>(aValue->ToObject());
+}
+// }}}
+
+// }}}
+
+
+
+// ==== class SnmpSession : public node::ObjectWrap {{{
+
+// native consumer of request results (poll jobs), instead of JS callback
+struct SnmpResultSink {
+  // pdu is NULL when aError is set
+  virtual void deliver(netsnmp_pdu* pdu, const char* aError) = 0;
+
+  virtual ~SnmpResultSink() {}
+};
+
+/**
+ * max-repetitions of GETBULK walk steps for one agent. Grows by one after each
+ * complete response that came back without RTT spike, halves on tooBig and
+ * timeouts, and stays under estimated response size of kTargetBytes (single
+ * unfragmented datagram on usual paths).
+ */
+class SnmpBulkTuner {
+  public:
+    static const unsigned kTargetBytes = 1400;
+
+  private:
+    double repetitions_;
+    unsigned max_;
+    double minRtt_;         // ms, best seen
+    double varbindBytes_;   // moving average of encoded varbind size
+
+  public:
+    SnmpBulkTuner()
+      : repetitions_(10), max_(50), minRtt_(0), varbindBytes_(0) {}
+
+    void configure(unsigned aInitial, unsigned aMax);
+    unsigned repetitions() const;
+
+    // aPerRepetition - varbinds in request (lockstep roots)
+    void onResponse(netsnmp_pdu* pdu, unsigned aRepetitions,
+        unsigned aPerRepetition, double aRtt);
+    void onFailure();
+};
+
+// void SnmpBulkTuner::configure(unsigned aInitial, unsigned aMax) {{{
+void SnmpBulkTuner::configure(unsigned aInitial, unsigned aMax) {
+  max_ = std::max(aMax, 1u);
+  repetitions_ = std::min(std::max(aInitial, 1u), max_);
+}
+// }}}
+
+// unsigned SnmpBulkTuner::repetitions() const {{{
+unsigned SnmpBulkTuner::repetitions() const {
+  return static_cast<unsigned>(repetitions_);
+}
+// }}}
+
+// void SnmpBulkTuner::onResponse(...) {{{
+void SnmpBulkTuner::onResponse(netsnmp_pdu* pdu, unsigned aRepetitions,
+    unsigned aPerRepetition, double aRtt)
+{
+  size_t kCount = 0;
+  size_t kBytes = 0;
+  for (netsnmp_variable_list* var = pdu->variables; var;
+      var = var->next_variable)
+  {
+    ++kCount;
+    // BER estimate: header, mostly single-byte subids, value
+    kBytes += 6 + var->name_length + var->val_len;
+  }
+  if (kCount == 0) {
+    return;
+  }
+  double kAverage = static_cast<double>(kBytes) / kCount;
+  varbindBytes_ = varbindBytes_ == 0 ? kAverage :
+    varbindBytes_ * 0.8 + kAverage * 0.2;
+  if (minRtt_ == 0 || aRtt < minRtt_) {
+    minRtt_ = aRtt;
+  }
+
+  // complete response (the agent didn't cut it) returned at about best speed
+  bool kComplete = kCount >= aRepetitions * std::max(aPerRepetition, 1u);
+  if (kComplete && aRtt <= 2 * minRtt_ + 10) {
+    repetitions_ = std::min(repetitions_ + 1, static_cast<double>(max_));
+  }
+
+  double kCap = kTargetBytes /
+    (varbindBytes_ * std::max(aPerRepetition, 1u));
+  repetitions_ = std::max(std::min(repetitions_, floor(kCap)), 1.0);
+}
+// }}}
+
+// void SnmpBulkTuner::onFailure() {{{
+void SnmpBulkTuner::onFailure() {
+  repetitions_ = std::max(floor(repetitions_ / 2), 1.0);
+}
+// }}}
+
+/**
+ * Round-trip times of the last kSamples responses of one agent and their
+ * percentile (hedging delay). The percentile is recomputed every kRefresh
+ * samples, requests in between use the cached value.
+ */
+class SnmpRttTracker {
+  public:
+    static const size_t kSamples = 128;
+    static const size_t kMinSamples = 16;
+    static const size_t kRefresh = 16;
+
+  private:
+    std::vector<double> samples_;   // ms, ring once full
+    size_t next_;
+    size_t fresh_;          // samples since the last computation
+    double percentile_;     // (0, 100]
+    double value_;          // ms, 0 until kMinSamples
+
+    void compute();
+
+  public:
+    SnmpRttTracker()
+      : next_(0), fresh_(0), percentile_(95), value_(0) {}
+
+    void configure(double aPercentile);
+    void add(double aRtt);
+    double value() const { return value_; }
+};
+
+// void SnmpRttTracker::configure(double aPercentile) {{{
+void SnmpRttTracker::configure(double aPercentile) {
+  percentile_ = aPercentile;
+  compute();
+}
+// }}}
+
+// void SnmpRttTracker::add(double aRtt) {{{
+void SnmpRttTracker::add(double aRtt) {
+  if (samples_.size() < kSamples) {
+    samples_.push_back(aRtt);
+  } else {
+    samples_[next_] = aRtt;
+    next_ = (next_ + 1) % kSamples;
+  }
+  if (++fresh_ >= kRefresh) {
+    compute();
+  }
+}
+// }}}
+
+// void SnmpRttTracker::compute() {{{
+void SnmpRttTracker::compute() {
+  fresh_ = 0;
+  if (samples_.size() < kMinSamples) {
+    value_ = 0;
+    return;
+  }
+  std::vector<double> kSorted(samples_);
+  size_t kRank = static_cast<size_t>(
+      ceil(percentile_ / 100 * kSorted.size()));
+  kRank = std::min(std::max(kRank, static_cast<size_t>(1)), kSorted.size());
+  std::nth_element(kSorted.begin(), kSorted.begin() + kRank - 1,
+      kSorted.end());
+  value_ = kSorted[kRank - 1];
+}
+// }}}
+
+class SnmpSession : public node::ObjectWrap, public SnmpSendQueue,
+    public SnmpResolveClient, public SnmpTimerClient
+{
+  public:
+    typedef Persistent<Function> callback_type;
+
+    struct self_data {
+      SnmpSession* selfPtr_;
+    };
+
+    enum req_type {
+      REQ_NEXT = SNMP_MSG_GETNEXT ,
+      REQ_GET = SNMP_MSG_GET,
+      REQ_BULK = SNMP_MSG_GETBULK
+    };
+
+    struct req_data {
+      netsnmp_pdu* pdu_;
+      req_type type_;
+      callback_type callback_;
+      SnmpWalk* walk_;  // NULL unless the request is a step of native walk
+      size_t walkRoot_;
+      request_options options_;
+      std::string cacheKey_;  // non-empty when response goes to cache
+      double cacheTtl_;
+      SnmpResultSink* sink_;  // takes the result instead of callback_
+      double sent_;           // ms, nowMs clock
+      long reqid_;            // of pdu_, responses are matched by it
+      bool hedged_;           // copy was sent to the alternate address
+      // copy in flight at the alternate address, net-snmp owns it
+      netsnmp_pdu* hedgePdu_;
+      // primary copy failed, pdu_ is the one at the alternate address
+      bool alternateOnly_;
+
+      req_data()
+        : pdu_(NULL), walk_(NULL), walkRoot_(0), cacheTtl_(0), sink_(NULL),
+          sent_(0), reqid_(0), hedged_(false), hedgePdu_(NULL),
+          alternateOnly_(false) {}
+    };
+
+    typedef std::deque<req_data> queue_type;
+    typedef queue_type::iterator queue_iterator;
+
+    // callers of identical request attached to the one in flight
+    struct waiter {
+      callback_type callback_;
+      request_options options_;
+    };
+    typedef std::map<std::string, std::vector<waiter> > waiters_type;
+
+    // keys by expiry, the first one is evicted when the cache is full
+    typedef std::multimap<double, std::string> expiry_index;
+    struct cache_entry {
+      double expires_;  // ms, same clock as nowMs
+      netsnmp_variable_list* vars_;
+      expiry_index::iterator expiry_;
+    };
+    typedef std::map<std::string, cache_entry> cache_type;
+
+    // TTL for OIDs in subtree, longest prefix wins
+    typedef std::map<std::vector<oid>, double> ttl_rules_type;
+
+    // previous raw sample of counter, see computeRates
+    struct rate_sample {
+      uint64_t value_;
+      double time_;       // ms, nowMs clock
+      u_long uptime_;     // sysUpTime of the agent, valid with hasUptime_
+      bool hasUptime_;
+    };
+    typedef std::map<std::vector<oid>, rate_sample> rate_map;
+
+    struct ex_deadline {
+      ev_timer watcher_;
+      bool active_;
+      double at_;       // ms, nowMs clock
+      SnmpSession* selfPtr_;
+    };
+
+    static const size_t kMaxCacheEntries = 4096;
+
+  private:
+    self_data selfData_;
+    std::string hostName_;
+    std::string credentials_;
+    long version_;
+    queue_type queue_;      // sent, waiting for response
+    // copies net-snmp still retries but nobody waits for - of requests taken
+    // out of queue_ (cancelled, past deadline) and losers of hedged ones, as
+    // (reqid, sent to the alternate address). Handles stay watched and each
+    // keeps its send slot until net-snmp is done with it.
+    typedef std::set<std::pair<long, bool> > orphan_set;
+    orphan_set orphans_;
+    queue_type pending_[kPriorityLevels];  // waiting to be sent
+    size_t window_;         // max requests in flight, 0 - unlimited
+    size_t outstanding_;    // copies net-snmp has in flight, see acquireSlot
+    void* sessionHandle_;   // NULL once closed, or while opening_
+    bool opening_;          // waiting for lookup of hostName_
+    callback_type openCallback_;  // called when opening_ is over
+    SnmpSessionManager* manager_;
+    // previous state of tables polled with PollTable, by table and columns
+    std::map<std::string, SnmpWalk::snapshot_type> snapshots_;
+    // responses by (request type, OIDs), see cacheKey
+    cache_type cache_;
+    expiry_index expiry_;
+    waiters_type inFlight_;
+    ttl_rules_type cacheTtl_;
+    unsigned lastId_;
+    ex_deadline deadline_;  // fires at the earliest deadline of requests
+    rate_map rates_;        // by OID, requests with rate option
+    bool bulk_;             // native walks use GETBULK (v2c)
+    SnmpBulkTuner bulkTuner_;
+    uint32_t traceId_;      // session of tracepoints, see SnmpTrace
+    // hedging: requests not answered in time go to the alternate address too
+    void* hedgeHandle_;     // net-snmp session to it, NULL - off
+    SnmpRttTracker rtt_;    // of the primary address
+    double hedgeMin_;       // ms, least delay before the copy is sent
+    double hedgeInitial_;   // ms, delay until RTT percentile is known
+    double hedgeAt_;        // ms, shared timer armed for hedging, 0 - none
+    // net-snmp sessions closed by CloseHandle, really closed at next flush -
+    // Close is usually called from a callback, with snmp_sess_read (or
+    // snmp_sess_timeout) of the same session still on the stack
+    std::vector<void*> closing_;
+
+  private: // ctors
+    SnmpSession()
+      : window_(0), outstanding_(0), sessionHandle_(NULL), opening_(false),
+        lastId_(0), bulk_(false), traceId_(SnmpTrace::nextSession()),
+        hedgeHandle_(NULL), hedgeMin_(0), hedgeInitial_(0), hedgeAt_(0)
+    {
+      selfData_.selfPtr_ = this;
+      deadline_.active_ = false;
+      deadline_.at_ = 0;
+      deadline_.selfPtr_ = this;
+      manager_ = SnmpSessionManager::default_inst();
+#ifdef ENABLE_DEBUG_PRINTS
+      fprintf(stdout, "SnmpSession()\n");
+#endif
+    };
+
+  private: // methods
+    Handle<Value> PerformRequestImpl(
+        req_type aType, netsnmp_pdu* pdu, callback_type aCallback,
+        const request_options& aOptions,
+        const std::string& aCacheKey = std::string(), double aCacheTtl = 0);
+
+    // cache lifetime of response to pdu (least of its OIDs), 0 - don't cache
+    double cacheTtl(netsnmp_pdu* pdu, const request_options& aOptions) const;
+    static std::string cacheKey(req_type aType, netsnmp_pdu* pdu);
+    // result array, empty handle when not cached or expired
+    Local<Array> cachedResult(const std::string& aKey,
+        const request_options& aOptions);
+    void storeResult(const std::string& aKey, double aTtl, netsnmp_pdu* pdu);
+    // takes ownership of aVars
+    void storeVars(const std::string& aKey, double aExpires,
+        netsnmp_variable_list* aVars);
+    // response aFrom (clone of sync request) cached under aKey
+    void adoptResult(const std::string& aKey, SnmpSession* aFrom);
+    void dropCached(cache_type::iterator aEntry);
+    static double nowMs();
+
+    // give new request (or walk) its id and absolute deadline
+    unsigned Track(request_options* aOptions);
+    // take requests (steps of walks, attached callers) with id aId, or with
+    // deadline passed at aNow when aId is 0, out of the queues. Unsent pdus
+    // are freed. Request with other callers attached stays, the first of them
+    // takes it over.
+    void Take(unsigned aId, double aNow, queue_type* aTaken,
+        std::vector<waiter>* aWaiters);
+    // fail requests past their deadline
+    void ExpireRequests();
+    void armDeadline(double aDeadline);
+    void rearmDeadline();
+    static void deadline_cb(EV_P_ ev_timer* w, int revents);
+
+    void snmp_reply_cb(
+        int operation,
+        struct snmp_pdu* pdu,
+        req_data& magic
+        );
+
+    // queue request  for sending (at next prepare, by  priority, see window_),
+    // NULL when the session is closed. Returned record stays valid until the
+    // request is sent.
+    req_data* SendRequest(req_type aType, netsnmp_pdu* pdu,
+        const callback_type& aCallback, SnmpWalk* aWalk, size_t aWalkRoot,
+        const request_options& aOptions);
+    void flushPending();
+
+    // pass result (or failure, aReason overrides operation) of request that
+    // left the queues to callback(s) and release the request
+    void Complete(int operation, netsnmp_pdu* pdu, req_data& aReq,
+        const char* aReason = NULL);
+
+    // session has requests in flight - manager watches it
+    void Activate();
+    void Deactivate();
+
+    // every copy sent (hedges included) takes a slot of window_ and of the
+    // manager's in-flight limit, false when there is none free
+    bool acquireSlot();
+    // copies are done, queued requests may go out
+    void releaseSlots(size_t aCount);
+    // net-snmp is done with the request copies
+    void orphan(const req_data& aReq);
+
+    // send copies of requests waiting longer than hedgeDelay to the alternate
+    // address, arm the timer for the next one
+    void onTimer();
+    double hedgeDelay() const;
+    void armHedge(double aAt);
+    void closeHedge(bool aDefer = true);
+
+    // take requests out of the queues and close net-snmp session, in-flight
+    // first, unsent (their pdus freed) after them. Callbacks of the taken
+    // requests are up to the caller.
+    // Without aDefer (destructor) net-snmp sessions are closed right away.
+    void CloseHandle(queue_type* aPending, bool aDefer = true);
+    // net-snmp session goes to closing_, JS object is kept alive until then
+    // (snmp_cb magic)
+    void closeLater(void* aHandle, bool aDefer);
+    void closeDeferred();
+    static void closeNow(void* aHandle);
+
+    bool StartWalk(SnmpWalk* aWalk, const callback_type& aCallback);
+    void ContinueWalk(req_data& magic);
+
+    void snmp_result_cb(
+        const req_data& magic,
+        Handle<Value> aResult
+        );
+
+    void snmp_success_cb(
+        struct snmp_pdu* pdu,
+        const req_data& magic
+        );
+
+    void snmp_walk_cb(
+        int operation,
+        struct snmp_pdu* pdu,
+        req_data& magic
+        );
+
+    // aData (null when empty) is passed to callback along with the error
+    void snmp_fail_cb(
+        struct snmp_pdu* pdu,
+        const req_data& magic,
+        const char* reason,
+        Handle<Value> aData = Handle<Value>(),
+        Handle<Value> aExtra = Handle<Value>()
+        );
+
+    // results written to options_.output_ - failure reason for walks that
+    // failed part way, their checkpoint as aExtra
+    void snmp_written_cb(
+        const req_data& magic,
+        const SnmpWriter& aWriter,
+        const char* reason = NULL,
+        Handle<Value> aExtra = Handle<Value>()
+        );
+
+    int snmp_cb_proxy(
+        int operation,
+        netsnmp_session* session,
+        int reqid,
+        struct snmp_pdu* pdu
+        );
+
+    // void getBulk(
+    //     const oid* aOID, std::size_t aOIDLen,
+    //     const callback_type& aCallback);
+
+    /**
+     * We can't mix sync and async queries in same session (they would use same
+     * descriptor, and we don't want responses to earlier requests, or to allow
+     * node to process  other async operations, when in sync  mode). Since sync
+     * version is inefficient by definition, it doesn't matter if we add little
+     * more inefficiency and open another session to same host.
+     */
+    SnmpSession* Clone(SnmpSessionManager* aManager);
+
+  private: // static callback proxy
+    static int snmp_cb(
+        int operation,
+        netsnmp_session* session,
+        int reqid,
+        struct snmp_pdu* pdu,
+        void* magic);
+
+  private: // static interface for V8 integration
+    static Persistent<v8::FunctionTemplate> constructorTemplate_;
+
+    static Handle<Value> PerformRequest(req_type aType, const Arguments& args);
+
+    // entrypoints from V8, all just call
+    static Handle<Value> Get(const Arguments& args);
+    static Handle<Value> GetNext(const Arguments& args);
+    static Handle<Value> GetBulk(const Arguments& args);
+    static Handle<Value> GetTable(const Arguments& args);
+    static Handle<Value> PollTable(const Arguments& args);
+    static Handle<Value> StartTableWalk(const Arguments& args, bool aPoll);
+    static Handle<Value> Walk(const Arguments& args);
+    static Handle<Value> Close(const Arguments& args);
+    static Handle<Value> SetCacheTtl(const Arguments& args);
+    static Handle<Value> SetMaxInFlight(const Arguments& args);
+    static Handle<Value> Cancel(const Arguments& args);
+    static Handle<Value> SetBulk(const Arguments& args);
+
+    // with aAsync, host name that is not cached is looked up in background
+    // and requests wait in the queues (opening_). Otherwise it is resolved
+    // right away, through the cache.
+    static SnmpSession* New(const std::string& hostName,
+        const std::string& credentials, long aVersion, bool aAsync = false);
+    bool open(const std::string& aPeer);
+    // net-snmp session with credentials of this one, NULL on failure
+    void* openHandle(const std::string& aPeer);
+    // requests are accepted (not closed)
+    bool isOpen() const { return sessionHandle_ || opening_; }
+    void onResolved(const std::string& aAddress, const char* aError);
+    static Handle<Value> IsOpening(const Arguments& args);
+    static Handle<Value> TraceId(const Arguments& args);
+    static Handle<Value> SetHedge(const Arguments& args);
+
+  public:
+    ~SnmpSession();
+
+    // send GET/GETNEXT with result going to aSink, returns request id (for
+    // CancelRequest), 0 when the session is closed (pdu is freed then)
+    unsigned Submit(req_type aType, netsnmp_pdu* pdu, SnmpResultSink* aSink,
+        request_options aOptions);
+    // drop request without calling its callback, false if there is none
+    bool CancelRequest(unsigned aId);
+
+    // delta and per-second rate of each varbind (pairs in aOut, NaN when not
+    // a counter or without valid previous sample), samples replace previous
+    // ones. Counter32 wraps, agent restart (sysUpTime.0 in vars going back)
+    // resets.
+    void computeRates(netsnmp_variable_list* vars, std::vector<double>* aOut);
+    // rates as one Buffer of little endian doubles, no JS value per sample
+    static Local<Object> ratesToV8(const std::vector<double>& aRates);
+    // 8 bytes per rate at aOut
+    static void writeRates(const std::vector<double>& aRates, char* aOut);
+    // JS Buffer over aLength bytes of aSlow from aOffset
+    static Local<Object> bufferToV8(node::Buffer* aSlow, size_t aOffset,
+        size_t aLength);
+    // append sysUpTime.0 unless pdu has it, for restart detection and exact
+    // time base of rates
+    static bool addUptimeVar(netsnmp_pdu* pdu);
+
+    static bool HasInstance(Handle<Value> aValue);
+    static Handle<Value> New(const Arguments& args);
+    static void Initialize(Handle<Object> target);
+};
+
+Persistent<v8::FunctionTemplate> SnmpSession::constructorTemplate_;
+
+// bool SnmpSession::HasInstance(Handle<Value> aValue) {{{
+bool SnmpSession::HasInstance(Handle<Value> aValue) {
+  return aValue->IsObject() &&
+    constructorTemplate_->HasInstance(aValue->ToObject());
+}
+// }}}
+
+// SnmpSession* SnmpSession::Clone(SnmpSessionManager* aManager) {{{
+SnmpSession* SnmpSession::Clone(SnmpSessionManager* aManager) {
+  SnmpSession* kResult = SnmpSession::New(hostName_, credentials_, version_);
+  if (kResult) {
+    kResult->manager_ = aManager;
+  }
+  return kResult;
+}
+// }}}
+
+// SnmpSession::~SnmpSession() {{{
+SnmpSession::~SnmpSession() {
+#ifdef ENABLE_DEBUG_PRINTS
+  fprintf(stdout, "~SnmpSession()\n");
+#endif
+  // JS object is kept alive while requests are pending, so there is something
+  // left only for sync clones and at exit. Callbacks can't be called from
+  // here (GC), just release everything.
+  queue_type kPending;
+  CloseHandle(&kPending, false);
+  // sync clones, their manager goes away right after
+  closeDeferred();
+  manager_->unschedule(this);
+
+  std::vector<SnmpWalk*> kWalks;
+  for (queue_iterator it = kPending.begin(); it != kPending.end(); ++it) {
+    if (!it->walk_) {
+      it->callback_.Dispose();
+    } else if (std::find(kWalks.begin(), kWalks.end(), it->walk_) ==
+        kWalks.end())
+    {
+      // steps of one walk share the callback
+      if (!it->walk_->reported()) {
+        it->callback_.Dispose();
+      }
+      kWalks.push_back(it->walk_);
+    }
+  }
+  for (size_t i = 0; i < kWalks.size(); ++i) {
+    delete kWalks[i];
+  }
+
+  waiters_type::iterator w_end = inFlight_.end();
+  for (waiters_type::iterator w = inFlight_.begin(); w != w_end; ++w) {
+    for (size_t i = 0; i < w->second.size(); ++i) {
+      w->second[i].callback_.Dispose();
+    }
+  }
+  cache_type::iterator c_end = cache_.end();
+  for (cache_type::iterator c = cache_.begin(); c != c_end; ++c) {
+    snmp_free_varbind(c->second.vars_);
+  }
+}
+// }}}
+
+// void SnmpSession::Activate() {{{
+void SnmpSession::Activate() {
+  manager_->addClient(sessionHandle_);
+  if (hedgeHandle_) {
+    manager_->addClient(hedgeHandle_);
+  }
+}
+// }}}
+
+// void SnmpSession::Deactivate() {{{
+void SnmpSession::Deactivate() {
+  manager_->removeClient(sessionHandle_);
+  if (hedgeHandle_) {
+    manager_->removeClient(hedgeHandle_);
+  }
+}
+// }}}
+
+// bool SnmpSession::acquireSlot() {{{
+bool SnmpSession::acquireSlot() {
+  if ((window_ != 0 && outstanding_ >= window_) ||
+      !manager_->acquireSend(this))
+  {
+    return false;
+  }
+  ++outstanding_;
+  return true;
+}
+// }}}
+
+// void SnmpSession::releaseSlots(size_t aCount) {{{
+void SnmpSession::releaseSlots(size_t aCount) {
+  assert(outstanding_ >= aCount);
+  outstanding_ -= aCount;
+  manager_->releaseSend(aCount);
+  for (int i = 0; i < kPriorityLevels; ++i) {
+    if (!pending_[i].empty()) {
+      manager_->schedule(this);
+      break;
+    }
+  }
+}
+// }}}
+
+// void SnmpSession::orphan(const req_data& aReq) {{{
+void SnmpSession::orphan(const req_data& aReq) {
+  if (!aReq.alternateOnly_) {
+    orphans_.insert(std::make_pair(aReq.reqid_, false));
+  }
+  if (aReq.hedgePdu_ || aReq.alternateOnly_) {
+    orphans_.insert(std::make_pair(aReq.reqid_, true));
+  }
+}
+// }}}
+
+// double SnmpSession::hedgeDelay() const {{{
+double SnmpSession::hedgeDelay() const {
+  double kRtt = rtt_.value();
+  return std::max(kRtt > 0 ? kRtt : hedgeInitial_, hedgeMin_);
+}
+// }}}
+
+// void SnmpSession::armHedge(double aAt) {{{
+void SnmpSession::armHedge(double aAt) {
+  if (hedgeAt_ != 0 && hedgeAt_ <= aAt) {
+    return;
+  }
+  if (hedgeAt_ != 0) {
+    manager_->removeTimer(hedgeAt_, this);
+  }
+  manager_->addTimer(aAt, this);
+  hedgeAt_ = aAt;
+}
+// }}}
+
+// void SnmpSession::onTimer() {{{
+void SnmpSession::onTimer() {
+  hedgeAt_ = 0;
+  if (!hedgeHandle_) {
+    return;
+  }
+  double kDelay = hedgeDelay();
+  // due within the manager's clock resolution counts as due
+  double kNow = nowMs() + 1;
+  double kNext = 0;
+  for (queue_iterator it = queue_.begin(); it != queue_.end(); ++it) {
+    if (it->hedged_) {
+      continue;
+    }
+    double kDue = it->sent_ + kDelay;
+    if (kDue > kNow) {
+      if (kNext == 0 || kDue < kNext) {
+        kNext = kDue;
+      }
+      continue;
+    }
+    // the copy counts against in-flight limits like any request, no hedging
+    // without a free slot - try again after another delay
+    if (!acquireSlot()) {
+      if (kNext == 0 || kNow + kDelay < kNext) {
+        kNext = kNow + kDelay;
+      }
+      break;
+    }
+    // same request id, whichever response comes first completes the request
+    // and the other one becomes orphan
+    it->hedged_ = true;
+    netsnmp_pdu* kCopy = snmp_clone_pdu(it->pdu_);
+    SNMP_TRACE(EVENT_HEDGE, request__hedge, traceId_, it->reqid_);
+    if (!kCopy || !snmp_sess_send(hedgeHandle_, kCopy)) {
+      if (kCopy) {
+        snmp_free_pdu(kCopy);
+      }
+      --outstanding_;
+      manager_->releaseSend(1);
+      continue;
+    }
+    it->hedgePdu_ = kCopy;
+  }
+  if (kNext != 0) {
+    armHedge(kNext);
+  }
+}
+// }}}
+
+// void SnmpSession::closeHedge(bool aDefer) {{{
+void SnmpSession::closeHedge(bool aDefer) {
+  if (hedgeAt_ != 0) {
+    manager_->removeTimer(hedgeAt_, this);
+    hedgeAt_ = 0;
+  }
+  if (hedgeHandle_) {
+    closeLater(hedgeHandle_, aDefer);
+    hedgeHandle_ = NULL;
+  }
+}
+// }}}
+
+// void SnmpSession::closeLater(void* aHandle, bool aDefer) {{{
+void SnmpSession::closeLater(void* aHandle, bool aDefer) {
+  if (!aDefer) {
+    closeNow(aHandle);
+    return;
+  }
+  if (closing_.empty() && !handle_.IsEmpty()) {
+    Ref();
+  }
+  closing_.push_back(aHandle);
+  manager_->schedule(this);
+}
+// }}}
+
+// void SnmpSession::closeDeferred() {{{
+void SnmpSession::closeDeferred() {
+  if (closing_.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < closing_.size(); ++i) {
+    closeNow(closing_[i]);
+  }
+  closing_.clear();
+  if (!handle_.IsEmpty()) {
+    Unref();
+  }
+}
+// }}}
+
+// void SnmpSession::closeNow(void* aHandle) {{{
+void SnmpSession::closeNow(void* aHandle) {
+  // net-snmp may notify about the close through snmp_cb, queue is empty by
+  // now and such calls are ignored
+  SnmpBatchIo::detach(snmp_sess_transport(aHandle));
+  snmp_sess_close(aHandle);
+}
+// }}}
+
+// void SnmpSession::CloseHandle(queue_type* aPending, bool aDefer) {{{
+void SnmpSession::CloseHandle(queue_type* aPending, bool aDefer) {
+  if (!isOpen()) {
+    return;
+  }
+  aPending->swap(queue_);
+  if (!aPending->empty() || !orphans_.empty()) {
+    Deactivate();
+  }
+  // closing the handles drops every copy still in flight
+  orphans_.clear();
+  manager_->releaseSend(outstanding_);
+  outstanding_ = 0;
+  manager_->unschedule(this);
+  closeHedge(aDefer);
+  if (deadline_.active_) {
+    manager_->stopTimer(&deadline_.watcher_);
+    deadline_.active_ = false;
+  }
+  for (int i = 0; i < kPriorityLevels; ++i) {
+    for (queue_iterator it = pending_[i].begin(); it != pending_[i].end();
+        ++it)
+    {
+      snmp_free_pdu(it->pdu_);
+      it->pdu_ = NULL;
+      aPending->push_back(*it);
+    }
+    pending_[i].clear();
+  }
+  manager_->countRequests(-static_cast<long>(aPending->size()));
+  if (opening_) {
+    manager_->cancelResolve(this);
+    opening_ = false;
+    openCallback_.Dispose();
+    openCallback_.Clear();
+    // reference taken for the lookup
+    if (!handle_.IsEmpty()) {
+      Unref();
+    }
+    return;
+  }
+#ifdef ENABLE_DEBUG_PRINTS
+  fprintf(stdout, "close handle %p\n", sessionHandle_);
+#endif
+  closeLater(sessionHandle_, aDefer);
+  sessionHandle_ = NULL;
+  SNMP_TRACE(EVENT_CLOSE, session__close, traceId_, 0);
+}
+// }}}
+
+// Handle<Value> SnmpSession::PerformRequestImpl(...) {{{
+Handle<Value> SnmpSession::PerformRequestImpl(
+    req_type aType, netsnmp_pdu* pdu, callback_type aCallback,
+    const request_options& aOptions,
+    const std::string& aCacheKey, double aCacheTtl)
+{
+  HandleScope kScope;
+
+  // steps of JS walks (see getNextSubtree in snmp.js) are sent from callbacks
+  // where nobody could catch the exception - only the first step is admitted
+  const char* kRejected =
+    aOptions.continuation_ ? NULL : manager_->admit();
+  if (kRejected) {
+    snmp_free_pdu(pdu);
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(kRejected)));
+  }
+
+  callback_type kCallback = v8::Persistent<Function>::New(aCallback);
+  req_data* kReq = SendRequest(aType, pdu, kCallback, NULL, 0, aOptions);
+  if (!kReq) {
+    snmp_free_pdu(pdu);
+    kCallback.Dispose();
+    return kScope.Close(
+        v8::ThrowException(NODE_PSYMBOL("cannot send query")));
+  }
+  if (!aCacheKey.empty()) {
+    // identical requests attach here until the response arrives
+    kReq->cacheKey_ = aCacheKey;
+    kReq->cacheTtl_ = aCacheTtl;
+    inFlight_[aCacheKey];
+  }
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// double SnmpSession::nowMs() {{{
+double SnmpSession::nowMs() {
+  return SnmpSessionManager::nowMs();
+}
+// }}}
+
+namespace {
+// sysUpTime.0
+const oid kSysUpTime[] = { 1, 3, 6, 1, 2, 1, 1, 3, 0 };
+const size_t kSysUpTimeLength = sizeof(kSysUpTime) / sizeof(oid);
+
+// bool is_uptime(netsnmp_variable_list* var) {{{
+bool is_uptime(netsnmp_variable_list* var) {
+  return var->type == ASN_TIMETICKS && var->name_length == kSysUpTimeLength &&
+    !memcmp(var->name, kSysUpTime, sizeof(kSysUpTime));
+}
+// }}}
+}
+
+// bool SnmpSession::addUptimeVar(netsnmp_pdu* pdu) {{{
+bool SnmpSession::addUptimeVar(netsnmp_pdu* pdu) {
+  for (netsnmp_variable_list* var = pdu->variables; var;
+      var = var->next_variable)
+  {
+    if (var->name_length == kSysUpTimeLength &&
+        !memcmp(var->name, kSysUpTime, sizeof(kSysUpTime)))
+    {
+      return true;
+    }
+  }
+  return snmp_add_null_var(pdu, kSysUpTime, kSysUpTimeLength) != NULL;
+}
+// }}}
+
+// void SnmpSession::computeRates(...) {{{
+void SnmpSession::computeRates(netsnmp_variable_list* vars,
+    std::vector<double>* aOut)
+{
+  const double kNaN = std::numeric_limits<double>::quiet_NaN();
+  double kNow = nowMs();
+
+  // agent clock (centiseconds) is the time base when available, it doesn't
+  // include network delays and detects restarts
+  bool kHasUptime = false;
+  u_long kUptime = 0;
+  for (netsnmp_variable_list* var = vars; var; var = var->next_variable) {
+    if (is_uptime(var)) {
+      kHasUptime = true;
+      kUptime = *var->val.integer & 0xffffffffUL;
+    }
+  }
+
+  aOut->clear();
+  for (netsnmp_variable_list* var = vars; var; var = var->next_variable) {
+    double kDelta = kNaN;
+    double kRate = kNaN;
+    uint64_t kValue;
+
+    if (var->type == ASN_COUNTER) {
+      kValue = *var->val.integer & 0xffffffffUL;
+    } else if (var->type == ASN_COUNTER64) {
+      kValue = (static_cast<uint64_t>(var->val.counter64->high) << 32) |
+        (var->val.counter64->low & 0xffffffffUL);
+    } else {
+      aOut->push_back(kDelta);
+      aOut->push_back(kRate);
+      continue;
+    }
+
+    std::vector<oid> kKey(var->name, var->name + var->name_length);
+    rate_map::iterator it = rates_.lower_bound(kKey);
+    if (it == rates_.end() || it->first != kKey) {
+      rate_sample kEmpty = { 0, 0, 0, false };
+      it = rates_.insert(it, rate_map::value_type(kKey, kEmpty));
+    } else {
+      rate_sample& kPrev = it->second;
+      bool kRestart =
+        kHasUptime && kPrev.hasUptime_ && kUptime < kPrev.uptime_;
+      bool kValid = !kRestart;
+      uint64_t kDiff = 0;
+      if (kValue >= kPrev.value_) {
+        kDiff = kValue - kPrev.value_;
+      } else if (var->type == ASN_COUNTER) {
+        // single wrap since previous sample
+        kDiff = kValue + (static_cast<uint64_t>(1) << 32) - kPrev.value_;
+      } else {
+        // Counter64 doesn't wrap in practice, it was reset
+        kValid = false;
+      }
+      if (kValid) {
+        double kSeconds = kHasUptime && kPrev.hasUptime_ ?
+          (kUptime - kPrev.uptime_) / 100.0 : (kNow - kPrev.time_) / 1000;
+        kDelta = static_cast<double>(kDiff);
+        if (kSeconds > 0) {
+          kRate = kDelta / kSeconds;
+        }
+      }
+    }
+    it->second.value_ = kValue;
+    it->second.time_ = kNow;
+    it->second.uptime_ = kUptime;
+    it->second.hasUptime_ = kHasUptime;
+
+    aOut->push_back(kDelta);
+    aOut->push_back(kRate);
+  }
+}
+// }}}
+
+// Local<Object> SnmpSession::ratesToV8(...) {{{
+Local<Object> SnmpSession::ratesToV8(const std::vector<double>& aRates) {
+  HandleScope kScope;
+  size_t kLength = aRates.size() * sizeof(uint64_t);
+  node::Buffer* kSlow = node::Buffer::New(kLength);
+  writeRates(aRates, node::Buffer::Data(kSlow));
+  return kScope.Close(bufferToV8(kSlow, 0, kLength));
+}
+// }}}
+
+// void SnmpSession::writeRates(...) {{{
+void SnmpSession::writeRates(const std::vector<double>& aRates, char* aOut) {
+  // byte order fixed as for packed OIDs, readDoubleLE reads them back
+  for (size_t i = 0; i < aRates.size(); ++i) {
+    uint64_t kBits;
+    memcpy(&kBits, &aRates[i], sizeof(kBits));
+    for (size_t k = 0; k < sizeof(kBits); ++k) {
+      *aOut++ = static_cast<char>((kBits >> (8 * k)) & 0xff);
+    }
+  }
+}
+// }}}
+
+// Local<Object> SnmpSession::bufferToV8(...) {{{
+Local<Object> SnmpSession::bufferToV8(node::Buffer* aSlow, size_t aOffset,
+    size_t aLength)
+{
+  HandleScope kScope;
+  Local<Function> kConstructor = Local<Function>::Cast(
+      v8::Context::GetCurrent()->Global()->Get(String::New("Buffer")));
+  Handle<Value> kArgs[3] = {
+    aSlow->handle_,
+    v8::Integer::NewFromUnsigned(aLength),
+    v8::Integer::NewFromUnsigned(aOffset)
+  };
+  return kScope.Close(kConstructor->NewInstance(3, kArgs));
+}
+// }}}
+
+// unsigned SnmpSession::Track(request_options* aOptions) {{{
+unsigned SnmpSession::Track(request_options* aOptions) {
+  if (++lastId_ == 0) {
+    ++lastId_;
+  }
+  aOptions->id_ = lastId_;
+  if (aOptions->deadline_ > 0) {
+    aOptions->deadline_ += nowMs();
+  }
+  return lastId_;
+}
+// }}}
+
+namespace {
+// bool request_matches(...) {{{
+bool request_matches(const request_options& aOptions, unsigned aId,
+    double aNow)
+{
+  if (aId) {
+    return aOptions.id_ == aId;
+  }
+  return aOptions.deadline_ > 0 && aOptions.deadline_ <= aNow;
+}
+// }}}
+}
+
+// void SnmpSession::Take(...) {{{
+void SnmpSession::Take(unsigned aId, double aNow, queue_type* aTaken,
+    std::vector<waiter>* aWaiters)
+{
+  // attached callers first, so that none of the taken ones inherits request
+  waiters_type::iterator w_end = inFlight_.end();
+  for (waiters_type::iterator w = inFlight_.begin(); w != w_end; ++w) {
+    std::vector<waiter>& kList = w->second;
+    for (size_t i = 0; i < kList.size(); ) {
+      if (request_matches(kList[i].options_, aId, aNow)) {
+        aWaiters->push_back(kList[i]);
+        kList.erase(kList.begin() + i);
+      } else {
+        ++i;
+      }
+    }
+  }
+
+  // in flight (index 0, responses to taken ones are ignored), then unsent
+  for (int q = 0; q <= kPriorityLevels; ++q) {
+    queue_type& kQueue = q == 0 ? queue_ : pending_[q - 1];
+    for (queue_iterator it = kQueue.begin(); it != kQueue.end(); ) {
+      if (!request_matches(it->options_, aId, aNow)) {
+        ++it;
+        continue;
+      }
+      if (!it->walk_ && !it->cacheKey_.empty()) {
+        waiters_type::iterator kAttached = inFlight_.find(it->cacheKey_);
+        if (kAttached != inFlight_.end()) {
+          if (!kAttached->second.empty()) {
+            waiter kOwner = { it->callback_, it->options_ };
+            aWaiters->push_back(kOwner);
+            it->callback_ = kAttached->second.front().callback_;
+            it->options_ = kAttached->second.front().options_;
+            kAttached->second.erase(kAttached->second.begin());
+            ++it;
+            continue;
+          }
+          inFlight_.erase(kAttached);
+        }
+      }
+      if (q != 0) {
+        snmp_free_pdu(it->pdu_);
+        it->pdu_ = NULL;
+      } else {
+        // net-snmp times it out (or reads its response) only while the
+        // handle is watched, see snmp_cb_proxy
+        orphan(*it);
+      }
+      manager_->countRequests(-1);
+      aTaken->push_back(*it);
+      it = kQueue.erase(it);
+    }
+  }
+  for (int i = 0; i < kPriorityLevels; ++i) {
+    if (!pending_[i].empty()) {
+      manager_->schedule(this);
+      break;
+    }
+  }
+}
+// }}}
+
+// unsigned SnmpSession::Submit(...) {{{
+unsigned SnmpSession::Submit(req_type aType, netsnmp_pdu* pdu,
+    SnmpResultSink* aSink, request_options aOptions)
+{
+  unsigned kId = Track(&aOptions);
+  req_data* kReq = SendRequest(aType, pdu, callback_type(), NULL, 0,
+      aOptions);
+  if (!kReq) {
+    snmp_free_pdu(pdu);
+    return 0;
+  }
+  kReq->sink_ = aSink;
+  return kId;
+}
+// }}}
+
+// bool SnmpSession::CancelRequest(unsigned aId) {{{
+bool SnmpSession::CancelRequest(unsigned aId) {
+  queue_type kTaken;
+  std::vector<waiter> kWaiters;
+  Take(aId, 0, &kTaken, &kWaiters);
+
+  for (size_t i = 0; i < kWaiters.size(); ++i) {
+    kWaiters[i].callback_.Dispose();
+  }
+  // steps of one walk share the callback
+  std::vector<SnmpWalk*> kWalks;
+  for (queue_iterator it = kTaken.begin(); it != kTaken.end(); ++it) {
+    if (!it->walk_) {
+      it->callback_.Dispose();
+    } else if (std::find(kWalks.begin(), kWalks.end(), it->walk_) ==
+        kWalks.end())
+    {
+      if (!it->walk_->reported()) {
+        it->callback_.Dispose();
+      }
+      kWalks.push_back(it->walk_);
+    }
+  }
+  for (size_t i = 0; i < kWalks.size(); ++i) {
+    delete kWalks[i];
+  }
+  // no JS runs from here, nothing can collect the object before return
+  if (!handle_.IsEmpty()) {
+    for (size_t i = 0; i < kTaken.size(); ++i) {
+      Unref();
+    }
+  }
+  rearmDeadline();
+  return !kTaken.empty() || !kWaiters.empty();
+}
+// }}}
+
+// void SnmpSession::ExpireRequests() {{{
+void SnmpSession::ExpireRequests() {
+  queue_type kTaken;
+  std::vector<waiter> kWaiters;
+  Take(0, nowMs(), &kTaken, &kWaiters);
+  rearmDeadline();
+
+  // taken requests keep the object referenced until their Complete
+  const char* kReason = "deadline exceeded";
+  for (size_t i = 0; i < kWaiters.size(); ++i) {
+    req_data kReq;
+    kReq.callback_ = kWaiters[i].callback_;
+    kReq.options_ = kWaiters[i].options_;
+    snmp_fail_cb(NULL, kReq, kReason);
+    kReq.callback_.Dispose();
+  }
+  for (queue_iterator it = kTaken.begin(); it != kTaken.end(); ++it) {
+    Complete(NETSNMP_CALLBACK_OP_TIMED_OUT, NULL, *it, kReason);
+  }
+}
+// }}}
+
+// void SnmpSession::armDeadline(double aDeadline) {{{
+void SnmpSession::armDeadline(double aDeadline) {
+  if (deadline_.active_ && deadline_.at_ <= aDeadline) {
+    return;
+  }
+  if (deadline_.active_) {
+    manager_->stopTimer(&deadline_.watcher_);
+  }
+  double kDelay = std::max(aDeadline - nowMs(), 0.0) / 1000;
+  ev_timer_init(&deadline_.watcher_, &SnmpSession::deadline_cb, kDelay, 0.0);
+  manager_->startTimer(&deadline_.watcher_);
+  deadline_.active_ = true;
+  deadline_.at_ = aDeadline;
+}
+// }}}
+
+// void SnmpSession::rearmDeadline() {{{
+void SnmpSession::rearmDeadline() {
+  // earliest deadline of what is left, the timer stays off without one
+  if (deadline_.active_) {
+    manager_->stopTimer(&deadline_.watcher_);
+    deadline_.active_ = false;
+  }
+  double kNext = 0;
+  for (int q = 0; q <= kPriorityLevels; ++q) {
+    const queue_type& kQueue = q == 0 ? queue_ : pending_[q - 1];
+    for (queue_type::const_iterator it = kQueue.begin(); it != kQueue.end();
+        ++it)
+    {
+      double d = it->options_.deadline_;
+      if (d > 0 && (kNext == 0 || d < kNext)) {
+        kNext = d;
+      }
+    }
+  }
+  waiters_type::const_iterator w_end = inFlight_.end();
+  for (waiters_type::const_iterator w = inFlight_.begin(); w != w_end; ++w) {
+    for (size_t i = 0; i < w->second.size(); ++i) {
+      double d = w->second[i].options_.deadline_;
+      if (d > 0 && (kNext == 0 || d < kNext)) {
+        kNext = d;
+      }
+    }
+  }
+  if (kNext > 0) {
+    armDeadline(kNext);
+  }
+}
+// }}}
+
+// void SnmpSession::deadline_cb(EV_P_ ev_timer* w, int revents) {{{
+void SnmpSession::deadline_cb(EV_P_ ev_timer* w, int revents) {
+  ex_deadline* data = reinterpret_cast<ex_deadline*>(w);
+  data->active_ = false;
+  data->selfPtr_->ExpireRequests();
+}
+// }}}
+
+// double SnmpSession::cacheTtl(...) const {{{
+double SnmpSession::cacheTtl(netsnmp_pdu* pdu,
+    const request_options& aOptions) const
+{
+  if (aOptions.rate_ || aOptions.format_ != FORMAT_NONE) {
+    // every response is a new sample, or it goes to caller's buffer
+    return 0;
+  }
+  double kResult = -1;
+  for (netsnmp_variable_list* var = pdu->variables; var;
+      var = var->next_variable)
+  {
+    double kTtl = aOptions.cacheTtl_;
+    size_t kBest = 0;
+    // few rules per session, linear scan is fine
+    ttl_rules_type::const_iterator it_end = cacheTtl_.end();
+    for (ttl_rules_type::const_iterator it = cacheTtl_.begin();
+        it != it_end; ++it)
+    {
+      if (it->first.size() > kBest && it->first.size() <= var->name_length &&
+          std::equal(it->first.begin(), it->first.end(), var->name))
+      {
+        kBest = it->first.size();
+        kTtl = it->second;
+      }
+    }
+    if (kResult < 0 || kTtl < kResult) {
+      kResult = kTtl;
+    }
+  }
+  return kResult > 0 ? kResult : 0;
+}
+// }}}
+
+// std::string SnmpSession::cacheKey(req_type aType, netsnmp_pdu* pdu) {{{
+std::string SnmpSession::cacheKey(req_type aType, netsnmp_pdu* pdu) {
+  // request type (GetBulk also its repetitions), then length and subids of
+  // each OID, as raw bytes
+  std::string kKey(1, static_cast<char>(aType));
+  if (aType == REQ_BULK) {
+    long kBulk[2] = { pdu->non_repeaters, pdu->max_repetitions };
+    kKey.append(reinterpret_cast<const char*>(kBulk), sizeof(kBulk));
+  }
+  for (netsnmp_variable_list* var = pdu->variables; var;
+      var = var->next_variable)
+  {
+    size_t kLength = var->name_length;
+    kKey.append(reinterpret_cast<const char*>(&kLength), sizeof(kLength));
+    kKey.append(reinterpret_cast<const char*>(var->name),
+        var->name_length * sizeof(oid));
+  }
+  return kKey;
+}
+// }}}
+
+// Local<Array> SnmpSession::cachedResult(...) {{{
+Local<Array> SnmpSession::cachedResult(const std::string& aKey,
+    const request_options& aOptions)
+{
+  HandleScope kScope;
+
+  cache_type::iterator it = cache_.find(aKey);
+  if (it == cache_.end()) {
+    return Local<Array>();
+  }
+  if (it->second.expires_ <= nowMs()) {
+    dropCached(it);
+    return Local<Array>();
+  }
+
+  Local<Array> kResult = v8::Array::New(0);
+  uint32_t index = 0;
+  for (netsnmp_variable_list* var = it->second.vars_; var;
+      var = var->next_variable, ++index)
+  {
+    kResult->Set(index, SnmpResult::New(var, aOptions.primitive_));
+  }
+  return kScope.Close(kResult);
+}
+// }}}
+
+// void SnmpSession::storeResult(...) {{{
+void SnmpSession::storeResult(const std::string& aKey, double aTtl,
+    netsnmp_pdu* pdu)
+{
+  netsnmp_variable_list* kVars = snmp_clone_varbind(pdu->variables);
+  if (!kVars && pdu->variables) {
+    return;
+  }
+  storeVars(aKey, nowMs() + aTtl, kVars);
+}
+// }}}
+
+// void SnmpSession::storeVars(...) {{{
+void SnmpSession::storeVars(const std::string& aKey, double aExpires,
+    netsnmp_variable_list* aVars)
+{
+  cache_type::iterator it = cache_.find(aKey);
+  if (it != cache_.end()) {
+    dropCached(it);
+  }
+  // expired entries go first, then those closest to expiry
+  while (cache_.size() >= kMaxCacheEntries) {
+    dropCached(cache_.find(expiry_.begin()->second));
+  }
+
+  cache_entry& kEntry = cache_[aKey];
+  kEntry.vars_ = aVars;
+  kEntry.expires_ = aExpires;
+  kEntry.expiry_ = expiry_.insert(expiry_index::value_type(aExpires, aKey));
+}
+// }}}
+
+// void SnmpSession::adoptResult(...) {{{
+void SnmpSession::adoptResult(const std::string& aKey, SnmpSession* aFrom) {
+  cache_type::iterator it = aFrom->cache_.find(aKey);
+  if (it == aFrom->cache_.end()) {
+    return;
+  }
+  netsnmp_variable_list* kVars = it->second.vars_;
+  double kExpires = it->second.expires_;
+  it->second.vars_ = NULL;
+  aFrom->dropCached(it);
+  storeVars(aKey, kExpires, kVars);
+}
+// }}}
+
+// void SnmpSession::dropCached(cache_type::iterator aEntry) {{{
+void SnmpSession::dropCached(cache_type::iterator aEntry) {
+  snmp_free_varbind(aEntry->second.vars_);
+  expiry_.erase(aEntry->second.expiry_);
+  cache_.erase(aEntry);
+}
+// }}}
+
+// bool SnmpSession::SendRequest(...) {{{
+SnmpSession::req_data* SnmpSession::SendRequest(req_type aType,
+    netsnmp_pdu* pdu, const callback_type& aCallback, SnmpWalk* aWalk,
+    size_t aWalkRoot, const request_options& aOptions)
+{
+  if (!isOpen()) {
+    return NULL;
+  }
+  int kLevel = std::min(std::max(aOptions.priority_, 0), kPriorityLevels - 1);
+  queue_type& kQueue = pending_[kLevel];
+
+  kQueue.resize(kQueue.size() + 1);
+  req_data& kReq = kQueue.back();
+  kReq.pdu_ = pdu;
+  kReq.reqid_ = pdu->reqid;
+  kReq.type_ = aType;
+  kReq.callback_ = aCallback;
+  kReq.walk_ = aWalk;
+  kReq.walkRoot_ = aWalkRoot;
+  kReq.options_ = aOptions;
+  manager_->countRequests(1);
+
+  // every request keeps the JS object (and so this) alive until its callback
+  // is done, see Complete
+  if (!handle_.IsEmpty()) {
+    Ref();
+  }
+  if (aOptions.deadline_ > 0) {
+    armDeadline(aOptions.deadline_);
+  }
+  manager_->schedule(this);
+  return &kReq;
+}
+// }}}
+
+// void SnmpSession::flushPending() {{{
+void SnmpSession::flushPending() {
+  queue_type kFailed;
+
+  // at prepare, outside of any snmp_sess_read
+  closeDeferred();
+
+  for (int i = 0; i < kPriorityLevels && sessionHandle_; ++i) {
+    queue_type& kQueue = pending_[i];
+    // window_ and global in-flight limit keep the rest queued
+    while (!kQueue.empty() && acquireSlot()) {
+      req_data kReq = kQueue.front();
+      kQueue.pop_front();
+      // net-snmp takes over the pdu pointer!
+      SNMP_TRACE(EVENT_SEND, request__send, traceId_, kReq.reqid_);
+      if (!snmp_sess_send(sessionHandle_, kReq.pdu_)) {
+        snmp_free_pdu(kReq.pdu_);
+        kReq.pdu_ = NULL;
+        --outstanding_;
+        manager_->releaseSend(1);
+        manager_->countRequests(-1);
+        kFailed.push_back(kReq);
+        continue;
+      }
+      kReq.sent_ = nowMs();
+      queue_.push_back(kReq);
+      if (queue_.size() == 1 && orphans_.empty()) {
+        Activate();
+      }
+      if (hedgeHandle_) {
+        armHedge(kReq.sent_ + hedgeDelay());
+      }
+    }
+  }
+  // rest waits for a response to open the window (releaseSlots schedules)
+
+  for (queue_iterator it = kFailed.begin(); it != kFailed.end(); ++it) {
+    Complete(NETSNMP_CALLBACK_OP_SEND_FAILED, NULL, *it, "cannot send query");
+  }
+}
+// }}}
+
+// void SnmpSession::snmp_success_cb(...) {{{
+void SnmpSession::snmp_success_cb(
+    struct snmp_pdu* pdu,
+    const req_data& magic
+    )
+{
+  HandleScope kScope;
+
+  if (magic.options_.rate_) {
+    std::vector<double> kRates;
+    computeRates(pdu->variables, &kRates);
+    snmp_result_cb(magic, ratesToV8(kRates));
+    return;
+  }
+  if (magic.options_.format_ != FORMAT_NONE) {
+    SnmpWriter kWriter(magic.options_.format_, magic.options_.output_,
+        magic.options_.outputLength_);
+    for (netsnmp_variable_list* var = pdu->variables; var;
+        var = var->next_variable)
+    {
+      kWriter.varbind(var->name, var->name_length, var->type,
+          var->val.string, var->val_len);
+    }
+    snmp_written_cb(magic, kWriter);
+    return;
+  }
+
+  netsnmp_variable_list* var = pdu->variables;
+  Local<Array> kResult = v8::Array::New(0);
+  uint32_t index = 0;
+
+  for(; var; var = var->next_variable, ++index) {
+    kResult->Set(index, SnmpResult::New(var, magic.options_.primitive_));
+  }
+
+  snmp_result_cb(magic, kResult);
+}
+// }}}
+
+// void SnmpSession::snmp_result_cb(...) {{{
+void SnmpSession::snmp_result_cb(
+    const req_data& magic,
+    Handle<Value> aResult
+    )
+{
+  HandleScope kScope;
+
+  Handle<Value> args[2];
+  args[0] = v8::Boolean::New(false);
+  args[1] = aResult;
+
+  {
+    TryCatch try_catch;
+
+    SNMP_TRACE(EVENT_CALLBACK_ENTER, callback__enter, traceId_, magic.reqid_);
+    magic.callback_->Call(v8::Context::GetCurrent()->Global(), 2, args);
+    SNMP_TRACE(EVENT_CALLBACK_EXIT, callback__exit, traceId_, magic.reqid_);
+
+    if (try_catch.HasCaught()) {
+      node::FatalException(try_catch);
+    }
+  }
+}
+// }}}
+
+// void SnmpSession::snmp_written_cb(...) {{{
+void SnmpSession::snmp_written_cb(
+    const req_data& magic,
+    const SnmpWriter& aWriter,
+    const char* reason,
+    Handle<Value> aExtra
+    )
+{
+  HandleScope kScope;
+
+  // callback gets number of bytes written, or needed when the output is short
+  Local<Value> kSize = v8::Number::New(aWriter.size());
+  if (reason) {
+    snmp_fail_cb(NULL, magic, reason, kSize, aExtra);
+  } else if (aWriter.overflow()) {
+    snmp_fail_cb(NULL, magic, "output buffer too small", kSize);
+  } else {
+    snmp_result_cb(magic, kSize);
+  }
+}
+// }}}
+
+// void SnmpSession::snmp_fail_cb(...) {{{
+void SnmpSession::snmp_fail_cb(
+        struct snmp_pdu* pdu,
+        const req_data& magic,
+        const char* reason,
+        Handle<Value> aData,
+        Handle<Value> aExtra
+        )
+{
+  HandleScope kScope;
+
+  Handle<Value> args[3];
+  args[0] = v8::String::NewSymbol(reason, strlen(reason));
+  args[1] = aData.IsEmpty() ? Handle<Value>(v8::Null()) : aData;
+  args[2] = aExtra;
+
+  {
+    // TryCatch try_catch;
+
+    SNMP_TRACE(EVENT_CALLBACK_ENTER, callback__enter, traceId_, magic.reqid_);
+    magic.callback_->Call(v8::Context::GetCurrent()->Global(),
+        aExtra.IsEmpty() ? 2 : 3, args);
+    SNMP_TRACE(EVENT_CALLBACK_EXIT, callback__exit, traceId_, magic.reqid_);
+
+    // if (try_catch.HasCaught()) {
+    //   node::FatalException(try_catch);
+    // }
+  }
+}
+// }}}
+
+namespace {
+// const char* callback_op_message(int operation) {{{
+const char* callback_op_message(int operation) {
+  switch (operation) {
+    case NETSNMP_CALLBACK_OP_TIMED_OUT:
+      return "timeout";
+    case NETSNMP_CALLBACK_OP_SEND_FAILED:
+      return "send failed";
+    case NETSNMP_CALLBACK_OP_CONNECT:
+      return "connect failed";
+    case NETSNMP_CALLBACK_OP_DISCONNECT:
+      return "peer has disconnected";
+    default:
+      return "unknown snmp error";
+  }
+}
+// }}}
+}
+
+// void SnmpSession::snmp_walk_cb(...) {{{
+void SnmpSession::snmp_walk_cb(
+    int operation,
+    struct snmp_pdu* pdu,
+    req_data& magic
+    )
+{
+  // request pdu is still owned by net-snmp here
+  netsnmp_pdu* kRequest = magic.pdu_;
+  bool kBulk = kRequest && kRequest->command == SNMP_MSG_GETBULK;
+
+  if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+    if (kBulk) {
+      bulkTuner_.onFailure();
+    }
+    if (!magic.walk_->retry(magic.walkRoot_)) {
+      magic.walk_->fail(magic.walkRoot_, callback_op_message(operation));
+    }
+  } else if (kBulk && pdu->errstat == SNMP_ERR_TOOBIG &&
+      kRequest->max_repetitions > 1)
+  {
+    // ask again for less
+    bulkTuner_.onFailure();
+    magic.walk_->resend(magic.walkRoot_);
+  } else {
+    if (kBulk && pdu->errstat == SNMP_ERR_NOERROR) {
+      unsigned kPerRepetition = 0;
+      for (netsnmp_variable_list* var = kRequest->variables; var;
+          var = var->next_variable)
+      {
+        ++kPerRepetition;
+      }
+      bulkTuner_.onResponse(pdu, kRequest->max_repetitions, kPerRepetition,
+          nowMs() - magic.sent_);
+    }
+    magic.walk_->step(magic.walkRoot_, pdu);
+  }
+  ContinueWalk(magic);
+}
+// }}}
+
+// bool SnmpSession::StartWalk(...) {{{
+bool SnmpSession::StartWalk(SnmpWalk* aWalk, const callback_type& aCallback) {
+  size_t kRoot;
+  netsnmp_pdu* kNext;
+
+  aWalk->setAccount(manager_);
+  aWalk->setRepetitions(bulk_ ? bulkTuner_.repetitions() : 0);
+  while (aWalk->nextRequest(&kRoot, &kNext)) {
+    if (!kNext || !SendRequest(REQ_NEXT, kNext, aCallback, aWalk, kRoot,
+          aWalk->options()))
+    {
+      if (kNext) {
+        snmp_free_pdu(kNext);
+      }
+      aWalk->fail(kRoot, "cannot send query");
+    }
+  }
+  if (aWalk->failed()) {
+    if (!aWalk->idle()) {
+      // some requests made it out, report through callback like any other
+      // walk failure
+      req_data kReq;
+      kReq.callback_ = aCallback;
+      kReq.walk_ = aWalk;
+      ContinueWalk(kReq);
+      return true;
+    }
+    return false;
+  }
+  if (aWalk->finished()) {
+    // nothing to do (checkpoint with every root finished), report empty result
+    req_data kReq;
+    kReq.callback_ = aCallback;
+    kReq.walk_ = aWalk;
+    ContinueWalk(kReq);
+  }
+  return true;
+}
+// }}}
+
+// void SnmpSession::ContinueWalk(req_data& magic) {{{
+void SnmpSession::ContinueWalk(req_data& magic) {
+  SnmpWalk* kWalk = magic.walk_;
+  size_t kRoot;
+  netsnmp_pdu* kNext;
+
+  kWalk->setRepetitions(bulk_ ? bulkTuner_.repetitions() : 0);
+  while (kWalk->nextRequest(&kRoot, &kNext)) {
+    if (!kNext || !SendRequest(REQ_NEXT, kNext, magic.callback_, kWalk, kRoot,
+          kWalk->options()))
+    {
+      if (kNext) {
+        snmp_free_pdu(kNext);
+      }
+      kWalk->fail(kRoot, "cannot send query");
+    }
+  }
+
+  if (kWalk->reported()) {
+    // callback is gone already, just wait for the last outstanding response
+    if (kWalk->idle()) {
+      delete kWalk;
+    }
+    return;
+  }
+
+  if (kWalk->failed()) {
+    // report now, don't make the caller wait for responses to other roots.
+    // Plain walks pass what they have so far, with checkpoint to resume from.
+    HandleScope kScope;
+    const walk_options& kOptions = kWalk->options();
+    if (kOptions.format_ != FORMAT_NONE) {
+      // partial results go to the output, checkpoint as third argument
+      SnmpWriter kWriter(kOptions.format_, kOptions.output_,
+          kOptions.outputLength_);
+      kWalk->write(&kWriter);
+      Local<Array> kCheckpoint = kWalk->checkpointToV8();
+      kWalk->setReported();
+      const char* msg = kWalk->error();
+      if (kWalk->idle()) {
+        delete kWalk;
+      }
+      snmp_written_cb(magic, kWriter, msg, kCheckpoint);
+      magic.callback_.Dispose();
+      return;
+    }
+    Local<Array> kPartial;
+    if (kWalk->snapshotKey().empty()) {
+      kPartial = kWalk->resultToV8();
+      kPartial->Set(String::NewSymbol("resume"), kWalk->checkpointToV8());
+    }
+    kWalk->setReported();
+    const char* msg = kWalk->error();
+    if (kWalk->idle()) {
+      delete kWalk;
+    }
+    snmp_fail_cb(NULL, magic, msg, kPartial);
+    magic.callback_.Dispose();
+    return;
+  }
+
+  if (kWalk->finished()) {
+    HandleScope kScope;
+    const walk_options& kOptions = kWalk->options();
+    if (kOptions.format_ != FORMAT_NONE) {
+      SnmpWriter kWriter(kOptions.format_, kOptions.output_,
+          kOptions.outputLength_);
+      kWalk->write(&kWriter);
+      delete kWalk;
+      snmp_written_cb(magic, kWriter);
+      magic.callback_.Dispose();
+      return;
+    }
+    Local<Object> kResult;
+    if (kWalk->snapshotKey().empty()) {
+      kResult = kWalk->resultToV8();
+    } else {
+      kResult = kWalk->diffToV8(&snapshots_[kWalk->snapshotKey()]);
+    }
+    delete kWalk;
+    snmp_result_cb(magic, kResult);
+    magic.callback_.Dispose();
+  }
+}
+// }}}
+
+// int SnmpSession::snmp_cb_proxy(...) {{{
+int SnmpSession::snmp_cb_proxy(
+    int operation,
+    netsnmp_session* session,
+    int reqid,
+    struct snmp_pdu* pdu)
+{
+  // copy of hedged request came from the alternate address
+  bool kAlternate = hedgeHandle_ && session == snmp_sess_session(hedgeHandle_);
+
+  queue_iterator it_end = queue_.end();
+  for (queue_iterator it = queue_.begin(); it != it_end; ++it) {
+    if (it->reqid_ == reqid) {
+      if (it->hedgePdu_ && operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+        // the other copy can still be answered. net-snmp frees the failed
+        // one after return, pdu_ has to point to the live one.
+        if (!kAlternate) {
+          it->pdu_ = it->hedgePdu_;
+          it->alternateOnly_ = true;
+        }
+        it->hedgePdu_ = NULL;
+        releaseSlots(1);
+        return 1;
+      }
+      if (hedgeHandle_ && !kAlternate &&
+          operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE)
+      {
+        rtt_.add(nowMs() - it->sent_);
+      }
+
+      // in  some more  extreme  situations, *this  can  be deallocated  inside
+      // callback (by forcing GC cycle). Everything we want to do with instance
+      // must be done before trying callback.
+      req_data kReq = *it;
+
+      queue_.erase(it);
+      manager_->countRequests(-1);
+      if (kReq.hedgePdu_) {
+        // loser keeps its slot until net-snmp is done with it
+        orphans_.insert(std::make_pair(reqid, !kAlternate));
+      }
+      if (queue_.empty() && orphans_.empty()) {
+        Deactivate();
+      }
+      // window has room again
+      releaseSlots(1);
+      bool kIdle = queue_.empty();
+      for (int i = 0; i < kPriorityLevels && kIdle; ++i) {
+        kIdle = pending_[i].empty();
+      }
+      if (kIdle && deadline_.active_) {
+        // nothing left to expire, don't keep the loop alive
+        manager_->stopTimer(&deadline_.watcher_);
+        deadline_.active_ = false;
+      }
+
+      Complete(operation, pdu, kReq);
+      return 1;
+    }
+  }
+  // not ours (anymore) - response or timeout of a taken request, or net-snmp
+  // notifying about closed session
+  if (orphans_.erase(std::make_pair(static_cast<long>(reqid), kAlternate))) {
+    if (queue_.empty() && orphans_.empty()) {
+      Deactivate();
+    }
+    releaseSlots(1);
+  }
+  return 1;
+}
+// }}}
+
+// void SnmpSession::Complete(...) {{{
+void SnmpSession::Complete(int operation, netsnmp_pdu* pdu, req_data& aReq,
+    const char* aReason)
+{
+  // callbacks may drop the last reference to JS object, keep it until done
+  bool kReferenced = !handle_.IsEmpty();
+
+  if (operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE && !aReason) {
+    SNMP_TRACE(EVENT_RECEIVE, response__receive, traceId_, aReq.reqid_);
+  } else if (operation == NETSNMP_CALLBACK_OP_TIMED_OUT) {
+    SNMP_TRACE(EVENT_TIMEOUT, request__timeout, traceId_, aReq.reqid_);
+  } else {
+    SNMP_TRACE(EVENT_FAIL, request__fail, traceId_, aReq.reqid_);
+  }
+
+  if (aReq.sink_) {
+    const char* kError = aReason;
+    if (!kError && operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+      kError = callback_op_message(operation);
+    } else if (!kError && pdu->errstat != SNMP_ERR_NOERROR) {
+      kError = snmp_errstring(pdu->errstat);
+    }
+    aReq.sink_->deliver(kError ? NULL : pdu, kError);
+  } else if (aReq.walk_) {
+    if (operation == NETSNMP_CALLBACK_OP_SEND_FAILED &&
+        aReq.walk_->retry(aReq.walkRoot_))
+    {
+      // unsent step goes out again, like one that timed out
+      ContinueWalk(aReq);
+    } else if (aReason) {
+      // reports the walk (once) and deletes it after its last step
+      aReq.walk_->fail(aReq.walkRoot_, aReason);
+      ContinueWalk(aReq);
+    } else {
+      snmp_walk_cb(operation, pdu, aReq);
+    }
+  } else {
+    std::vector<waiter> kWaiters;
+    if (!aReq.cacheKey_.empty()) {
+      waiters_type::iterator kAttached = inFlight_.find(aReq.cacheKey_);
+      if (kAttached != inFlight_.end()) {
+        kWaiters.swap(kAttached->second);
+        inFlight_.erase(kAttached);
+      }
+      if (!aReason && operation == NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE &&
+          pdu->errstat == SNMP_ERR_NOERROR)
+      {
+        storeResult(aReq.cacheKey_, aReq.cacheTtl_, pdu);
+      }
+    }
+
+    for (size_t i = 0; i <= kWaiters.size(); ++i) {
+      if (i > 0) {
+        aReq.callback_ = kWaiters[i - 1].callback_;
+        aReq.options_ = kWaiters[i - 1].options_;
+      }
+      if (aReason) {
+        snmp_fail_cb(NULL, aReq, aReason);
+        aReq.callback_.Dispose();
+      } else {
+        snmp_reply_cb(operation, pdu, aReq);
+      }
+    }
+  }
+
+  if (kReferenced) {
+    Unref();
+  }
+}
+// }}}
+
+// void SnmpSession::snmp_reply_cb(...) {{{
+void SnmpSession::snmp_reply_cb(
+    int operation,
+    struct snmp_pdu* pdu,
+    req_data& magic
+    )
+{
+  // called for each caller of coalesced request, Complete keeps the instance
+  // referenced until the last of them returns
+  if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
+    const char* msg = callback_op_message(operation);
+    snmp_fail_cb(pdu, magic, msg);
+    magic.callback_.Dispose();
+    return;
+  }
+  if (pdu->errstat != SNMP_ERR_NOERROR) {
+    const char* msg = snmp_errstring(pdu->errstat);
+    snmp_fail_cb(pdu, magic, msg);
+    magic.callback_.Dispose();
+    return;
+  }
+
+  switch (magic.type_) {
+    case REQ_GET:
+      snmp_success_cb(pdu, magic);
+      break;
+    case REQ_NEXT:
+    case REQ_BULK:
+      snmp_success_cb(pdu, magic);
+      break;
+    default:
+      assert(false && "internal error: inconsistent req_data record");
+      snmp_fail_cb(pdu, magic,
+          "internal error: inconsistent req_data record");
+      break;
+  }
+  magic.callback_.Dispose();
+}
+// }}}
+
+// void SnmpSession::snmp_cb(...) {{{
+int SnmpSession::snmp_cb(
+    int operation,
+    netsnmp_session* session,
+    int reqid,
+    struct snmp_pdu* pdu,
+    void* magic)
+{
+  SnmpSession::self_data* instData =
+    reinterpret_cast<SnmpSession::self_data*>(magic);
+  return instData->selfPtr_->snmp_cb_proxy(operation, session, reqid, pdu);
+}
+// }}}
+
+
+// SnmpSession* SnmpSession::New(hostname, community) {{{
+SnmpSession* SnmpSession::New(const std::string& hostName,
+    const std::string& credentials, long aVersion, bool aAsync)
+{
+  SnmpSession* kResult = new SnmpSession();
+  kResult->hostName_ = hostName;
+  kResult->credentials_ = credentials;
+  kResult->version_ = aVersion;
+  kResult->manager_ = SnmpSessionManager::default_inst();
+
+  std::string kPeer = hostName;
+  std::string kHost;
+  std::string kPort;
+  if (SnmpResolver::split(hostName, &kHost, &kPort)) {
+    std::string kAddress;
+    if (aAsync) {
+      if (!kResult->manager_->resolve(kHost, kResult, &kAddress)) {
+        kResult->opening_ = true;
+        return kResult;
+      }
+      kPeer = SnmpResolver::numericPeer(kAddress, kPort);
+    } else if (SnmpResolver::lookup(kHost, &kAddress)) {
+      kPeer = SnmpResolver::numericPeer(kAddress, kPort);
+    }
+    // failed lookup - let net-snmp try and report
+  }
+
+  if (!kResult->open(kPeer)) {
+    delete kResult;
+    return NULL;
+  }
+  return kResult;
+}
+// }}}
+
+// bool SnmpSession::open(const std::string& aPeer) {{{
+bool SnmpSession::open(const std::string& aPeer) {
+  sessionHandle_ = openHandle(aPeer);
+  if (sessionHandle_) {
+    SNMP_TRACE(EVENT_OPEN, session__open, traceId_, 0);
+  }
+  return sessionHandle_ != NULL;
+}
+// }}}
+
+// void* SnmpSession::openHandle(const std::string& aPeer) {{{
+void* SnmpSession::openHandle(const std::string& aPeer) {
+  netsnmp_session kSession;
+  snmp_sess_init(&kSession);
+  kSession.peername = strdup(aPeer.c_str());
+  kSession.version = version_;
+
+  kSession.community = (u_char*)malloc(credentials_.size() + 1);
+  // TODO: some better way to report out of memory instead of SIGSEGV?
+  memcpy(kSession.community, credentials_.c_str(), credentials_.size() + 1);
+  kSession.community_len = credentials_.size();
+
+  kSession.callback = SnmpSession::snmp_cb;
+  kSession.callback_magic = &selfData_;
+
+  void* kHandle = snmp_sess_open(&kSession);
+  if (kHandle) {
+    SnmpBatchIo::attach(snmp_sess_transport(kHandle));
+  }
+#ifdef ENABLE_DEBUG_PRINTS
+  fprintf(stderr, "new session handle %p\n", kHandle);
+#endif
+  free(kSession.community);
+  free(kSession.peername);
+  return kHandle;
+}
+// }}}
+
+// void SnmpSession::onResolved(...) {{{
+void SnmpSession::onResolved(const std::string& aAddress, const char* aError)
+{
+  HandleScope kScope;
+  assert(opening_);
+  opening_ = false;
+
+  std::string kHost;
+  std::string kPort;
+  SnmpResolver::split(hostName_, &kHost, &kPort);
+  const char* kError = aError;
+  if (!kError && !open(SnmpResolver::numericPeer(aAddress, kPort))) {
+    kError = "cannot open snmp session";
+  }
+
+  if (!kError) {
+    // queued requests go out at next prepare
+    manager_->schedule(this);
+  } else {
+    // nothing was sent, fail the queued requests
+    queue_type kPending;
+    for (int i = 0; i < kPriorityLevels; ++i) {
+      for (queue_iterator it = pending_[i].begin(); it != pending_[i].end();
+          ++it)
+      {
+        snmp_free_pdu(it->pdu_);
+        it->pdu_ = NULL;
+        kPending.push_back(*it);
+      }
+      pending_[i].clear();
+    }
+    manager_->countRequests(-static_cast<long>(kPending.size()));
+    manager_->unschedule(this);
+    for (queue_iterator it = kPending.begin(); it != kPending.end(); ++it) {
+      Complete(NETSNMP_CALLBACK_OP_CONNECT, NULL, *it,
+          "cannot resolve host name");
+    }
+  }
+
+  if (!openCallback_.IsEmpty()) {
+    callback_type kCallback = openCallback_;
+    openCallback_.Clear();
+    Handle<Value> args[1];
+    args[0] = kError ?
+      Handle<Value>(v8::String::New(kError)) : Handle<Value>(v8::Null());
+    kCallback->Call(v8::Context::GetCurrent()->Global(), 1, args);
+    kCallback.Dispose();
+  }
+  // reference taken for the lookup
+  if (!handle_.IsEmpty()) {
+    Unref();
+  }
+}
+// }}}
+
+// Handle<Value> SnmpSession::New(const Arguments& args) {{{
+Handle<Value> SnmpSession::New(const Arguments& args) {
+  HandleScope kScope;
+  std::auto_ptr<SnmpSession> kInst;
+
+  if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsString()) {
+    return kScope.Close(v8::ThrowException(
+        NODE_PSYMBOL("not enough arguments or wrong type"
+        " (expecting two strings)")));
+  }
+  // optional third argument - SNMP_VERSION_1 (default) or SNMP_VERSION_2c
+  long kVersion = SNMP_VERSION_1;
+  if (args.Length() > 2 && !args[2]->IsUndefined()) {
+    if (!args[2]->IsUint32() ||
+        (args[2]->Uint32Value() != SNMP_VERSION_1 &&
+         args[2]->Uint32Value() != SNMP_VERSION_2c))
+    {
+      return kScope.Close(v8::ThrowException(
+            NODE_PSYMBOL("invalid argument - unsupported snmp version")));
+    }
+    kVersion = args[2]->Uint32Value();
+  }
+
+  // optional fourth argument - callback (error or null) called once host
+  // name lookup is done, only when IsOpening() is true after construction
+  if (args.Length() > 3 && !args[3]->IsUndefined() && !args[3]->IsFunction()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - callback is not a function")));
+  }
+
+  {
+    v8::String::Utf8Value hostname(args[0]->ToString());
+    v8::String::Utf8Value credentials(args[1]->ToString());
+    kInst.reset(SnmpSession::New(
+        std::string(*hostname, hostname.length()),
+        std::string(*credentials, credentials.length()),
+        kVersion, true
+        ));
+  }
+
+  if (!kInst.get()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("cannot open snmp session")));
+  }
+
+  // Wrap makes the handle weak, ObjectWrap deletes the instance when GC
+  // collects it (never while requests are pending, see SendRequest, or
+  // during the lookup)
+  kInst->Wrap(args.This());
+  if (kInst->opening_) {
+    kInst->Ref();
+    if (args.Length() > 3 && args[3]->IsFunction()) {
+      kInst->openCallback_ = v8::Persistent<Function>::New(
+          Local<Function>::Cast(args[3]));
+    }
+  }
+  kInst.release();
+  return kScope.Close(args.This());
+}
+// }}}
+
+// Handle<Value> SnmpSession::IsOpening(const Arguments& args) {{{
+Handle<Value> SnmpSession::IsOpening(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+  return kScope.Close(v8::Boolean::New(inst->opening_));
+}
+// }}}
+
+// Handle<Value> SnmpSession::TraceId(const Arguments& args) {{{
+Handle<Value> SnmpSession::TraceId(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+  return kScope.Close(v8::Integer::NewFromUnsigned(inst->traceId_));
+}
+// }}}
+
+// Handle<Value> SnmpSession::Close(const Arguments& args) {{{
+Handle<Value> SnmpSession::Close(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+
+  queue_type kPending;
+  inst->CloseHandle(&kPending);
+
+  // fail everything that was in flight, in order of sending, then the unsent
+  for (queue_iterator it = kPending.begin(); it != kPending.end(); ++it) {
+    inst->Complete(NETSNMP_CALLBACK_OP_DISCONNECT, NULL, *it,
+        "session closed");
+  }
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+namespace {
+// bool oidFromV8Array(...) {{{
+bool oidFromV8Array(Local<Value> var, std::vector<oid>* tmp)
+{
+  // handleScope - intentionally omited, use scope from caller
+  if (!var->IsArray()) {
+    v8::ThrowException(
+        NODE_PSYMBOL("invalid argument - not an array"));
+    return false;
+  }
+  Local<Array> a = Local<Array>::Cast(var);
+  size_t end = a->Length();
+  if (end == 0) {
+    v8::ThrowException(
+        NODE_PSYMBOL("invalid argument - empty oid"));
+    return false;
+  }
+  tmp->resize(end);
+  for (size_t i = 0; i < end; ++i) {
+    Local<Value> v = a->Get(i);
+    if (!v->IsUint32()) {
+      v8::ThrowException(
+          NODE_PSYMBOL("invalid oid - non-integer member"));
+      return false;
+    }
+    (*tmp)[i] = v->ToUint32()->Value();
+  }
+  return true;
+}
+// }}}
+
+// bool requestOptionsFromV8(...) {{{
+bool requestOptionsFromV8(Local<Value> var, request_options* aOptions)
+{
+  // handleScope - intentionally omited, use scope from caller
+  if (var->IsUndefined() || var->IsNull()) {
+    return true;
+  }
+  if (!var->IsObject()) {
+    v8::ThrowException(
+        NODE_PSYMBOL("invalid argument - options must be an object"));
+    return false;
+  }
+  Local<Object> o = var->ToObject();
+
+  aOptions->primitive_ =
+    o->Get(String::NewSymbol("primitive"))->BooleanValue();
+
+  Local<Value> kCache = o->Get(String::NewSymbol("cache"));
+  if (!kCache->IsUndefined()) {
+    if (!kCache->IsNumber() || kCache->NumberValue() < 0) {
+      v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - cache must be TTL in ms"));
+      return false;
+    }
+    aOptions->cacheTtl_ = kCache->NumberValue();
+  }
+
+  Local<Value> kPriority = o->Get(String::NewSymbol("priority"));
+  if (!kPriority->IsUndefined()) {
+    if (!kPriority->IsNumber() || kPriority->Int32Value() < PRIORITY_HIGH ||
+        kPriority->Int32Value() > PRIORITY_LOW)
+    {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - priority must be one of PRIORITY_*"));
+      return false;
+    }
+    aOptions->priority_ = kPriority->Int32Value();
+  }
+
+  aOptions->rate_ = o->Get(String::NewSymbol("rate"))->BooleanValue();
+
+  Local<Value> kDeadline = o->Get(String::NewSymbol("deadline"));
+  if (!kDeadline->IsUndefined()) {
+    if (!kDeadline->IsNumber() || kDeadline->NumberValue() <= 0) {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - deadline must be positive number of ms"));
+      return false;
+    }
+    aOptions->deadline_ = kDeadline->NumberValue();
+  }
+
+  Local<Value> kNonRepeaters = o->Get(String::NewSymbol("nonRepeaters"));
+  if (!kNonRepeaters->IsUndefined()) {
+    if (!kNonRepeaters->IsNumber() || kNonRepeaters->Int32Value() < 0) {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - nonRepeaters must be non-negative number"));
+      return false;
+    }
+    aOptions->nonRepeaters_ = kNonRepeaters->Int32Value();
+  }
+  Local<Value> kMaxRepetitions = o->Get(String::NewSymbol("maxRepetitions"));
+  if (!kMaxRepetitions->IsUndefined()) {
+    if (!kMaxRepetitions->IsNumber() || kMaxRepetitions->Int32Value() < 0) {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - maxRepetitions must be non-negative number"));
+      return false;
+    }
+    aOptions->maxRepetitions_ = kMaxRepetitions->Int32Value();
+  }
+
+  // { format: FORMAT_*, output: SlowBuffer, outputOffset, outputLength }
+  Local<Value> kFormat = o->Get(String::NewSymbol("format"));
+  if (!kFormat->IsUndefined()) {
+    if (!kFormat->IsNumber() || (kFormat->Int32Value() != FORMAT_NDJSON &&
+          kFormat->Int32Value() != FORMAT_BINARY))
+    {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - format must be one of FORMAT_*"));
+      return false;
+    }
+    Local<Value> kOutput = o->Get(String::NewSymbol("output"));
+    if (!node::Buffer::HasInstance(kOutput)) {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - output must be a Buffer"));
+      return false;
+    }
+    size_t kLength = node::Buffer::Length(kOutput->ToObject());
+    size_t kOffset = o->Get(String::NewSymbol("outputOffset"))->Uint32Value();
+    Local<Value> kOutputLength = o->Get(String::NewSymbol("outputLength"));
+    if (kOffset > kLength || (!kOutputLength->IsUndefined() &&
+          kOutputLength->Uint32Value() > kLength - kOffset))
+    {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - output range out of Buffer bounds"));
+      return false;
+    }
+    if (aOptions->rate_) {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - rates cannot be written to output"));
+      return false;
+    }
+    aOptions->format_ = kFormat->Int32Value();
+    aOptions->output_ = node::Buffer::Data(kOutput->ToObject()) + kOffset;
+    aOptions->outputLength_ = kOutputLength->IsUndefined() ?
+      kLength - kOffset : kOutputLength->Uint32Value();
+  }
+  return true;
+}
+// }}}
+
+// void keepOutput(Local<Value> var, Handle<Function> aCallback) {{{
+void keepOutput(Local<Value> var, Handle<Function> aCallback) {
+  // results are written to output Buffer of the options just before the
+  // callback is called, it must live as long as the callback. Callback must
+  // not be shared with other requests writing elsewhere.
+  if (var->IsObject()) {
+    Local<Value> kOutput = var->ToObject()->Get(String::NewSymbol("output"));
+    if (!kOutput->IsUndefined()) {
+      aCallback->SetHiddenValue(String::NewSymbol("output"), kOutput);
+    }
+  }
+}
+// }}}
+
+// bool walkOptionsFromV8(...) {{{
+bool walkOptionsFromV8(Local<Value> var, walk_options* aOptions)
+{
+  // handleScope - intentionally omited, use scope from caller
+  if (!requestOptionsFromV8(var, aOptions)) {
+    return false;
+  }
+  if (var->IsUndefined() || var->IsNull()) {
+    return true;
+  }
+  Local<Object> o = var->ToObject();
+
+  Local<Value> kParallel = o->Get(String::NewSymbol("parallel"));
+  if (!kParallel->IsUndefined()) {
+    if (!kParallel->IsUint32()) {
+      v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - parallel must be integer"));
+      return false;
+    }
+    aOptions->parallelism_ = kParallel->Uint32Value();
+  }
+  aOptions->lockstep_ =
+    o->Get(String::NewSymbol("lockstep"))->BooleanValue();
+
+  Local<Value> kRetries = o->Get(String::NewSymbol("retries"));
+  if (!kRetries->IsUndefined()) {
+    if (!kRetries->IsUint32()) {
+      v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - retries must be integer"));
+      return false;
+    }
+    aOptions->retries_ = kRetries->Uint32Value();
+  }
+
+  // checkpoint from 'resume' of failed walk's partial result
+  Local<Value> kResume = o->Get(String::NewSymbol("resume"));
+  if (!kResume->IsUndefined() && !kResume->IsNull()) {
+    // empty one is of a walk that failed after its last root finished
+    if (!kResume->IsArray()) {
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - resume must be checkpoint array"));
+      return false;
+    }
+    aOptions->resuming_ = true;
+    Local<Array> kPoints = Local<Array>::Cast(kResume);
+    aOptions->resume_.resize(kPoints->Length());
+    for (uint32_t i = 0; i < kPoints->Length(); ++i) {
+      Local<Value> kPoint = kPoints->Get(i);
+      if (!kPoint->IsArray() || Local<Array>::Cast(kPoint)->Length() != 2) {
+        v8::ThrowException(NODE_PSYMBOL(
+              "invalid argument - checkpoint must be [ base, last ] pair"));
+        return false;
+      }
+      walk_options::checkpoint& kCheckpoint = aOptions->resume_[i];
+      if (!oidFromV8Array(Local<Array>::Cast(kPoint)->Get(0),
+            &kCheckpoint.first) ||
+          !oidFromV8Array(Local<Array>::Cast(kPoint)->Get(1),
+            &kCheckpoint.second))
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+// }}}
+
+// Local<Value> addNullVarFromV8Array(...) {{{
+void addNullVarFromV8Array(netsnmp_pdu* pdu, Local<Value> var,
+    std::vector<oid>* tmp)
+{
+  // handleScope - intentionally omited, use scope from PerformRequest
+  if (!oidFromV8Array(var, tmp)) {
+    return;
+  }
+  if (!snmp_add_null_var(pdu, &((*tmp)[0]), tmp->size())) {
+    v8::ThrowException(NODE_PSYMBOL("cannot add query to pdu"));
+    return;
+  }
+}
+// }}}
+
+// bool addNullVarsFromPacked(...) {{{
+bool addNullVarsFromPacked(netsnmp_pdu* pdu, Local<Object> aPacked)
+{
+  // Uint32Array (host byte order) or Buffer (little endian uint32s) with
+  // OIDs one after another, each prefixed by its number of arcs - copied to
+  // the pdu in one pass, no V8 call per arc
+  const char* kData = static_cast<const char*>(
+      aPacked->GetIndexedPropertiesExternalArrayData());
+  int kLength = aPacked->GetIndexedPropertiesExternalArrayDataLength();
+  bool kWords;
+  switch (aPacked->GetIndexedPropertiesExternalArrayDataType()) {
+    case v8::kExternalUnsignedIntArray:
+      kWords = true;
+      break;
+    case v8::kExternalUnsignedByteArray:
+      kWords = false;
+      if (kLength % 4 != 0) {
+        v8::ThrowException(NODE_PSYMBOL(
+              "invalid oid - packed Buffer length must be multiple of 4"));
+        return false;
+      }
+      kLength /= 4;
+      break;
+    default:
+      v8::ThrowException(NODE_PSYMBOL(
+            "invalid oid - Uint32Array or Buffer expected"));
+      return false;
+  }
+  if (kLength == 0) {
+    v8::ThrowException(NODE_PSYMBOL("invalid argument - empty oid"));
+    return false;
+  }
+
+  oid kName[MAX_OID_LEN];
+  size_t kNameLength = 0;
+  size_t kLeft = 0;   // arcs of the current OID still to come
+  for (int i = 0; i < kLength; ++i) {
+    uint32_t kWord;
+    if (kWords) {
+      kWord = reinterpret_cast<const uint32_t*>(kData)[i];
+    } else {
+      const unsigned char* kBytes =
+        reinterpret_cast<const unsigned char*>(kData) + 4 * i;
+      kWord = kBytes[0] | (kBytes[1] << 8) | (kBytes[2] << 16) |
+        (static_cast<uint32_t>(kBytes[3]) << 24);
+    }
+    if (kLeft == 0) {
+      if (kWord == 0 || kWord > MAX_OID_LEN) {
+        v8::ThrowException(NODE_PSYMBOL(
+              "invalid oid - bad arc count in packed oids"));
+        return false;
+      }
+      kLeft = kWord;
+      kNameLength = 0;
+      continue;
+    }
+    kName[kNameLength++] = kWord;
+    if (--kLeft == 0 && !snmp_add_null_var(pdu, kName, kNameLength)) {
+      v8::ThrowException(NODE_PSYMBOL("cannot add query to pdu"));
+      return false;
+    }
+  }
+  if (kLeft != 0) {
+    v8::ThrowException(NODE_PSYMBOL("invalid oid - truncated packed oids"));
+    return false;
+  }
+  return true;
+}
+// }}}
+
+// bool isPackedOid(Local<Value> var) {{{
+bool isPackedOid(Local<Value> var) {
+  return var->IsObject() && !var->IsArray() &&
+    var->ToObject()->HasIndexedPropertiesInExternalArrayData();
+}
+// }}}
+
+// netsnmp_pdu* pduFromV8(int aCommand, Local<Value> var) {{{
+netsnmp_pdu* pduFromV8(int aCommand, Local<Value> var)
+{
+  // handleScope - intentionally omited, use scope from caller. OID (array
+  // of integers), array of OIDs or packed OIDs; NULL with exception thrown
+  // when invalid.
+  if (!var->IsArray() && !isPackedOid(var)) {
+    v8::ThrowException(NODE_PSYMBOL("invalid argument - not an array"));
+    return NULL;
+  }
+  netsnmp_pdu* pdu = snmp_pdu_create(aCommand);
+  if (!pdu) {
+    v8::ThrowException(NODE_PSYMBOL("cannot allocate pdu"));
+    return NULL;
+  }
+
+  if (isPackedOid(var)) {
+    if (!addNullVarsFromPacked(pdu, var->ToObject())) {
+      snmp_free_pdu(pdu);
+      return NULL;
+    }
+    return pdu;
+  }
+
+  Local<Array> kOidArg = Local<Array>::Cast(var);
+  size_t end = kOidArg->Length();
+  if (end == 0) {
+    snmp_free_pdu(pdu);
+    v8::ThrowException(NODE_PSYMBOL("invalid argument - empty oid"));
+    return NULL;
+  }
+
+  std::vector<oid> tmp;
+  v8::TryCatch tryCatch;
+
+  if (kOidArg->Get(0)->IsArray()) {
+    // array of arrays - second level arrays must contain integers
+    for (size_t i = 0; i < end && !tryCatch.HasCaught(); ++i) {
+      addNullVarFromV8Array(pdu, kOidArg->Get(i), &tmp);
+    }
+  } else {
+    // array of integers - single oid query
+    addNullVarFromV8Array(pdu, kOidArg, &tmp);
+  }
+  if (tryCatch.HasCaught()) {
+    snmp_free_pdu(pdu);
+    tryCatch.ReThrow();
+    return NULL;
+  }
+  return pdu;
+}
+// }}}
+}
+
+// Handle<Value> SnmpSession::PerformRequest(...) {{{
+Handle<Value> SnmpSession::PerformRequest(
+    req_type aType, const Arguments& args)
+{
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+  if (!inst->isOpen()) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("session is closed")));
+  }
+
+  // call with (OID, callback, bool (=sync or not sync)[, options[,
+  // continuation]]), continuation is internal to snmp.js (walk steps)
+  if (args.Length() < 3) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  if (!args[0]->IsArray() && !isPackedOid(args[0]) &&
+      !SnmpRequestTemplate::FromV8(args[0]))
+  {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - only string OID is supported")));
+  }
+  if (!args[1]->IsFunction()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - callback is not a function")));
+  }
+  if (!args[2]->IsBoolean()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - sync flag must be boolean")));
+  }
+  request_options kOptions;
+  if (!requestOptionsFromV8(args[3], &kOptions)) {
+    return kScope.Close(v8::Undefined());
+  }
+  kOptions.continuation_ = args[4]->BooleanValue();
+  if (aType == REQ_BULK && kOptions.rate_) {
+    // repeated varbinds have no previous samples of their own
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - rates are not supported by GetBulk")));
+  }
+  keepOutput(args[3], Local<Function>::Cast(args[1]));
+  unsigned kId = inst->Track(&kOptions);
+
+  netsnmp_pdu* pdu = NULL;
+
+  SnmpRequestTemplate* kTemplate = SnmpRequestTemplate::FromV8(args[0]);
+  if (kTemplate) {
+    pdu = kTemplate->instantiate(aType);
+    if (!pdu) {
+      return kScope.Close(
+          v8::ThrowException(NODE_PSYMBOL("cannot allocate pdu")));
+    }
+  } else {
+    pdu = pduFromV8(aType, args[0]);
+    if (!pdu) {
+      return kScope.Close(v8::Undefined());
+    }
+  }
+  if (aType == REQ_BULK) {
+    pdu->non_repeaters = kOptions.nonRepeaters_;
+    pdu->max_repetitions = kOptions.maxRepetitions_;
+  }
+
+  if (kOptions.rate_ && !addUptimeVar(pdu)) {
+    snmp_free_pdu(pdu);
+    return kScope.Close(
+        v8::ThrowException(NODE_PSYMBOL("cannot allocate pdu")));
+  }
+
+  // Cached response is returned right away, callback is not called (the JS
+  // side defers it). Identical async request already in flight gets the
+  // callback attached instead of sending another PDU. Otherwise async request
+  // returns its id for Cancel.
+  double kTtl = inst->cacheTtl(pdu, kOptions);
+  std::string kKey;
+  if (kTtl > 0) {
+    kKey = cacheKey(aType, pdu);
+    Local<Array> kCached = inst->cachedResult(kKey, kOptions);
+    if (!kCached.IsEmpty()) {
+      snmp_free_pdu(pdu);
+      return kScope.Close(kCached);
+    }
+    waiters_type::iterator it = inst->inFlight_.find(kKey);
+    if (!args[2]->BooleanValue() && it != inst->inFlight_.end()) {
+      snmp_free_pdu(pdu);
+      waiter kWaiter;
+      kWaiter.callback_ = v8::Persistent<Function>::New(
+          Local<Function>::Cast(args[1]));
+      kWaiter.options_ = kOptions;
+      it->second.push_back(kWaiter);
+      if (kOptions.deadline_ > 0) {
+        inst->armDeadline(kOptions.deadline_);
+      }
+      return kScope.Close(v8::Integer::NewFromUnsigned(kId));
+    }
+  }
+
+  if (args[2]->BooleanValue()) {
+#if EV_MULTIPLICITY
+    struct ev_loop* our_loop = ev_loop_new(0);
+    SnmpSessionManager* manager = SnmpSessionManager::create(our_loop);
+    SnmpSession* cloned_sess = inst->Clone(manager);
+    if (!cloned_sess) {
+      snmp_free_pdu(pdu);
+      delete manager;
+      ev_loop_destroy(our_loop);
+      return kScope.Close(v8::ThrowException(
+            NODE_PSYMBOL("cannot open snmp session")));
+    }
+
+    // the clone caches the response under the same key, the connection
+    // takes it over below
+    cloned_sess->PerformRequestImpl(aType, pdu,
+        Persistent<Function>(Function::Cast(*args[1])), kOptions,
+        kKey, kTtl);
+
+#if EV_VERSION_MAJOR == 3
+    ev_loop(our_loop, 0);
+#else
+    ev_run(our_loop);
+#endif
+
+    if (!kKey.empty()) {
+      inst->adoptResult(kKey, cloned_sess);
+    }
+    delete cloned_sess;
+    delete manager;
+    ev_loop_destroy(our_loop);
+#else
+    return kScope.Close(
+        v8::ThrowException(
+          NODE_PSYMBOL("synchronous interface is unavailable due to"
+            " binding module configuration")));
+#endif
+  } else {
+    inst->PerformRequestImpl(aType, pdu,
+        Persistent<Function>(Function::Cast(*args[1])), kOptions,
+        kKey, kTtl);
+    return kScope.Close(v8::Integer::NewFromUnsigned(kId));
+  }
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// Handle<Value> SnmpSession::Get(const Arguments& args) {{{
+Handle<Value> SnmpSession::Get(const Arguments& args) {
+  return PerformRequest(REQ_GET, args);
+}
+// }}}
+
+// Handle<Value> SnmpSession::GetNext(const Arguments& args) {{{
+Handle<Value> SnmpSession::GetNext(const Arguments& args) {
+  return PerformRequest(REQ_NEXT, args);
+}
+// }}}
+
+// Handle<Value> SnmpSession::GetBulk(const Arguments& args) {{{
+Handle<Value> SnmpSession::GetBulk(const Arguments& args) {
+  return PerformRequest(REQ_BULK, args);
+}
+// }}}
+
+
+// Handle<Value> SnmpSession::GetTable(const Arguments& args) {{{
+Handle<Value> SnmpSession::GetTable(const Arguments& args) {
+  return StartTableWalk(args, false);
+}
+// }}}
+
+// Handle<Value> SnmpSession::PollTable(const Arguments& args) {{{
+Handle<Value> SnmpSession::PollTable(const Arguments& args) {
+  return StartTableWalk(args, true);
+}
+// }}}
+
+// Handle<Value> SnmpSession::StartTableWalk(...) {{{
+Handle<Value> SnmpSession::StartTableWalk(const Arguments& args, bool aPoll) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+  if (!inst->isOpen()) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("session is closed")));
+  }
+
+  // call with (table OID, array of column numbers, callback[, options])
+  if (args.Length() < 3) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  if (!args[2]->IsFunction()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - callback is not a function")));
+  }
+  walk_options kOptions;
+  if (!walkOptionsFromV8(args[3], &kOptions)) {
+    return kScope.Close(v8::Undefined());
+  }
+  if (aPoll && kOptions.format_ != FORMAT_NONE) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - changes cannot be written to output")));
+  }
+  keepOutput(args[3], Local<Function>::Cast(args[2]));
+  unsigned kId = inst->Track(&kOptions);
+
+  std::vector<oid> kTable;
+  std::vector<oid> kColumns;
+  if (!oidFromV8Array(args[0], &kTable)) {
+    return kScope.Close(v8::Undefined());
+  }
+  // column list has the same shape as oid - non-empty array of integers
+  if (!oidFromV8Array(args[1], &kColumns)) {
+    return kScope.Close(v8::Undefined());
+  }
+
+  const char* kRejected = inst->manager_->admit();
+  if (kRejected) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(kRejected)));
+  }
+  SnmpWalk* kWalk = new SnmpWalk(kTable, kColumns, kOptions);
+  if (aPoll) {
+    // same table with different set of columns is different snapshot. Key
+    // is (table length, table, columns) as raw oid bytes.
+    std::vector<oid> kKey(1, kTable.size());
+    kKey.insert(kKey.end(), kTable.begin(), kTable.end());
+    kKey.insert(kKey.end(), kColumns.begin(), kColumns.end());
+    kWalk->setSnapshotKey(std::string(
+          reinterpret_cast<const char*>(&kKey[0]), kKey.size() * sizeof(oid)));
+  }
+  callback_type kCallback = v8::Persistent<Function>::New(
+      Local<Function>::Cast(args[2]));
+  if (!inst->StartWalk(kWalk, kCallback)) {
+    delete kWalk;
+    kCallback.Dispose();
+    return kScope.Close(
+        v8::ThrowException(NODE_PSYMBOL("cannot send query")));
+  }
+  return kScope.Close(v8::Integer::NewFromUnsigned(kId));
+}
+// }}}
+
+// Handle<Value> SnmpSession::Walk(const Arguments& args) {{{
+Handle<Value> SnmpSession::Walk(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+  if (!inst->isOpen()) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("session is closed")));
+  }
+
+  // call with (OID or array of OIDs, callback[, options])
+  if (args.Length() < 2) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  if (!args[1]->IsFunction()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - callback is not a function")));
+  }
+  walk_options kOptions;
+  if (!walkOptionsFromV8(args[2], &kOptions)) {
+    return kScope.Close(v8::Undefined());
+  }
+  keepOutput(args[2], Local<Function>::Cast(args[1]));
+  unsigned kId = inst->Track(&kOptions);
+  if (!args[0]->IsArray()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - not an array")));
+  }
+
+  std::vector<std::vector<oid> > kBases;
+  Local<Array> kOidArg = Local<Array>::Cast(args[0]);
+  if (kOidArg->Length() > 0 && kOidArg->Get(0)->IsArray()) {
+    // array of arrays - one root per member
+    kBases.resize(kOidArg->Length());
+    for (uint32_t i = 0; i < kOidArg->Length(); ++i) {
+      if (!oidFromV8Array(kOidArg->Get(i), &kBases[i])) {
+        return kScope.Close(v8::Undefined());
+      }
+    }
+  } else {
+    kBases.resize(1);
+    if (!oidFromV8Array(kOidArg, &kBases[0])) {
+      return kScope.Close(v8::Undefined());
+    }
+  }
+
+  const char* kRejected = inst->manager_->admit();
+  if (kRejected) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(kRejected)));
+  }
+  SnmpWalk* kWalk = new SnmpWalk(kBases, kOptions);
+  callback_type kCallback = v8::Persistent<Function>::New(
+      Local<Function>::Cast(args[1]));
+  if (!inst->StartWalk(kWalk, kCallback)) {
+    delete kWalk;
+    kCallback.Dispose();
+    return kScope.Close(
+        v8::ThrowException(NODE_PSYMBOL("cannot send query")));
+  }
+  return kScope.Close(v8::Integer::NewFromUnsigned(kId));
+}
+// }}}
+
+// Handle<Value> SnmpSession::SetCacheTtl(const Arguments& args) {{{
+Handle<Value> SnmpSession::SetCacheTtl(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+
+  // call with (OID, TTL in ms) - 0 disables caching in the subtree, null
+  // removes the rule
+  if (args.Length() < 2) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  std::vector<oid> kOid;
+  if (!oidFromV8Array(args[0], &kOid)) {
+    return kScope.Close(v8::Undefined());
+  }
+  if (args[1]->IsNull() || args[1]->IsUndefined()) {
+    inst->cacheTtl_.erase(kOid);
+    return kScope.Close(v8::Undefined());
+  }
+  if (!args[1]->IsNumber() || args[1]->NumberValue() < 0) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - TTL must be non-negative number")));
+  }
+  inst->cacheTtl_[kOid] = args[1]->NumberValue();
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// Handle<Value> SnmpSession::SetMaxInFlight(const Arguments& args) {{{
+Handle<Value> SnmpSession::SetMaxInFlight(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+
+  // call with (count) - 0 means unlimited, requests above the limit wait in
+  // priority queues until responses arrive
+  if (args.Length() < 1 || !args[0]->IsNumber() ||
+      args[0]->NumberValue() < 0)
+  {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - count must be non-negative number")));
+  }
+  inst->window_ = args[0]->Uint32Value();
+  // larger window can let queued requests out right away
+  if (inst->sessionHandle_) {
+    inst->manager_->schedule(inst);
+  }
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// Handle<Value> SnmpSession::Cancel(const Arguments& args) {{{
+Handle<Value> SnmpSession::Cancel(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+
+  // call with (id returned by request or walk), callback is not called.
+  // Request already sent can't be withdrawn from net-snmp, its response (or
+  // timeout) is ignored.
+  if (args.Length() < 1 || !args[0]->IsNumber()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - request id must be number")));
+  }
+  unsigned kId = args[0]->Uint32Value();
+  return kScope.Close(v8::Boolean::New(kId != 0 && inst->CancelRequest(kId)));
+}
+// }}}
+
+// Handle<Value> SnmpSession::SetBulk(const Arguments& args) {{{
+Handle<Value> SnmpSession::SetBulk(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+
+  // call with (false) or (true[, initial repetitions, max repetitions]).
+  // Learned value is kept when called again without initial.
+  if (args.Length() < 1) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  if (!args[0]->BooleanValue()) {
+    inst->bulk_ = false;
+    return kScope.Close(v8::Undefined());
+  }
+  if (inst->version_ == SNMP_VERSION_1) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("GETBULK needs SNMPv2c connection")));
+  }
+  for (int i = 1; i < 3 && i < args.Length(); ++i) {
+    if (!args[i]->IsUndefined() &&
+        (!args[i]->IsUint32() || args[i]->Uint32Value() == 0))
+    {
+      return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+              "invalid argument - repetitions must be positive integer")));
+    }
+  }
+  if (!args[1]->IsUndefined() || !args[2]->IsUndefined()) {
+    unsigned kMax = args[2]->IsUndefined() ? 50 : args[2]->Uint32Value();
+    unsigned kInitial = args[1]->IsUndefined() ?
+      inst->bulkTuner_.repetitions() : args[1]->Uint32Value();
+    inst->bulkTuner_.configure(kInitial, kMax);
+  }
+  inst->bulk_ = true;
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// Handle<Value> SnmpSession::SetHedge(const Arguments& args) {{{
+Handle<Value> SnmpSession::SetHedge(const Arguments& args) {
+  HandleScope kScope;
+  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+
+  // call with (false) or (alternate peer, percentile, min ms, initial ms)
+  if (args.Length() < 1) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  if (!inst->isOpen()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("connection is closed")));
+  }
+  // in-flight copies point into the alternate session
+  if (!inst->queue_.empty() || !inst->orphans_.empty()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid state - requests in flight")));
+  }
+  if (!args[0]->IsString()) {
+    if (args[0]->BooleanValue()) {
+      return kScope.Close(v8::ThrowException(
+            NODE_PSYMBOL("invalid argument - alternate peer expected")));
+    }
+    inst->closeHedge();
+    return kScope.Close(v8::Undefined());
+  }
+  if (args.Length() < 4 || !args[1]->IsNumber() || !args[2]->IsNumber() ||
+      !args[3]->IsNumber())
+  {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  double kPercentile = args[1]->NumberValue();
+  if (!(kPercentile > 0 && kPercentile <= 100)) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - percentile must be in (0, 100]")));
+  }
+  if (args[2]->NumberValue() < 0 || args[3]->NumberValue() < 0) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - delay must not be negative")));
+  }
+
+  // no lookup on the loop thread - numeric address, or host name already in
+  // the resolver cache
+  String::Utf8Value kName(args[0]->ToString());
+  std::string kPeer(*kName);
+  std::string kHost;
+  std::string kPort;
+  if (SnmpResolver::split(kPeer, &kHost, &kPort)) {
+    std::string kAddress;
+    if (!SnmpResolver::cached(kHost, &kAddress)) {
+      return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+              "invalid argument - alternate peer must be numeric address")));
+    }
+    kPeer = SnmpResolver::numericPeer(kAddress, kPort);
+  } else if (!SnmpResolver::numeric(kPeer)) {
+    // other transports ("tcp:host") and IPv6 names would be resolved by
+    // net-snmp right here
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - alternate peer must be numeric address")));
+  }
+  void* kHandle = inst->openHandle(kPeer);
+  if (!kHandle) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("cannot open snmp session")));
+  }
+  inst->closeHedge();
+  inst->hedgeHandle_ = kHandle;
+  inst->rtt_.configure(kPercentile);
+  inst->hedgeMin_ = args[2]->NumberValue();
+  inst->hedgeInitial_ = args[3]->NumberValue();
+  return kScope.Close(v8::Undefined());
+}
+// }}}
+
+// void SnmpSession::Initialize(Handle<Object> target) {{{
+void SnmpSession::Initialize(Handle<Object> target) {
+  js::HandleScope kScope;
+
+  Local<FunctionTemplate> t = FunctionTemplate::New(SnmpSession::New);
+  constructorTemplate_ = Persistent<FunctionTemplate>::New(t);
+  constructorTemplate_->InstanceTemplate()->SetInternalFieldCount(1);
+  constructorTemplate_->SetClassName(String::NewSymbol("Connection"));
+
+  // t->Inherit(EventEmitter::constructor_template);
+
+  NODE_SET_PROTOTYPE_METHOD(t, "Get", SnmpSession::Get);
+  NODE_SET_PROTOTYPE_METHOD(t, "GetNext", SnmpSession::GetNext);
+  NODE_SET_PROTOTYPE_METHOD(t, "GetBulk", SnmpSession::GetBulk);
+  NODE_SET_PROTOTYPE_METHOD(t, "GetTable", SnmpSession::GetTable);
+  NODE_SET_PROTOTYPE_METHOD(t, "PollTable", SnmpSession::PollTable);
+  NODE_SET_PROTOTYPE_METHOD(t, "Walk", SnmpSession::Walk);
+  NODE_SET_PROTOTYPE_METHOD(t, "Close", SnmpSession::Close);
+  NODE_SET_PROTOTYPE_METHOD(t, "SetCacheTtl", SnmpSession::SetCacheTtl);
+  NODE_SET_PROTOTYPE_METHOD(t, "SetMaxInFlight", SnmpSession::SetMaxInFlight);
+  NODE_SET_PROTOTYPE_METHOD(t, "Cancel", SnmpSession::Cancel);
+  NODE_SET_PROTOTYPE_METHOD(t, "SetBulk", SnmpSession::SetBulk);
+  NODE_SET_PROTOTYPE_METHOD(t, "IsOpening", SnmpSession::IsOpening);
+  NODE_SET_PROTOTYPE_METHOD(t, "TraceId", SnmpSession::TraceId);
+  NODE_SET_PROTOTYPE_METHOD(t, "SetHedge", SnmpSession::SetHedge);
+
+  NODE_DEFINE_CONSTANT(target, SNMP_VERSION_1);
+  NODE_DEFINE_CONSTANT(target, SNMP_VERSION_2c);
+  NODE_DEFINE_CONSTANT(target, FORMAT_NDJSON);
+  NODE_DEFINE_CONSTANT(target, FORMAT_BINARY);
+  NODE_DEFINE_CONSTANT(target, PRIORITY_HIGH);
+  NODE_DEFINE_CONSTANT(target, PRIORITY_NORMAL);
+  NODE_DEFINE_CONSTANT(target, PRIORITY_LOW);
+
+  target->Set(String::NewSymbol("Connection"),
+      constructorTemplate_->GetFunction());
+}
+// }}}
+
+// }}}
+
+
+
+// ==== SnmpRequestTemplate entry points {{{
+
+// Handle<Value> SnmpRequestTemplate::New(const Arguments& args) {{{
+Handle<Value> SnmpRequestTemplate::New(const Arguments& args) {
+  HandleScope kScope;
+
+  // call with (OID, array of OIDs or packed OIDs)
+  if (args.Length() < 1) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  netsnmp_pdu* pdu = pduFromV8(SNMP_MSG_GET, args[0]);
+  if (!pdu) {
+    return kScope.Close(v8::Undefined());
+  }
+  SnmpRequestTemplate* kInst = new SnmpRequestTemplate();
+  kInst->pdu_ = pdu;
+  kInst->Wrap(args.This());
+  return kScope.Close(args.This());
+}
+// }}}
+
+// Handle<Value> SnmpRequestTemplate::Size(const Arguments& args) {{{
+Handle<Value> SnmpRequestTemplate::Size(const Arguments& args) {
+  HandleScope kScope;
+  SnmpRequestTemplate* inst =
+    ObjectWrap::Unwrap<SnmpRequestTemplate>(args.This());
+
+  uint32_t kCount = 0;
+  for (netsnmp_variable_list* var = inst->pdu_->variables; var;
+      var = var->next_variable)
+  {
+    ++kCount;
+  }
+  return kScope.Close(v8::Integer::NewFromUnsigned(kCount));
+}
+// }}}
+
+// void SnmpRequestTemplate::Initialize(Handle<Object> target) {{{
+void SnmpRequestTemplate::Initialize(Handle<Object> target) {
+  js::HandleScope kScope;
+
+  Local<FunctionTemplate> t = FunctionTemplate::New(SnmpRequestTemplate::New);
+  constructorTemplate_ = Persistent<FunctionTemplate>::New(t);
+  constructorTemplate_->InstanceTemplate()->SetInternalFieldCount(1);
+  constructorTemplate_->SetClassName(String::NewSymbol("Template"));
+
+  NODE_SET_PROTOTYPE_METHOD(t, "Size", SnmpRequestTemplate::Size);
+
+  target->Set(String::NewSymbol("Template"),
+      constructorTemplate_->GetFunction());
+}
+// }}}
+
+// }}}
+
+
+
+// ==== class SnmpPollScheduler : public node::ObjectWrap {{{
+
+/**
+ * Periodic GETs of fixed OID sets (jobs), one per interval. Start times  of
+ * jobs are spread over their interval -  offset of n-th job is frac(n * golden
+ * ratio) of the interval, which  keeps any number of jobs added one by  one
+ * evenly spread - and each cycle is shifted by random jitter, so that 20k
+ * targets don't fire in one burst on the interval boundary. All jobs share the
+ * clock timer of the session manager.
+ *
+ * Results are collected natively and passed to JS in one callback call per
+ * event loop iteration (flushed at prepare, like sends of sessions).
+ */
+class SnmpPollScheduler : public node::ObjectWrap, public SnmpSendQueue {
+  public:
+    struct job : public SnmpTimerClient, public SnmpResultSink {
+      SnmpPollScheduler* owner_;
+      unsigned id_;
+      Persistent<Object> session_;  // keeps the connection alive
+      SnmpSession* sessionPtr_;
+      netsnmp_pdu* prototype_;  // request of every cycle, see instantiate
+      request_options options_;
+      double interval_;   // ms
+      double start_;      // due time of cycle 0, without jitter
+      double cycle_;
+      double due_;        // key in manager timers, job is always armed
+      unsigned request_;  // id of request in flight, 0 - none
+
+      job() : prototype_(NULL) {}
+      ~job() {
+        if (prototype_) {
+          snmp_free_pdu(prototype_);
+        }
+      }
+
+      void onTimer();
+      void deliver(netsnmp_pdu* pdu, const char* aError);
+    };
+
+    struct result {
+      unsigned job_;
+      double time_;
+      const char* error_;             // static string or NULL
+      netsnmp_variable_list* vars_;   // cloned, NULL on error
+      bool primitive_;
+      bool rate_;                     // rates_ instead of vars_
+      std::vector<double> rates_;
+    };
+
+  private:
+    static Persistent<v8::FunctionTemplate> constructorTemplate_;
+
+    SnmpSessionManager* manager_;
+    Persistent<Function> callback_;
+    std::map<unsigned, job*> jobs_;
+    unsigned lastId_;
+    double added_;      // jobs ever added, position in spreading sequence
+    double jitter_;     // fraction of interval
+    std::vector<result> results_;
+
+    SnmpPollScheduler()
+      : manager_(SnmpSessionManager::default_inst()), lastId_(0), added_(0),
+        jitter_(0.05)
+    { }
+
+    void collect(job* aJob, netsnmp_pdu* pdu, const char* aError);
+    void remove(std::map<unsigned, job*>::iterator aJob);
+    void flushPending();
+
+    static Handle<Value> New(const Arguments& args);
+    static Handle<Value> Add(const Arguments& args);
+    static Handle<Value> Remove(const Arguments& args);
+    static Handle<Value> Close(const Arguments& args);
+
+  public:
+    ~SnmpPollScheduler();
+
+    static void Initialize(Handle<Object> target);
+};
+
+Persistent<v8::FunctionTemplate> SnmpPollScheduler::constructorTemplate_;
+
+// SnmpPollScheduler::~SnmpPollScheduler() {{{
+SnmpPollScheduler::~SnmpPollScheduler() {
+  // jobs keep the object alive, only undelivered results can be left
+  manager_->unschedule(this);
+  for (size_t i = 0; i < results_.size(); ++i) {
+    if (results_[i].vars_) {
+      snmp_free_varbind(results_[i].vars_);
+    }
+  }
+  while (!jobs_.empty()) {
+    remove(jobs_.begin());
+  }
+  callback_.Dispose();
+}
+// }}}
+
+// void SnmpPollScheduler::job::onTimer() {{{
+void SnmpPollScheduler::job::onTimer() {
+  // next cycle first, the job must stay armed. Cycles missed while the loop
+  // was blocked are skipped, not fired back to back.
+  double kNow = SnmpSessionManager::nowMs();
+  cycle_ = std::max(cycle_ + 1, floor((kNow - start_) / interval_) + 1);
+  double kJitter = (drand48() - 0.5) * owner_->jitter_ * interval_;
+  due_ = start_ + cycle_ * interval_ + kJitter;
+  owner_->manager_->addTimer(due_, this);
+
+  if (request_) {
+    // deadline is one interval, it fails the request before we get here
+    // unless the loop was blocked
+    owner_->collect(this, NULL, "poll overrun");
+    return;
+  }
+
+  const char* kRejected = owner_->manager_->admit();
+  if (kRejected) {
+    owner_->collect(this, NULL, kRejected);
+    return;
+  }
+  netsnmp_pdu* pdu =
+    SnmpRequestTemplate::instantiate(prototype_, SNMP_MSG_GET);
+  if (!pdu) {
+    owner_->collect(this, NULL, "cannot allocate pdu");
+    return;
+  }
+  request_ = sessionPtr_->Submit(SnmpSession::REQ_GET, pdu, this, options_);
+  if (!request_) {
+    owner_->collect(this, NULL, "session is closed");
+  }
+}
+// }}}
+
+// void SnmpPollScheduler::job::deliver(...) {{{
+void SnmpPollScheduler::job::deliver(netsnmp_pdu* pdu, const char* aError) {
+  request_ = 0;
+  owner_->collect(this, pdu, aError);
+}
+// }}}
+
+// void SnmpPollScheduler::collect(...) {{{
+void SnmpPollScheduler::collect(job* aJob, netsnmp_pdu* pdu,
+    const char* aError)
+{
+  result kResult;
+  kResult.job_ = aJob->id_;
+  kResult.time_ = SnmpSessionManager::nowMs();
+  kResult.error_ = aError;
+  kResult.vars_ = NULL;
+  kResult.primitive_ = aJob->options_.primitive_;
+  kResult.rate_ = aJob->options_.rate_;
+  if (pdu && kResult.rate_) {
+    // now, the session can be gone by the time of flush
+    aJob->sessionPtr_->computeRates(pdu->variables, &kResult.rates_);
+  } else if (pdu && pdu->variables) {
+    kResult.vars_ = snmp_clone_varbind(pdu->variables);
+    if (!kResult.vars_) {
+      kResult.error_ = "cannot allocate result";
+    }
+  }
+  results_.push_back(kResult);
+  manager_->schedule(this);
+}
+// }}}
+
+// void SnmpPollScheduler::remove(...) {{{
+void SnmpPollScheduler::remove(std::map<unsigned, job*>::iterator aJob) {
+  job* kJob = aJob->second;
+  jobs_.erase(aJob);
+  manager_->removeTimer(kJob->due_, kJob);
+  if (kJob->request_) {
+    kJob->sessionPtr_->CancelRequest(kJob->request_);
+  }
+  kJob->session_.Dispose();
+  delete kJob;
+  if (jobs_.empty() && !handle_.IsEmpty()) {
+    Unref();
+  }
+}
+// }}}
+
+// void SnmpPollScheduler::flushPending() {{{
+void SnmpPollScheduler::flushPending() {
+  if (results_.empty() || callback_.IsEmpty()) {
+    return;
+  }
+  HandleScope kScope;
+
+  std::vector<result> kResults;
+  kResults.swap(results_);
+
+  // rates of the whole batch in one Buffer, each result gets its slice
+  size_t kRateBytes = 0;
+  for (size_t i = 0; i < kResults.size(); ++i) {
+    kRateBytes += kResults[i].rates_.size() * sizeof(uint64_t);
+  }
+  node::Buffer* kRates = kRateBytes ? node::Buffer::New(kRateBytes) : NULL;
+  size_t kRateOffset = 0;
+
+  Local<Array> kArray = v8::Array::New(kResults.size());
+  for (size_t i = 0; i < kResults.size(); ++i) {
+    const result& r = kResults[i];
+    Local<Object> o = Object::New();
+    o->Set(String::NewSymbol("id"), v8::Integer::NewFromUnsigned(r.job_));
+    o->Set(String::NewSymbol("time"), v8::Number::New(r.time_));
+    if (r.error_) {
+      o->Set(String::NewSymbol("error"), String::New(r.error_));
+    } else {
+      o->Set(String::NewSymbol("error"), v8::Null());
+    }
+    if (r.rate_) {
+      size_t kLength = r.rates_.size() * sizeof(uint64_t);
+      if (kLength) {
+        SnmpSession::writeRates(r.rates_,
+            node::Buffer::Data(kRates) + kRateOffset);
+        o->Set(String::NewSymbol("rates"),
+            SnmpSession::bufferToV8(kRates, kRateOffset, kLength));
+        kRateOffset += kLength;
+      } else {
+        o->Set(String::NewSymbol("rates"), SnmpSession::ratesToV8(r.rates_));
+      }
+    } else {
+      uint32_t kCount = 0;
+      Local<Array> kValues = v8::Array::New(0);
+      for (netsnmp_variable_list* var = r.vars_; var;
+          var = var->next_variable)
+      {
+        kValues->Set(kCount++, SnmpResult::New(var, r.primitive_));
+      }
+      o->Set(String::NewSymbol("values"), kValues);
+    }
+    kArray->Set(i, o);
+    if (r.vars_) {
+      snmp_free_varbind(r.vars_);
+    }
+  }
+
+  // callback can close the scheduler, keep local handle to it
+  Local<Function> kCallback = Local<Function>::New(callback_);
+  Handle<Value> args[2];
+  args[0] = v8::Boolean::New(false);
+  args[1] = kArray;
+
+  TryCatch try_catch;
+  kCallback->Call(v8::Context::GetCurrent()->Global(), 2, args);
+  if (try_catch.HasCaught()) {
+    node::FatalException(try_catch);
+  }
+}
+// }}}
+
+// Handle<Value> SnmpPollScheduler::New(const Arguments& args) {{{
+Handle<Value> SnmpPollScheduler::New(const Arguments& args) {
+  HandleScope kScope;
+
+  // call with (callback[, jitter as fraction of interval])
+  if (args.Length() < 1 || !args[0]->IsFunction()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - callback is not a function")));
+  }
+  double kJitter = 0.05;
+  if (args.Length() > 1 && !args[1]->IsUndefined()) {
+    if (!args[1]->IsNumber() || args[1]->NumberValue() < 0 ||
+        args[1]->NumberValue() > 1)
+    {
+      return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+              "invalid argument - jitter must be number from 0 to 1")));
+    }
+    kJitter = args[1]->NumberValue();
+  }
+
+  SnmpPollScheduler* kInst = new SnmpPollScheduler();
+  kInst->jitter_ = kJitter;
+  kInst->callback_ = Persistent<Function>::New(
+      Local<Function>::Cast(args[0]));
+  // jobs keep the object alive, see Add
+  kInst->Wrap(args.This());
+  return kScope.Close(args.This());
+}
+// }}}
 
+// Handle<Value> SnmpPollScheduler::Add(const Arguments& args) {{{
+Handle<Value> SnmpPollScheduler::Add(const Arguments& args) {
+  HandleScope kScope;
+  SnmpPollScheduler* inst =
+    ObjectWrap::Unwrap<SnmpPollScheduler>(args.This());
+  if (inst->callback_.IsEmpty()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("scheduler is closed")));
+  }
 
+  // call with (connection, array of OIDs or template, interval in ms[,
+  // options])
+  if (args.Length() < 3) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  if (!SnmpSession::HasInstance(args[0])) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - not a connection")));
+  }
+  if (!SnmpRequestTemplate::FromV8(args[1]) &&
+      (!args[1]->IsArray() || Local<Array>::Cast(args[1])->Length() == 0))
+  {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - OIDs must be non-empty array")));
+  }
+  if (!args[2]->IsNumber() || args[2]->NumberValue() < 1) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - interval must be at least 1 ms")));
+  }
 
-// ===== class SnmpResult : public node::ObjectWrap {{{
-class SnmpResult : public node::ObjectWrap {
-  public:
-    static Local<Object> New(netsnmp_variable_list* var);
+  std::auto_ptr<job> kJob(new job());
+  if (!requestOptionsFromV8(args[3], &kJob->options_)) {
+    return kScope.Close(v8::Undefined());
+  }
+  if (kJob->options_.format_ != FORMAT_NONE) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL(
+            "invalid argument - scheduler results cannot be written to output")));
+  }
+  // request is built once, cycles send its copies
+  SnmpRequestTemplate* kTemplate = SnmpRequestTemplate::FromV8(args[1]);
+  if (kTemplate) {
+    kJob->prototype_ = kTemplate->instantiate(SNMP_MSG_GET);
+    if (!kJob->prototype_) {
+      return kScope.Close(
+          v8::ThrowException(NODE_PSYMBOL("cannot allocate pdu")));
+    }
+  } else {
+    kJob->prototype_ = pduFromV8(SNMP_MSG_GET, args[1]);
+    if (!kJob->prototype_) {
+      return kScope.Close(v8::Undefined());
+    }
+  }
+  if (kJob->options_.rate_ && !SnmpSession::addUptimeVar(kJob->prototype_)) {
+    return kScope.Close(
+        v8::ThrowException(NODE_PSYMBOL("cannot allocate pdu")));
+  }
 
-    static void Initialize(Handle<Object> target);
-};
+  kJob->owner_ = inst;
+  kJob->id_ = ++inst->lastId_;
+  kJob->session_ = Persistent<Object>::New(args[0]->ToObject());
+  kJob->sessionPtr_ = ObjectWrap::Unwrap<SnmpSession>(args[0]->ToObject());
+  kJob->interval_ = args[2]->NumberValue();
+  // stale poll fails instead of competing with the next cycle
+  if (kJob->options_.deadline_ == 0 ||
+      kJob->options_.deadline_ > kJob->interval_)
+  {
+    kJob->options_.deadline_ = kJob->interval_;
+  }
+  kJob->cycle_ = -1;
+  kJob->request_ = 0;
+
+  // 0.618... - fractional part of golden ratio
+  double kPhase = inst->added_++ * 0.6180339887498949;
+  kPhase -= floor(kPhase);
+  kJob->start_ = SnmpSessionManager::nowMs() + kPhase * kJob->interval_;
+  kJob->due_ = kJob->start_;
+  inst->manager_->addTimer(kJob->due_, kJob.get());
+
+  if (inst->jobs_.empty()) {
+    inst->Ref();
+  }
+  inst->jobs_[kJob->id_] = kJob.get();
+  return kScope.Close(v8::Integer::NewFromUnsigned(kJob.release()->id_));
+}
+// }}}
 
-// Local<Object> SnmpResult::New(netsnmp_variable_list* var) {{{
-Local<Object> SnmpResult::New(netsnmp_variable_list* var) {
-  assert(var);
+// Handle<Value> SnmpPollScheduler::Remove(const Arguments& args) {{{
+Handle<Value> SnmpPollScheduler::Remove(const Arguments& args) {
   HandleScope kScope;
+  SnmpPollScheduler* inst =
+    ObjectWrap::Unwrap<SnmpPollScheduler>(args.This());
 
-  Local<Object> o = Object::New();
-  o->Set(String::New("oid"),
-      SnmpValue::New(ASN_OBJECT_ID,
-        var->name, var->name_length * sizeof(oid)));
-  o->Set(String::New("value"),
-      SnmpValue::New(var->type, var->val.string, var->val_len));
-  return kScope.Close(o);
+  // call with (job id), undelivered results of the job are still delivered
+  if (args.Length() < 1 || !args[0]->IsNumber()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid argument - job id must be number")));
+  }
+  std::map<unsigned, job*>::iterator it =
+    inst->jobs_.find(args[0]->Uint32Value());
+  if (it == inst->jobs_.end()) {
+    return kScope.Close(v8::False());
+  }
+  inst->remove(it);
+  return kScope.Close(v8::True());
 }
 // }}}
 
-// void SnmpResult::Initialize(Handle<Object> target) {{{
-void SnmpResult::Initialize(Handle<Object> target) {
+// Handle<Value> SnmpPollScheduler::Close(const Arguments& args) {{{
+Handle<Value> SnmpPollScheduler::Close(const Arguments& args) {
+  HandleScope kScope;
+  SnmpPollScheduler* inst =
+    ObjectWrap::Unwrap<SnmpPollScheduler>(args.This());
+
+  while (!inst->jobs_.empty()) {
+    inst->remove(inst->jobs_.begin());
+  }
+  for (size_t i = 0; i < inst->results_.size(); ++i) {
+    if (inst->results_[i].vars_) {
+      snmp_free_varbind(inst->results_[i].vars_);
+    }
+  }
+  inst->results_.clear();
+  inst->manager_->unschedule(inst);
+  inst->callback_.Dispose();
+  inst->callback_.Clear();
+  return kScope.Close(v8::Undefined());
 }
 // }}}
 
+// void SnmpPollScheduler::Initialize(Handle<Object> target) {{{
+void SnmpPollScheduler::Initialize(Handle<Object> target) {
+  js::HandleScope kScope;
+
+  Local<FunctionTemplate> t = FunctionTemplate::New(SnmpPollScheduler::New);
+  constructorTemplate_ = Persistent<FunctionTemplate>::New(t);
+  constructorTemplate_->InstanceTemplate()->SetInternalFieldCount(1);
+  constructorTemplate_->SetClassName(String::NewSymbol("Scheduler"));
+
+  NODE_SET_PROTOTYPE_METHOD(t, "Add", SnmpPollScheduler::Add);
+  NODE_SET_PROTOTYPE_METHOD(t, "Remove", SnmpPollScheduler::Remove);
+  NODE_SET_PROTOTYPE_METHOD(t, "Close", SnmpPollScheduler::Close);
+
+  target->Set(String::NewSymbol("Scheduler"),
+      constructorTemplate_->GetFunction());
+}
 // }}}
 
+// }}}
 
 
-// ==== class SnmpSession : public node::ObjectWrap {{{
 
-class SnmpSession : public node::ObjectWrap {
-  public:
-    typedef Persistent<Function> callback_type;
+// ==== class SnmpTrapListener : public node::ObjectWrap {{{
 
-    struct self_data {
-      SnmpSession* selfPtr_;
+/**
+ * Receiver of SNMPv1/v2c traps and informs. Socket is watched by the session
+ * manager's loop, every  readable event drains  up to kMaxBatch  datagrams
+ * (with recvmmsg where available), decodes them and passes all of them to JS
+ * in one callback call. Informs are acknowledged before the callback runs.
+ *
+ * Only community based messages are decoded here, SNMPv3 needs the whole USM
+ * machinery of a net-snmp session and is dropped.
+ */
+class SnmpTrapListener : public node::ObjectWrap {
+  public:
+    struct ex_io {
+      ev_io watcher_;
+      SnmpTrapListener* selfPtr_;
     };
 
-    enum req_type {
-      REQ_NEXT = SNMP_MSG_GETNEXT ,
-      REQ_GET = SNMP_MSG_GET,
-      REQ_BULK = SNMP_MSG_GETBULK
+    enum {
+      kRecvBatch = 32,          // datagrams per recvmmsg call
+      kMaxBatch = 1024,         // datagrams per JS callback
+      kMaxMessage = 8192        // larger datagrams are dropped
     };
 
-    struct req_data {
-      netsnmp_pdu* pdu_;
-      req_type type_;
-      callback_type callback_;
+    struct datagram {
+      struct sockaddr_storage from_;
+      socklen_t fromLength_;
+      size_t length_;
     };
 
-    typedef std::deque<req_data> queue_type;
-    typedef queue_type::iterator queue_iterator;
-
   private:
-    self_data selfData_;
-    std::string hostName_;
-    std::string credentials_;
-    queue_type queue_;
-    void* sessionHandle_;
-    SnmpSessionManager* manager_;
-    Persistent<Value> destructorInvoker_;
-
-  private: // ctors
-    SnmpSession() {
-      selfData_.selfPtr_ = this;
-      manager_ = SnmpSessionManager::default_inst();
-#ifdef ENABLE_DEBUG_PRINTS
-      fprintf(stdout, "SnmpSession()\n");
-#endif
-    };
-
-  private: // methods
-    Handle<Value> PerformRequestImpl(
-        req_type aType, netsnmp_pdu* pdu, callback_type aCallback);
-
-    void snmp_success_cb(
-        struct snmp_pdu* pdu,
-        const req_data& magic
-        );
-
-    void snmp_fail_cb(
-        struct snmp_pdu* pdu,
-        const req_data& magic,
-        const char* reason
-        );
-
-    int snmp_cb_proxy(
-        int operation,
-        netsnmp_session* session,
-        int reqid,
-        struct snmp_pdu* pdu
-        );
-
-    // void getBulk(
-    //     const oid* aOID, std::size_t aOIDLen,
-    //     const callback_type& aCallback);
-
-    /**
-     * We can't mix sync and async queries in same session (they would use same
-     * descriptor, and we don't want responses to earlier requests, or to allow
-     * node to process  other async operations, when in sync  mode). Since sync
-     * version is inefficient by definition, it doesn't matter if we add little
-     * more inefficiency and open another session to same host.
-     */
-    SnmpSession* Clone(SnmpSessionManager* aManager);
-
-  private: // static callback proxy
-    static int snmp_cb(
-        int operation,
-        netsnmp_session* session,
-        int reqid,
-        struct snmp_pdu* pdu,
-        void* magic);
-
-  private: // static interface for V8 integration
     static Persistent<v8::FunctionTemplate> constructorTemplate_;
 
-    static Handle<Value> PerformRequest(req_type aType, const Arguments& args);
+    int fd_;
+    ex_io io_;
+    SnmpSessionManager* manager_;
+    Persistent<Function> callback_;
+    std::vector<unsigned char> buffers_;  // kRecvBatch * kMaxMessage
+    std::vector<datagram> datagrams_;
+    std::vector<size_t> acks_;            // datagrams to send back
+
+    SnmpTrapListener()
+      : fd_(-1), manager_(SnmpSessionManager::default_inst())
+    {
+      io_.selfPtr_ = this;
+      buffers_.resize(kRecvBatch * kMaxMessage);
+      datagrams_.resize(kRecvBatch);
+    }
 
-    // entrypoints from V8, all just call
-    static Handle<Value> Get(const Arguments& args);
-    static Handle<Value> GetNext(const Arguments& args);
-    static Handle<Value> GetBulk(const Arguments& args);
+    unsigned char* buffer(size_t i) { return &buffers_[i * kMaxMessage]; }
 
-    static SnmpSession* New(const std::string& hostName,
-        const std::string& credentials);
+    size_t receive();
+    void sendAcks();
+    Local<Value> decode(size_t i);
+    void close();
 
-    static void Destroy(Persistent<Value> v, void* param);
+    void io_cb_impl();
+    static void io_cb(EV_P_ ev_io* w, int revents);
+
+    static Handle<Value> New(const Arguments& args);
+    static Handle<Value> Close(const Arguments& args);
 
   public:
-    ~SnmpSession() {
-#ifdef ENABLE_DEBUG_PRINTS
-      fprintf(stdout, "~SnmpSession()\n");
-#endif
-      if (sessionHandle_) {
-#ifdef ENABLE_DEBUG_PRINTS
-        fprintf(stdout, "close handle %p\n", sessionHandle_);
-#endif
-        snmp_sess_close(sessionHandle_);
-        sessionHandle_ = NULL;
-      }
+    ~SnmpTrapListener() {
+      close();
     }
 
-    static Handle<Value> New(const Arguments& args);
     static void Initialize(Handle<Object> target);
 };
 
-Persistent<v8::FunctionTemplate> SnmpSession::constructorTemplate_;
+Persistent<v8::FunctionTemplate> SnmpTrapListener::constructorTemplate_;
+
+// size_t SnmpTrapListener::receive() {{{
+size_t SnmpTrapListener::receive() {
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr kMsgs[kRecvBatch];
+  struct iovec kIov[kRecvBatch];
+
+  memset(kMsgs, 0, sizeof(kMsgs));
+  for (size_t i = 0; i < kRecvBatch; ++i) {
+    kIov[i].iov_base = buffer(i);
+    kIov[i].iov_len = kMaxMessage;
+    kMsgs[i].msg_hdr.msg_iov = &kIov[i];
+    kMsgs[i].msg_hdr.msg_iovlen = 1;
+    kMsgs[i].msg_hdr.msg_name = &datagrams_[i].from_;
+    kMsgs[i].msg_hdr.msg_namelen = sizeof(datagrams_[i].from_);
+  }
 
-// SnmpSession* SnmpSession::Clone(SnmpSessionManager* aManager) {{{
-SnmpSession* SnmpSession::Clone(SnmpSessionManager* aManager) {
-  SnmpSession* kResult = SnmpSession::New(hostName_, credentials_);
-  kResult->manager_ = aManager;
-  return kResult;
+  int kCount = recvmmsg(fd_, kMsgs, kRecvBatch, MSG_DONTWAIT, NULL);
+  if (kCount <= 0) {
+    return 0;
+  }
+  for (int i = 0; i < kCount; ++i) {
+    datagrams_[i].fromLength_ = kMsgs[i].msg_hdr.msg_namelen;
+    datagrams_[i].length_ = (kMsgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+      ? 0 : kMsgs[i].msg_len;
+  }
+  return kCount;
+#else
+  size_t i = 0;
+  for (; i < kRecvBatch; ++i) {
+    datagrams_[i].fromLength_ = sizeof(datagrams_[i].from_);
+    ssize_t kLength = recvfrom(fd_, buffer(i), kMaxMessage, MSG_DONTWAIT,
+        reinterpret_cast<struct sockaddr*>(&datagrams_[i].from_),
+        &datagrams_[i].fromLength_);
+    if (kLength < 0) {
+      break;
+    }
+    // can't tell truncated datagram from full one without MSG_TRUNC
+    // support in recvfrom, the decoder will reject it anyway
+    datagrams_[i].length_ = kLength;
+  }
+  return i;
+#endif
 }
 // }}}
 
-// Handle<Value> SnmpSession::PerformRequestImpl(...) {{{
-Handle<Value> SnmpSession::PerformRequestImpl(
-    req_type aType, netsnmp_pdu* pdu, callback_type aCallback)
-{
-  HandleScope kScope;
-
-  // net-snmp takes over the pdu pointer!
-  if (!snmp_sess_send(sessionHandle_, pdu)) {
-    return kScope.Close(
-        v8::ThrowException(NODE_PSYMBOL("cannot send query")));
+// void SnmpTrapListener::sendAcks() {{{
+void SnmpTrapListener::sendAcks() {
+  if (acks_.empty()) {
+    return;
   }
-  queue_.resize(queue_.size() + 1);
-  queue_.back().pdu_ = pdu;
-  queue_.back().type_ = aType;
-  queue_.back().callback_ = v8::Persistent<Function>::New(aCallback);
-  if (queue_.size() == 1) {
-    manager_->addClient(sessionHandle_);
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr kMsgs[kRecvBatch];
+  struct iovec kIov[kRecvBatch];
+
+  memset(kMsgs, 0, sizeof(kMsgs));
+  for (size_t i = 0; i < acks_.size(); ++i) {
+    datagram& kDatagram = datagrams_[acks_[i]];
+    kIov[i].iov_base = buffer(acks_[i]);
+    kIov[i].iov_len = kDatagram.length_;
+    kMsgs[i].msg_hdr.msg_iov = &kIov[i];
+    kMsgs[i].msg_hdr.msg_iovlen = 1;
+    kMsgs[i].msg_hdr.msg_name = &kDatagram.from_;
+    kMsgs[i].msg_hdr.msg_namelen = kDatagram.fromLength_;
   }
-  return kScope.Close(v8::Undefined());
+  // best effort, like any UDP response - sender retries unacknowledged
+  // informs
+  sendmmsg(fd_, kMsgs, acks_.size(), MSG_DONTWAIT);
+#else
+  for (size_t i = 0; i < acks_.size(); ++i) {
+    datagram& kDatagram = datagrams_[acks_[i]];
+    sendto(fd_, buffer(acks_[i]), kDatagram.length_, MSG_DONTWAIT,
+        reinterpret_cast<struct sockaddr*>(&kDatagram.from_),
+        kDatagram.fromLength_);
+  }
+#endif
+  acks_.clear();
 }
 // }}}
 
-// void SnmpSession::snmp_success_cb(...) {{{
-void SnmpSession::snmp_success_cb(
-    struct snmp_pdu* pdu,
-    const req_data& magic
-    )
-{
-  HandleScope kScope;
-
-  netsnmp_variable_list* var = pdu->variables;
-  Local<Array> kResult = v8::Array::New(0);
-  uint32_t index = 0;
-
-  for(; var; var = var->next_variable, ++index) {
-    kResult->Set(index, SnmpResult::New(var));
+namespace {
+// Local<String> sockaddr_to_string(...) {{{
+Local<String> sockaddr_to_string(const struct sockaddr_storage& aAddr) {
+  char kHost[INET6_ADDRSTRLEN] = "";
+  unsigned int kPort = 0;
+
+  if (aAddr.ss_family == AF_INET) {
+    const struct sockaddr_in* kIn =
+      reinterpret_cast<const struct sockaddr_in*>(&aAddr);
+    inet_ntop(AF_INET, &kIn->sin_addr, kHost, sizeof(kHost));
+    kPort = ntohs(kIn->sin_port);
+  } else if (aAddr.ss_family == AF_INET6) {
+    const struct sockaddr_in6* kIn6 =
+      reinterpret_cast<const struct sockaddr_in6*>(&aAddr);
+    inet_ntop(AF_INET6, &kIn6->sin6_addr, kHost, sizeof(kHost));
+    kPort = ntohs(kIn6->sin6_port);
   }
 
-  Handle<Value> args[2];
-  args[0] = v8::Boolean::New(false);
-  args[1] = kResult;
-
-  {
-    TryCatch try_catch;
-
-    magic.callback_->Call(v8::Context::GetCurrent()->Global(), 2, args);
-
-    if (try_catch.HasCaught()) {
-      node::FatalException(try_catch);
-    }
-  }
+  std::ostringstream kResult;
+  kResult << kHost << ":" << kPort;
+  return String::New(kResult.str().c_str());
 }
 // }}}
+}
 
-// void SnmpSession::snmp_fail_cb(...) {{{
-void SnmpSession::snmp_fail_cb(
-        struct snmp_pdu* pdu,
-        const req_data& magic,
-        const char* reason
-        )
-{
+// Local<Value> SnmpTrapListener::decode(size_t i) {{{
+Local<Value> SnmpTrapListener::decode(size_t i) {
   HandleScope kScope;
-
-  Handle<Value> args[2];
-  args[0] = v8::String::NewSymbol(reason, strlen(reason));
-  args[1] = v8::Null();
-
+  datagram& kDatagram = datagrams_[i];
+  u_char* kData = buffer(i);
+  size_t kLength = kDatagram.length_;
+  u_char kType;
+
+  // Message ::= SEQUENCE { version INTEGER, community OCTET STRING, PDU }
+  u_char* p = asn_parse_sequence(kData, &kLength, &kType,
+      (ASN_SEQUENCE | ASN_CONSTRUCTOR), "message");
+  long kVersion;
+  if (!p || !(p = asn_parse_int(p, &kLength, &kType,
+          &kVersion, sizeof(kVersion))))
   {
-    // TryCatch try_catch;
-
-    magic.callback_->Call(v8::Context::GetCurrent()->Global(), 2, args);
-
-    // if (try_catch.HasCaught()) {
-    //   node::FatalException(try_catch);
-    // }
+    return kScope.Close(Local<Value>());
+  }
+  if (kVersion != SNMP_VERSION_1 && kVersion != SNMP_VERSION_2c) {
+    return kScope.Close(Local<Value>());
+  }
+  u_char kCommunity[256];
+  size_t kCommunityLength = sizeof(kCommunity);
+  if (!(p = asn_parse_string(p, &kLength, &kType,
+          kCommunity, &kCommunityLength)))
+  {
+    return kScope.Close(Local<Value>());
   }
-}
-// }}}
 
-// int SnmpSession::snmp_cb_proxy(...) {{{
-int SnmpSession::snmp_cb_proxy(
-    int operation,
-    netsnmp_session* session,
-    int reqid,
-    struct snmp_pdu* pdu)
-{
-  queue_iterator it_end = queue_.end();
-  for (queue_iterator it = queue_.begin(); it != it_end; ++it) {
-    if (it->pdu_->reqid == reqid) {
-      // in  some more  extreme  situations, *this  can  be deallocated  inside
-      // callback (by forcing GC cycle). Everything we want to do with instance
-      // must be done before trying callback.
-      req_data kReq = *it;
+  size_t kPduOffset = p - kData;
+  netsnmp_pdu* pdu = snmp_pdu_create(SNMP_MSG_TRAP2);
+  if (!pdu) {
+    return kScope.Close(Local<Value>());
+  }
+  pdu->version = kVersion;
+  if (snmp_pdu_parse(pdu, p, &kLength) != 0) {
+    snmp_free_pdu(pdu);
+    return kScope.Close(Local<Value>());
+  }
 
-      queue_.erase(it);
-      if (queue_.size() == 0) {
-        manager_->removeClient(sessionHandle_);
-      }
-
-      if (operation != NETSNMP_CALLBACK_OP_RECEIVED_MESSAGE) {
-        const char* msg;
-        switch (operation) {
-          case NETSNMP_CALLBACK_OP_TIMED_OUT:
-            msg = "timeout";
-            break;
-          case NETSNMP_CALLBACK_OP_SEND_FAILED:
-            msg = "send failed";
-            break;
-          case NETSNMP_CALLBACK_OP_CONNECT:
-            msg = "connect failed";
-            break;
-          case NETSNMP_CALLBACK_OP_DISCONNECT:
-            msg = "peer has disconnected";
-            break;
-          default:
-            msg = "unknown snmp error";
-        }
-        snmp_fail_cb(pdu, kReq, msg);
-        kReq.callback_.Dispose();
-        return 1;
-      }
-      if (pdu->errstat != SNMP_ERR_NOERROR) {
-        const char* msg = snmp_errstring(pdu->errstat);
-        snmp_fail_cb(pdu, kReq, msg);
-        kReq.callback_.Dispose();
-        return 1;
-      }
+  const char* kKind;
+  switch (pdu->command) {
+    case SNMP_MSG_TRAP:
+      kKind = "trap";
+      break;
+    case SNMP_MSG_TRAP2:
+      kKind = "trap2";
+      break;
+    case SNMP_MSG_INFORM:
+      kKind = "inform";
+      break;
+    default:
+      snmp_free_pdu(pdu);
+      return kScope.Close(Local<Value>());
+  }
 
-      switch (it->type_) {
-        case REQ_GET:
-          snmp_success_cb(pdu, kReq);
-          break;
-        case REQ_NEXT:
-          snmp_success_cb(pdu, kReq);
-          break;
-        case REQ_BULK:
-        default:
-          assert(false && "internal error: inconsistent req_data record");
-          snmp_fail_cb(pdu, kReq,
-              "internal error: inconsistent req_data record");
-          break;
-      }
-      kReq.callback_.Dispose();
-      return 1;
-    }
+  Local<Object> o = Object::New();
+  o->Set(String::NewSymbol("type"), String::NewSymbol(kKind));
+  o->Set(String::NewSymbol("version"), v8::Integer::New(kVersion));
+  o->Set(String::NewSymbol("community"),
+      String::New(reinterpret_cast<char*>(kCommunity), kCommunityLength));
+  o->Set(String::NewSymbol("source"), sockaddr_to_string(kDatagram.from_));
+
+  if (pdu->command == SNMP_MSG_TRAP) {
+    o->Set(String::NewSymbol("enterprise"),
+        SnmpValue::New(ASN_OBJECT_ID, pdu->enterprise,
+          pdu->enterprise_length * sizeof(oid)));
+    o->Set(String::NewSymbol("agentAddr"),
+        SnmpValue::New(ASN_IPADDRESS, pdu->agent_addr,
+          sizeof(pdu->agent_addr)));
+    o->Set(String::NewSymbol("genericTrap"),
+        v8::Integer::New(pdu->trap_type));
+    o->Set(String::NewSymbol("specificTrap"),
+        v8::Integer::New(pdu->specific_type));
+    o->Set(String::NewSymbol("uptime"),
+        v8::Integer::NewFromUnsigned(pdu->time));
   }
-  assert(false && "spurious response received");
-  return 1;
+
+  Local<Array> kVarbinds = v8::Array::New(0);
+  uint32_t index = 0;
+  for (netsnmp_variable_list* var = pdu->variables;
+      var; var = var->next_variable, ++index)
+  {
+    kVarbinds->Set(index, SnmpResult::New(var));
+  }
+  o->Set(String::NewSymbol("varbinds"), kVarbinds);
+
+  if (pdu->command == SNMP_MSG_INFORM) {
+    // Response to inform carries the same request-id and varbinds, with
+    // zero error-status and index - which the inform itself must have. The
+    // acknowledgement is the received message with PDU tag changed.
+    kData[kPduOffset] = SNMP_MSG_RESPONSE;
+    acks_.push_back(i);
+  }
+
+  snmp_free_pdu(pdu);
+  return kScope.Close(o);
 }
 // }}}
 
-// void SnmpSession::snmp_cb(...) {{{
-int SnmpSession::snmp_cb(
-    int operation,
-    netsnmp_session* session,
-    int reqid,
-    struct snmp_pdu* pdu,
-    void* magic)
-{
-  SnmpSession::self_data* instData =
-    reinterpret_cast<SnmpSession::self_data*>(magic);
-  return instData->selfPtr_->snmp_cb_proxy(operation, session, reqid, pdu);
+// void SnmpTrapListener::io_cb(...) {{{
+void SnmpTrapListener::io_cb(EV_P_ ev_io* w, int revents) {
+  ex_io* data = reinterpret_cast<ex_io*>(w);
+  data->selfPtr_->io_cb_impl();
 }
 // }}}
 
+// void SnmpTrapListener::io_cb_impl() {{{
+void SnmpTrapListener::io_cb_impl() {
+  HandleScope kScope;
 
-// SnmpSession* SnmpSession::New(hostname, community) {{{
-SnmpSession* SnmpSession::New(const std::string& hostName,
-    const std::string& credentials)
-{
-  SnmpSession* kResult = new SnmpSession();
-  kResult->hostName_ = hostName;
-  kResult->credentials_ = credentials;
+  Local<Array> kTraps = v8::Array::New(0);
+  uint32_t kCount = 0;
+  size_t kReceived = 0;
 
-  netsnmp_session kSession;
-  snmp_sess_init(&kSession);
-  kSession.peername = strdup(kResult->hostName_.c_str());
-  kSession.version = SNMP_VERSION_1;
+  while (kReceived < kMaxBatch) {
+    size_t n = receive();
+    kReceived += n;
+    for (size_t i = 0; i < n; ++i) {
+      if (datagrams_[i].length_ == 0) {
+        continue;
+      }
+      Local<Value> kTrap = decode(i);
+      if (!kTrap.IsEmpty()) {
+        kTraps->Set(kCount++, kTrap);
+      }
+    }
+    sendAcks();
+    if (n < kRecvBatch) {
+      break;
+    }
+  }
 
-  kSession.community = (u_char*)malloc(kResult->credentials_.size() + 1);
-  // TODO: some better way to report out of memory instead of SIGSEGV?
-  memcpy(kSession.community, kResult->credentials_.c_str(),
-      kResult->credentials_.size() + 1);
-  kSession.community_len = kResult->credentials_.size();
+  if (kCount == 0) {
+    return;
+  }
 
-  kSession.callback = SnmpSession::snmp_cb;
-  kSession.callback_magic = &kResult->selfData_;
+  // callback can close the listener (and GC can collect it afterwards), keep
+  // local handle to the callback
+  Local<Function> kCallback = Local<Function>::New(callback_);
+  Handle<Value> args[2];
+  args[0] = v8::Boolean::New(false);
+  args[1] = kTraps;
 
-  kResult->sessionHandle_ = snmp_sess_open(&kSession);
-#ifdef ENABLE_DEBUG_PRINTS
-  fprintf(stderr, "new session handle %p\n", kResult->sessionHandle_);
-#endif
-  kResult->manager_ = SnmpSessionManager::default_inst();
-  free(kSession.community);
-  free(kSession.peername);
+  TryCatch try_catch;
+  kCallback->Call(v8::Context::GetCurrent()->Global(), 2, args);
+  if (try_catch.HasCaught()) {
+    node::FatalException(try_catch);
+  }
+}
+// }}}
 
-  if (!kResult->sessionHandle_) {
-    delete kResult;
-    return NULL;
+// void SnmpTrapListener::close() {{{
+void SnmpTrapListener::close() {
+  if (fd_ < 0) {
+    return;
   }
-  return kResult;
+  manager_->stopWatcher(&io_.watcher_);
+  ::close(fd_);
+  fd_ = -1;
+  callback_.Dispose();
+  callback_.Clear();
+  Unref();
 }
 // }}}
 
-// Handle<Value> SnmpSession::New(const Arguments& args) {{{
-Handle<Value> SnmpSession::New(const Arguments& args) {
+// Handle<Value> SnmpTrapListener::New(const Arguments& args) {{{
+Handle<Value> SnmpTrapListener::New(const Arguments& args) {
   HandleScope kScope;
-  std::auto_ptr<SnmpSession> kInst;
 
-  if (args.Length() < 2 || !args[0]->IsString() || !args[1]->IsString()) {
+  // call with (port, address, callback)
+  if (args.Length() < 3 || !args[0]->IsUint32() || !args[1]->IsString()
+      || !args[2]->IsFunction())
+  {
     return kScope.Close(v8::ThrowException(
         NODE_PSYMBOL("not enough arguments or wrong type"
-        " (expecting two strings)")));
+        " (expecting port, address and callback)")));
   }
 
-  {
-    v8::String::Utf8Value hostname(args[0]->ToString());
-    v8::String::Utf8Value credentials(args[1]->ToString());
-    kInst.reset(SnmpSession::New(
-        std::string(*hostname, hostname.length()),
-        std::string(*credentials, credentials.length())
-        ));
+  uint32_t kPort = args[0]->Uint32Value();
+  v8::String::Utf8Value kAddress(args[1]->ToString());
+
+  struct sockaddr_storage kBind;
+  socklen_t kBindLength;
+  memset(&kBind, 0, sizeof(kBind));
+  struct sockaddr_in* kIn = reinterpret_cast<struct sockaddr_in*>(&kBind);
+  struct sockaddr_in6* kIn6 = reinterpret_cast<struct sockaddr_in6*>(&kBind);
+  if (inet_pton(AF_INET, *kAddress, &kIn->sin_addr) == 1) {
+    kIn->sin_family = AF_INET;
+    kIn->sin_port = htons(kPort);
+    kBindLength = sizeof(*kIn);
+  } else if (inet_pton(AF_INET6, *kAddress, &kIn6->sin6_addr) == 1) {
+    kIn6->sin6_family = AF_INET6;
+    kIn6->sin6_port = htons(kPort);
+    kBindLength = sizeof(*kIn6);
+  } else {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - cannot parse listen address")));
   }
 
-  if (!kInst.get()) {
+  int fd = socket(kBind.ss_family, SOCK_DGRAM, 0);
+  if (fd < 0) {
     return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("cannot open snmp session")));
+          NODE_PSYMBOL("cannot create socket")));
   }
+  if (bind(fd, reinterpret_cast<struct sockaddr*>(&kBind), kBindLength) < 0) {
+    ::close(fd);
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("cannot bind trap listener socket")));
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
+  SnmpTrapListener* kInst = new SnmpTrapListener();
+  kInst->fd_ = fd;
+  kInst->callback_ = Persistent<Function>::New(
+      Local<Function>::Cast(args[2]));
   kInst->Wrap(args.This());
-  /* Persistent<Object> p = */
-  kInst->destructorInvoker_ = Persistent<Object>::New(args.This());
-  kInst->destructorInvoker_.MakeWeak(NULL, SnmpSession::Destroy);
-  kInst.release();
+  // listening socket keeps the object alive until Close
+  kInst->Ref();
+
+  ev_io_init(&kInst->io_.watcher_, SnmpTrapListener::io_cb, fd, EV_READ);
+  kInst->manager_->startWatcher(&kInst->io_.watcher_);
+
   return kScope.Close(args.This());
 }
 // }}}
 
-// void SnmpSession::Destroy(Persistent<Value> v, void* param) {{{
-void SnmpSession::Destroy(Persistent<Value> v, void* param) {
-  assert(v->IsObject());
-  SnmpSession* s = ObjectWrap::Unwrap<SnmpSession>(v->ToObject());
-#ifdef ENABLE_DEBUG_PRINTS
-  fprintf(stderr, "destroy persistent for %p\n", s);
-#endif
-  delete s;
-  v.Dispose();
+// Handle<Value> SnmpTrapListener::Close(const Arguments& args) {{{
+Handle<Value> SnmpTrapListener::Close(const Arguments& args) {
+  HandleScope kScope;
+  SnmpTrapListener* inst = ObjectWrap::Unwrap<SnmpTrapListener>(args.This());
+  inst->close();
+  return kScope.Close(v8::Undefined());
 }
 // }}}
 
-namespace {
-// Local<Value> addNullVarFromV8Array(...) {{{
-void addNullVarFromV8Array(netsnmp_pdu* pdu, Local<Value> var,
-    std::vector<oid>* tmp)
-{
-  // handleScope - intentionally omited, use scope from PerformRequest
-  if (!var->IsArray()) {
-    v8::ThrowException(
-        NODE_PSYMBOL("invalid argument - not an array"));
-    return;
-  }
-  Local<Array> a = Local<Array>::Cast(var);
-  size_t end = a->Length();
-  if (end == 0) {
-    v8::ThrowException(
-        NODE_PSYMBOL("invalid argument - empty oid"));
-    return;
-  }
-  tmp->resize(end);
-  for (size_t i = 0; i < end; ++i) {
-    Local<Value> v = a->Get(i);
-    if (!v->IsUint32()) {
-      v8::ThrowException(
-          NODE_PSYMBOL("invalid oid - non-integer member"));
-      return;
-    }
-    (*tmp)[i] = v->ToUint32()->Value();
-  }
-  if (!snmp_add_null_var(pdu, &((*tmp)[0]), tmp->size())) {
-    v8::ThrowException(NODE_PSYMBOL("cannot add query to pdu"));
-    return;
-  }
+// void SnmpTrapListener::Initialize(Handle<Object> target) {{{
+void SnmpTrapListener::Initialize(Handle<Object> target) {
+  js::HandleScope kScope;
+
+  Local<FunctionTemplate> t = FunctionTemplate::New(SnmpTrapListener::New);
+  constructorTemplate_ = Persistent<FunctionTemplate>::New(t);
+  constructorTemplate_->InstanceTemplate()->SetInternalFieldCount(1);
+  constructorTemplate_->SetClassName(String::NewSymbol("TrapListener"));
+
+  NODE_SET_PROTOTYPE_METHOD(t, "Close", SnmpTrapListener::Close);
+
+  target->Set(String::NewSymbol("TrapListener"),
+      constructorTemplate_->GetFunction());
 }
 // }}}
-}
 
-// Handle<Value> SnmpSession::PerformRequest(...) {{{
-Handle<Value> SnmpSession::PerformRequest(
-    req_type aType, const Arguments& args)
-{
-  HandleScope kScope;
-  SnmpSession* inst = ObjectWrap::Unwrap<SnmpSession>(args.This());
+// }}}
 
-  // call with (OID, callback, bool (=sync or not sync))
-  if (args.Length() < 3) {
-    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
-  }
-  if (!args[0]->IsArray()) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - only string OID is supported")));
-  }
-  if (!args[1]->IsFunction()) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid arguments - callback is not a function")));
-  }
-  if (!args[2]->IsBoolean()) {
-    return kScope.Close(v8::ThrowException(
-          NODE_PSYMBOL("invalid argument - sync flag must be boolean")));
-  }
 
-  Local<Array> kOidArg = Local<Array>::Cast(args[0]);
+// ==== class SnmpFormatter {{{
+
+/**
+ * Text representation of values, same as snmpwalk -Oq prints them: enums are
+ * labeled,  DISPLAY-HINTs  of  TEXTUAL-CONVENTIONs  (MacAddress, DateAndTime,
+ * DisplayString...) and units are applied.
+ *
+ * MIB object of  an OID is resolved  with get_tree once and  cached by OID of
+ * the object. Lookup then is one map search: predecessor of the OID in cache
+ * is its longest cached prefix, if any. Only leaf objects (columns, scalars)
+ * are cached  - nothing  else can  be found below  them, so  any OID  in their
+ * subtree is theirs.
+ */
+class SnmpFormatter {
+  private:
+    typedef std::map<std::vector<oid>, struct tree*> cache_type;
 
-  netsnmp_pdu* pdu = NULL;
+    static cache_type cache_;
+    static unsigned generation_;   // of MIB tree the cache was built from
+    static std::vector<oid> key_;  // reused lookup key
+    static u_char* buf_;           // output buffer, grows as needed
+    static size_t bufLen_;
 
-  {
-    size_t end = kOidArg->Length();
-    if (end == 0) {
-      return kScope.Close(v8::ThrowException(
-            NODE_PSYMBOL("invalid argument - empty oid")));
-    }
+    static struct tree* lookup(const oid* aName, size_t aLength);
 
-    pdu = snmp_pdu_create(static_cast<int>(aType));
-    if (!pdu) {
-      return kScope.Close(
-          v8::ThrowException(NODE_PSYMBOL("cannot allocate pdu")));
-    }
+  public:
+    static bool format(const oid* aName, size_t aNameLength,
+        u_char aType, const void* aData, size_t aLength, std::string* aOut);
 
-    std::vector<oid> tmp;
-    v8::TryCatch tryCatch;
+};
 
-    if (kOidArg->Get(0)->IsArray()) {
-      // array of arrays - second level arrays must contain integers
-      for (size_t i = 0; i < end; ++i) {
-        addNullVarFromV8Array(pdu, kOidArg->Get(i), &tmp);
-        if (tryCatch.HasCaught()) {
-          return kScope.Close(tryCatch.ReThrow());
-        }
-      }
-    } else {
-      // array of integers - single oid query
-      addNullVarFromV8Array(pdu, kOidArg, &tmp);
-      if (tryCatch.HasCaught()) {
-        return kScope.Close(tryCatch.ReThrow());
-      }
-    }
-  }
+SnmpFormatter::cache_type SnmpFormatter::cache_;
+unsigned SnmpFormatter::generation_ = 0;
+std::vector<oid> SnmpFormatter::key_;
+u_char* SnmpFormatter::buf_ = NULL;
+size_t SnmpFormatter::bufLen_ = 0;
 
-  if (args[2]->BooleanValue()) {
-#if EV_MULTIPLICITY
-    struct ev_loop* our_loop = ev_loop_new(0);
-    SnmpSessionManager* manager = SnmpSessionManager::create(our_loop);
-    SnmpSession* cloned_sess = inst->Clone(manager);
+// struct tree* SnmpFormatter::lookup(const oid* aName, size_t aLength) {{{
+struct tree* SnmpFormatter::lookup(const oid* aName, size_t aLength) {
+  if (aLength == 0) {
+    // get_tree reads the first subid unconditionally
+    return NULL;
+  }
+  SnmpMibLoader::ensureLoaded();
+  if (generation_ != SnmpMibLoader::generation()) {
+    // tree nodes are gone
+    cache_.clear();
+    generation_ = SnmpMibLoader::generation();
+  }
 
-    cloned_sess->PerformRequestImpl(aType, pdu,
-        Persistent<Function>(Function::Cast(*args[1])));
+  key_.assign(aName, aName + aLength);
+  cache_type::const_iterator it = cache_.upper_bound(key_);
+  if (it != cache_.begin()) {
+    --it;
+    if (it->first.size() <= aLength &&
+        std::equal(it->first.begin(), it->first.end(), aName))
+    {
+      return it->second;
+    }
+  }
 
-#if EV_VERSION_MAJOR == 3
-    ev_loop(our_loop, 0);
-#else
-    ev_run(our_loop);
-#endif
+  struct tree* kTree = get_tree(aName, aLength, get_tree_head());
+  if (!kTree || kTree->child_list) {
+    return kTree;
+  }
 
-    delete cloned_sess;
-    delete manager;
-    ev_loop_destroy(our_loop);
-#else
-    return kScope.Close(
-        v8::ThrowException(
-          NODE_PSYMBOL("synchronous interface is unavailable due to"
-            " binding module configuration")));
-#endif
-  } else {
-    inst->PerformRequestImpl(aType, pdu,
-        Persistent<Function>(Function::Cast(*args[1])));
+  std::vector<oid> kObject;
+  for (struct tree* t = kTree; t; t = t->parent) {
+    kObject.push_back(t->subid);
   }
-  return kScope.Close(v8::Undefined());
+  std::reverse(kObject.begin(), kObject.end());
+  if (kObject.size() <= aLength &&
+      std::equal(kObject.begin(), kObject.end(), aName))
+  {
+    cache_.insert(std::make_pair(kObject, kTree));
+  }
+  return kTree;
 }
 // }}}
 
-// Handle<Value> SnmpSession::Get(const Arguments& args) {{{
-Handle<Value> SnmpSession::Get(const Arguments& args) {
-  return PerformRequest(REQ_GET, args);
+// bool SnmpFormatter::format(...) {{{
+bool SnmpFormatter::format(const oid* aName, size_t aNameLength,
+    u_char aType, const void* aData, size_t aLength, std::string* aOut)
+{
+  netsnmp_variable_list kVar;
+  memset(&kVar, 0, sizeof(kVar));
+  kVar.name = const_cast<oid*>(aName);
+  kVar.name_length = aNameLength;
+  kVar.type = aType;
+  kVar.val.string = static_cast<u_char*>(const_cast<void*>(aData));
+  kVar.val_len = aLength;
+
+  if (!buf_) {
+    bufLen_ = 256;
+    buf_ = static_cast<u_char*>(malloc(bufLen_));
+    if (!buf_) {
+      bufLen_ = 0;
+      return false;
+    }
+  }
+
+  struct tree* kTree = lookup(aName, aNameLength);
+  size_t kOutLen = 0;
+  // without "TYPE: " prefixes, the setting is process-wide and is restored
+  // for net-snmp users outside the formatter
+  int kQuick = netsnmp_ds_get_boolean(NETSNMP_DS_LIBRARY_ID,
+      NETSNMP_DS_LIB_QUICK_PRINT);
+  netsnmp_ds_set_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_QUICK_PRINT, 1);
+  int kOk = sprint_realloc_by_type(&buf_, &bufLen_, &kOutLen, 1, &kVar,
+      kTree ? kTree->enums : NULL,
+      kTree ? kTree->hint : NULL,
+      kTree ? kTree->units : NULL);
+  netsnmp_ds_set_boolean(NETSNMP_DS_LIBRARY_ID, NETSNMP_DS_LIB_QUICK_PRINT,
+      kQuick);
+  aOut->assign(reinterpret_cast<char*>(buf_), kOutLen);
+  return kOk != 0;
 }
 // }}}
 
-// Handle<Value> SnmpSession::GetNext(const Arguments& args) {{{
-Handle<Value> SnmpSession::GetNext(const Arguments& args) {
-  return PerformRequest(REQ_NEXT, args);
+namespace {
+// bool oidFromV8(...) {{{
+bool oidFromV8(Handle<Value> var, std::vector<oid>* aOid)
+{
+  // handleScope - intentionally omited, use scope from caller
+  SnmpValue* v = SnmpValue::FromV8(var);
+  if (!v) {
+    return oidFromV8Array(Local<Value>::New(var), aOid);
+  }
+  if (v->type() != ASN_OBJECT_ID) {
+    v8::ThrowException(
+        NODE_PSYMBOL("invalid argument - Value is not an oid"));
+    return false;
+  }
+  const std::vector<unsigned char>& kData = v->data();
+  aOid->resize(kData.size() / sizeof(oid));
+  if (!aOid->empty()) {
+    memcpy(&(*aOid)[0], &kData[0], aOid->size() * sizeof(oid));
+  }
+  return true;
 }
 // }}}
 
-// Handle<Value> SnmpSession::GetBulk(const Arguments& args) {{{
-Handle<Value> SnmpSession::GetBulk(const Arguments& args) {
-  return PerformRequest(REQ_BULK, args);
+// Handle<Value> formatToV8(...) {{{
+Handle<Value> formatToV8(const std::vector<oid>& aName, Handle<Value> aValue,
+    Handle<Value> aType)
+{
+  // handleScope - intentionally omited, use scope from caller
+  if (aValue->IsNull() || aValue->IsUndefined()) {
+    return v8::Null();
+  }
+
+  std::string kText;
+  SnmpValue* v = SnmpValue::FromV8(aValue);
+  if (v) {
+    const std::vector<unsigned char>& kData = v->data();
+    SnmpFormatter::format(aName.empty() ? NULL : &aName[0], aName.size(),
+        v->type(),
+        kData.empty() ? NULL : &kData[0], kData.size(), &kText);
+    return String::New(kText.data(), kText.size());
+  }
+
+  // value of primitive result, rebuild it from number and type tag
+  if (!aType->IsUint32()) {
+    return aValue->ToString();
+  }
+  u_char kType = static_cast<u_char>(aType->Uint32Value());
+  if (kType == ASN_COUNTER64) {
+    uint64_t kNum;
+    if (aValue->IsNumber()) {
+      kNum = static_cast<uint64_t>(aValue->NumberValue());
+    } else {
+      kNum = strtoull(*String::Utf8Value(aValue->ToString()), NULL, 10);
+    }
+    struct counter64 c;
+    c.high = static_cast<u_long>(kNum >> 32);
+    c.low = static_cast<u_long>(kNum & 0xFFFFFFFF);
+    SnmpFormatter::format(aName.empty() ? NULL : &aName[0], aName.size(),
+        kType, &c, sizeof(c), &kText);
+  } else if (aValue->IsNumber()) {
+    long kNum = (kType == ASN_INTEGER)
+      ? static_cast<long>(aValue->Int32Value())
+      : static_cast<long>(aValue->Uint32Value());
+    SnmpFormatter::format(aName.empty() ? NULL : &aName[0], aName.size(),
+        kType, &kNum, sizeof(kNum), &kText);
+  } else {
+    return aValue->ToString();
+  }
+  return String::New(kText.data(), kText.size());
 }
 // }}}
+}
 
+// Handle<Value> SnmpValue::Format(const Arguments& args) {{{
+Handle<Value> SnmpValue::Format(const Arguments& args) {
+  HandleScope kScope;
 
-// void SnmpSession::Initialize(Handle<Object> target) {{{
-void SnmpSession::Initialize(Handle<Object> target) {
-  js::HandleScope kScope;
+  SnmpValue* inst = ObjectWrap::Unwrap<SnmpValue>(args.This());
 
-  Local<FunctionTemplate> t = FunctionTemplate::New(SnmpSession::New);
-  constructorTemplate_ = Persistent<FunctionTemplate>::New(t);
-  constructorTemplate_->InstanceTemplate()->SetInternalFieldCount(1);
-  constructorTemplate_->SetClassName(String::NewSymbol("Connection"));
+  // call with (OID the value belongs to)
+  if (args.Length() < 1) {
+    return kScope.Close(v8::ThrowException(NODE_PSYMBOL("missing arguments")));
+  }
+  std::vector<oid> kName;
+  if (!oidFromV8(args[0], &kName)) {
+    return kScope.Close(v8::Undefined());
+  }
 
-  // t->Inherit(EventEmitter::constructor_template);
+  std::string kText;
+  SnmpFormatter::format(kName.empty() ? NULL : &kName[0], kName.size(),
+      inst->type_,
+      inst->data_.empty() ? NULL : &inst->data_[0], inst->data_.size(),
+      &kText);
+  return kScope.Close(String::New(kText.data(), kText.size()));
+}
+// }}}
 
-  NODE_SET_PROTOTYPE_METHOD(t, "Get", SnmpSession::Get);
-  NODE_SET_PROTOTYPE_METHOD(t, "GetNext", SnmpSession::GetNext);
+// v8::Handle<v8::Value> format_values_wrapper(const Arguments& args) {{{
+v8::Handle<v8::Value> format_values_wrapper(const Arguments& args) {
+  HandleScope kScope;
 
-  target->Set(String::NewSymbol("Connection"),
-      constructorTemplate_->GetFunction());
+  // call with (array of { oid, value }) or (array of rows, table, columns)
+  if (args.Length() < 1 || !args[0]->IsArray()) {
+    return kScope.Close(v8::ThrowException(
+          NODE_PSYMBOL("invalid arguments - array expected")));
+  }
+  Local<Array> kInput = Local<Array>::Cast(args[0]);
+  Local<Array> kResult = v8::Array::New(kInput->Length());
+
+  Local<String> kOidSymbol = String::NewSymbol("oid");
+  Local<String> kValueSymbol = String::NewSymbol("value");
+  Local<String> kTypeSymbol = String::NewSymbol("type");
+  Local<String> kIndexSymbol = String::NewSymbol("index");
+  Local<String> kValuesSymbol = String::NewSymbol("values");
+  Local<String> kTypesSymbol = String::NewSymbol("types");
+
+  std::vector<oid> kName;
+
+  if (args.Length() < 2) {
+    for (uint32_t i = 0; i < kInput->Length(); ++i) {
+      Local<Value> kItem = kInput->Get(i);
+      if (!kItem->IsObject()) {
+        return kScope.Close(v8::ThrowException(
+              NODE_PSYMBOL("invalid argument - result must be an object")));
+      }
+      Local<Object> o = kItem->ToObject();
+      if (!oidFromV8(o->Get(kOidSymbol), &kName)) {
+        return kScope.Close(v8::Undefined());
+      }
+      kResult->Set(i,
+          formatToV8(kName, o->Get(kValueSymbol), o->Get(kTypeSymbol)));
+    }
+    return kScope.Close(kResult);
+  }
+
+  // rows of GetTable - value OID is table.1.column.index
+  std::vector<oid> kTable;
+  std::vector<oid> kColumns;
+  std::vector<oid> kIndex;
+  if (!oidFromV8(args[1], &kTable) || !oidFromV8Array(args[2], &kColumns)) {
+    return kScope.Close(v8::Undefined());
+  }
+
+  for (uint32_t i = 0; i < kInput->Length(); ++i) {
+    Local<Value> kItem = kInput->Get(i);
+    if (!kItem->IsObject()) {
+      return kScope.Close(v8::ThrowException(
+            NODE_PSYMBOL("invalid argument - row must be an object")));
+    }
+    Local<Object> kRow = kItem->ToObject();
+    if (!oidFromV8(kRow->Get(kIndexSymbol), &kIndex)) {
+      return kScope.Close(v8::Undefined());
+    }
+    Local<Value> kValuesArg = kRow->Get(kValuesSymbol);
+    if (!kValuesArg->IsArray()) {
+      return kScope.Close(v8::ThrowException(
+            NODE_PSYMBOL("invalid argument - row values must be an array")));
+    }
+    Local<Array> kValues = Local<Array>::Cast(kValuesArg);
+    Local<Value> kTypesArg = kRow->Get(kTypesSymbol);
+    Local<Array> kTypes;
+    if (kTypesArg->IsArray()) {
+      kTypes = Local<Array>::Cast(kTypesArg);
+    }
+
+    Local<Array> kTexts = v8::Array::New(kColumns.size());
+    for (uint32_t j = 0; j < kColumns.size(); ++j) {
+      kName = kTable;
+      kName.push_back(1);
+      kName.push_back(kColumns[j]);
+      kName.insert(kName.end(), kIndex.begin(), kIndex.end());
+      kTexts->Set(j, formatToV8(kName, kValues->Get(j),
+            kTypes.IsEmpty() ? Handle<Value>(v8::Undefined()) : kTypes->Get(j)));
+    }
+    kResult->Set(i, kTexts);
+  }
+  return kScope.Close(kResult);
 }
 // }}}
 
@@ -1241,14 +8173,28 @@ extern "C" void
 init (Handle<Object> target) {
   HandleScope scope;
 
-  init_snmp("asdf");
+  // MIB modules are loaded on demand
+  SnmpMibLoader::initialize("asdf");
 
   SnmpSession::Initialize(target);
   SnmpValue::Initialize(target);
   SnmpResult::Initialize(target);
+  SnmpTrapListener::Initialize(target);
+  SnmpPollScheduler::Initialize(target);
+  SnmpRequestTemplate::Initialize(target);
 
   NODE_SET_METHOD(target, "read_objid", read_objid_wrapper);
   NODE_SET_METHOD(target, "parse_oid", parse_oid_wrapper);
+  NODE_SET_METHOD(target, "batch_io", batch_io_wrapper);
+  NODE_SET_METHOD(target, "set_dns_ttl", set_dns_ttl_wrapper);
+  NODE_SET_METHOD(target, "rates_to_array", rates_to_array_wrapper);
+  NODE_SET_METHOD(target, "set_admission", set_admission_wrapper);
+  NODE_SET_METHOD(target, "admission_state", admission_state_wrapper);
+  NODE_SET_METHOD(target, "trace_enable", trace_enable_wrapper);
+  NODE_SET_METHOD(target, "trace_dump", trace_dump_wrapper);
+  NODE_SET_METHOD(target, "format_values", format_values_wrapper);
+  NODE_SET_METHOD(target, "set_mib_cache", set_mib_cache_wrapper);
+  NODE_SET_METHOD(target, "load_mibs", load_mibs_wrapper);
 }
 
 // vim: ts=2 fdm=marker syntax=cpp expandtab sw=2